@@ -4,6 +4,7 @@
 #include <fstream>
 #include "../../../libraries/protobuf/build/midi.pb.h"
 #include "../compression/lz4.h"
+#include "dataset_index.h"
 
 
 namespace dataset_manipulation {
@@ -11,8 +12,10 @@ namespace dataset_manipulation {
 	private:
 		std::string filepath_;
 		std::string header_filepath_;
+		std::string index_filepath_;
 		std::fstream file_stream_;
 		std::fstream header_file_stream_;
+		IndexWriter index_writer_;
 		midi::Dataset dataset_split_protobuf_;
 		int flush_count_;
 		bool can_write;
@@ -21,6 +24,7 @@ namespace dataset_manipulation {
 		BytesToFile(std::string external_filepath_);
 		void enableWrite();
 		void appendBytesToFileStream(std::string& bytes_as_string, size_t split_id);
+		void flush();
 		void writeFile();
 		void close();
 	};
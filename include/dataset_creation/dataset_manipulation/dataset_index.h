@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../../../src/inference/xxh/xxh3.h"
+
+namespace dataset_manipulation {
+
+	// Append-only index written next to a dataset file (<filepath>.index).
+	// Every record appended to the data file gets a fixed-width IndexEntry,
+	// so appending costs O(1) and the protobuf header is only written on
+	// close. A file cut short by a crash is recovered by keeping the longest
+	// prefix of entries that are complete, pass their checksum and point
+	// inside the data file.
+	//
+	// content_hash is the XXH3 hash of the source of a record (the midi file
+	// for datasets built from midi files, the uncompressed record otherwise),
+	// note_hash that of its canonical note stream when known, 0 otherwise.
+	// num_segments is the number of valid segments of the record, 0 if unknown.
+	const char INDEX_MAGIC[8] = {'M','G','P','T','I','D','X','1'};
+
+	enum IndexEntryKind : uint16_t {
+		INDEX_RECORD = 0,
+		INDEX_PROGRESS = 1 // start holds the number of consumed inputs, content_hash the inputs hash
+	};
+
+#pragma pack(push, 1)
+	struct IndexEntry {
+		uint64_t start;
+		uint32_t length;
+		uint32_t src_size;
+		uint64_t content_hash;
+		uint64_t note_hash;
+		uint32_t num_segments;
+		uint16_t split_id;
+		uint16_t kind;
+		uint32_t reserved;
+		uint32_t checksum;
+	};
+#pragma pack(pop)
+	static_assert(sizeof(IndexEntry) == 48, "IndexEntry must be 48 bytes");
+
+	inline uint64_t fnv1a(const char* data, size_t size, uint64_t h = 14695981039346656037ULL) {
+		for (size_t i = 0; i < size; i++) {
+			h = (h ^ (uint8_t)data[i]) * 1099511628211ULL;
+		}
+		return h;
+	}
+
+	inline uint64_t contentHash(const char* data, size_t size) {
+		return XXH3_64bits(data, size);
+	}
+
+	inline uint32_t indexEntryChecksum(const IndexEntry& entry) {
+		uint64_t h = fnv1a((const char*)&entry, offsetof(IndexEntry, checksum));
+		return (uint32_t)(h ^ (h >> 32));
+	}
+
+	inline IndexEntry makeIndexEntry(uint64_t start, uint32_t length, uint32_t src_size, uint64_t content_hash, uint64_t note_hash, uint32_t num_segments, uint16_t split_id, uint16_t kind) {
+		IndexEntry entry;
+		std::memset(&entry, 0, sizeof(entry));
+		entry.start = start;
+		entry.length = length;
+		entry.src_size = src_size;
+		entry.content_hash = content_hash;
+		entry.note_hash = note_hash;
+		entry.num_segments = num_segments;
+		entry.split_id = split_id;
+		entry.kind = kind;
+		entry.checksum = indexEntryChecksum(entry);
+		return entry;
+	}
+
+	// reads the valid prefix of an index. data_size is the size of the data
+	// file. returns false if there is no index at filepath
+	inline bool readIndex(const std::string& filepath, uint64_t data_size, std::vector<IndexEntry>& entries) {
+		entries.clear();
+		std::ifstream stream(filepath, std::ios::in | std::ios::binary);
+		char magic[sizeof(INDEX_MAGIC)];
+		if ((!stream.is_open()) || (!stream.read(magic, sizeof(magic))) || (std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0)) {
+			return false;
+		}
+		std::error_code ec;
+		uint64_t file_size = std::filesystem::file_size(filepath, ec);
+		if (!ec) {
+			entries.reserve((file_size - sizeof(INDEX_MAGIC)) / sizeof(IndexEntry));
+		}
+		IndexEntry entry;
+		while (stream.read((char*)&entry, sizeof(entry))) {
+			if (entry.checksum != indexEntryChecksum(entry)) {
+				break;
+			}
+			if ((entry.kind == INDEX_RECORD) && (entry.start + entry.length > data_size)) {
+				break;
+			}
+			entries.push_back(entry);
+		}
+		return true;
+	}
+
+	class IndexWriter {
+	private:
+		std::fstream stream_;
+
+	public:
+		// starts a new index, or continues one after its first num_entries
+		void open(const std::string& filepath, bool resume, size_t num_entries) {
+			if (resume) {
+				std::filesystem::resize_file(filepath, sizeof(INDEX_MAGIC) + num_entries * sizeof(IndexEntry));
+				stream_.open(filepath, std::ios::in | std::ios::out | std::ios::binary);
+				stream_.seekp(0, std::ios::end);
+			}
+			else {
+				stream_.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+				stream_.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+			}
+		}
+		void append(const IndexEntry& entry) {
+			stream_.write((const char*)&entry, sizeof(entry));
+		}
+		void flush() {
+			stream_.flush();
+		}
+		void close() {
+			if (stream_.is_open()) {
+				stream_.close();
+			}
+		}
+		bool isOpen() {
+			return stream_.is_open();
+		}
+	};
+}
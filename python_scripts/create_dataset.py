@@ -4,7 +4,6 @@ import json
 import numpy as np
 import csv
 from tqdm import tqdm
-from multiprocessing import Pool
 
 from utils import *
 
@@ -13,22 +12,6 @@ import os
 sys.path.append(os.path.dirname(os.getcwd()) + "/python_lib")
 import midigpt
 
-def worker(args):
-	path,sid,labels,nomml,tcjson,encoding = args
-	tc = midigpt.TrainConfig()
-	tc.from_json(tcjson)
-	labels["nomml"] = nomml
-
-	encoder_mode = midigpt.getEncoderType(encoding)
-	assert encoder_mode is not midigpt.ENCODER_TYPE.NO_ENCODER
-	encoder = midigpt.getEncoder(encoder_mode)
-
-	try:
-		return sid, midigpt.midi_to_json_bytes(path,tc,json.dumps(labels))
-	except Exception as e:
-		print(e)
-		return None,None
-
 def load_json(path):
 	if not os.path.exists(path):
 		return {}
@@ -88,6 +71,11 @@ if __name__ == "__main__":
 	parser.add_argument("--metadata", type=str, required=True)
 	parser.add_argument("--type", type=str, default="Drum+Music")
 	parser.add_argument("--test", type=str, default="no")
+	parser.add_argument("--resume", action="store_true")
+	parser.add_argument("--dedup", action="store_true")
+	parser.add_argument("--lz4_dictionary_size", type=int, default=0)
+	parser.add_argument("--lz4_dictionary_samples", type=int, default=1000)
+	parser.add_argument("--seed", type=int, default=0)
 	args = parser.parse_args()
 
 	args.ignore_score = bool(args.ignore_score)
@@ -102,8 +90,6 @@ if __name__ == "__main__":
 	import os
 	os.system("taskset -p 0xffff %d" % os.getpid())
 
-	# multi thread approach takes about 2 minutes
-	pool = Pool(args.nthreads)
 	output = os.path.splitext(args.output)[0]
 	ss=""
 	if args.max_size > 0:
@@ -113,23 +99,19 @@ if __name__ == "__main__":
 	else:
 		output += "/{}_NUM_BARS={}_RESOLUTION_{}{}.arr".format(args.encoding,args.num_bars,args.resolution,ss)
 	print(output)
-	if not test_script:
-		jag = midigpt.BytesToFile(output)
-	
 
 	paths = list(glob.glob(args.data_dir + "/**/*.mid", recursive=True))
 	
 	import random
-	import time
-	random.seed(int(time.time()))
+	# inputs must come in the same order for --resume
+	random.seed(args.seed)
 
 	tc = midigpt.TrainConfig()
 	tc.num_bars = args.num_bars
 	tc.use_microtiming = args.expressive
 	tc.resolution = args.resolution
 	tc.delta_resolution = args.delta_resolution
-	tc = tc.to_json()
-	print(tc)
+	print(tc.to_json())
 	
 	paths_exp = []
 	sids_exp = []
@@ -197,9 +179,7 @@ if __name__ == "__main__":
 	metadata_labels = [metadata_label_data.get(os.path.splitext(os.path.basename(p))[0],DEFAULT_LABELS) for p in paths]
 	print("LOADED {} METADATA LABELS".format(len(metadata_labels)))
 
-	tcs = [tc for _ in paths]
-	encoding = [args.encoding for _ in paths]
-	inputs = list(zip(paths,sids,metadata_labels,nomml_vals,tcs,encoding))
+	inputs = list(zip(paths,sids,metadata_labels,nomml_vals))
 	random.shuffle(inputs)
 
 	for k,v in DEFAULT_LABELS.items():
@@ -209,18 +189,27 @@ if __name__ == "__main__":
 		inputs = inputs[:args.max_size]
 
 	if not test_script:
-		total_count = 0
-		success_count = 0
-		pool = Pool(args.nthreads)
-		progress_bar = tqdm(pool.imap_unordered(worker, inputs), total=len(inputs))
-		for sid,b in progress_bar:
-			if b is not None and len(b):
-				jag.append_bytes_to_file_stream(b,sid)
-				success_count += 1
-			total_count += 1
-			status_str = "{}/{}".format(success_count,total_count)
-			progress_bar.set_description(status_str)
-		jag.close()
+		labels = []
+		for _,_,label,nomml in inputs:
+			label = dict(label)
+			label["nomml"] = nomml
+			labels.append(json.dumps(label))
+		# the dictionary is trained on the first inputs, so a resumed build
+		# trains the same one
+		lz4_dictionary = b""
+		if args.lz4_dictionary_size > 0:
+			samples = []
+			for (path,_,_,_),label in zip(inputs[:args.lz4_dictionary_samples],labels):
+				try:
+					samples.append(midigpt.midi_to_json_bytes(path, tc, label))
+				except Exception as e:
+					print("{} : {}".format(path, e))
+			lz4_dictionary = midigpt.train_lz4_dictionary([x for x in samples if len(x)], args.lz4_dictionary_size)
+			print("TRAINED A {} BYTE LZ4 DICTIONARY".format(len(lz4_dictionary)))
+		# parses, validates and compresses the files on a native thread pool
+		stats = midigpt.build_dataset(
+			[x[0] for x in inputs], [x[1] for x in inputs], labels, tc, output, args.nthreads, args.resume, args.dedup, lz4_dictionary)
+		print("{}/{} FILES WRITTEN, {} DUPLICATES".format(int(stats["written"]), int(stats["inputs"]), int(stats["duplicates"])))
 	else:
 		print("Test successful")
 		sys.exit(0)
@@ -1,4 +1,5 @@
 from transformers import *
+from transformers.models.gpt2.modeling_gpt2 import GPT2Attention
 import torch.nn as nn
 import torch
 
@@ -101,6 +102,49 @@ class GPT2LMHeadModelCont(GPT2LMHeadModel):
 			labels=labels
 		)
 
+class PackedGPT2Attention(GPT2Attention):
+	# packed_mask, when it is set, holds the (batch,1,query,key) pairs that
+	# may attend and replaces the padding mask. the causal mask is still
+	# applied by GPT2Attention
+	def _attn(self, query, key, value, attention_mask=None, head_mask=None):
+		packed_mask = getattr(self, "packed_mask", None)
+		if packed_mask is not None:
+			attention_mask = (~packed_mask).to(query.dtype) * torch.finfo(query.dtype).min
+		return super()._attn(query, key, value, attention_mask, head_mask)
+
+class GPT2LMHeadModelPacked(GPT2LMHeadModel):
+	# GPT2LMHeadModel for batches with several segments packed into each row
+	# (see Jagged.set_packing). document_ids replace the attention mask, so a
+	# token only attends to earlier tokens of its own segment
+	def __init__(self, config):
+		super().__init__(config)
+		assert not config.reorder_and_upcast_attn
+		for block in self.transformer.h:
+			block.attn.__class__ = PackedGPT2Attention
+
+	def forward(
+		self,
+		input_ids=None,
+		document_ids=None,
+		position_ids=None,
+		labels=None,
+		**kwargs
+	):
+		assert document_ids is not None
+		packed_mask = document_ids[:,None,:,None] == document_ids[:,None,None,:]
+		for block in self.transformer.h:
+			block.attn.packed_mask = packed_mask
+		try:
+			return super().forward(
+				input_ids=input_ids,
+				position_ids=position_ids,
+				labels=labels,
+				**kwargs
+			)
+		finally:
+			for block in self.transformer.h:
+				block.attn.packed_mask = None
+
 if __name__ == "__main__":
 
 	batch_size = 3
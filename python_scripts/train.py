@@ -38,6 +38,8 @@ if __name__ == "__main__":
   parser.add_argument("--max_tracks", type=int, default=12)
   parser.add_argument("--max_seq_len", type=int, default=2048)
   parser.add_argument("--no_max_length", type=int, default=0)
+  parser.add_argument("--packing", action="store_true")
+  parser.add_argument("--sampling", type=str, default="SAMPLE_UNIFORM", choices=["SAMPLE_UNIFORM", "SAMPLE_EPOCH", "SAMPLE_WEIGHTED"])
   parser.add_argument("--resolution", type=int, default=12)
   parser.add_argument("--delta_resolution", type=int, default=1920)
   parser.add_argument("--abs_pos_vocab_size", type=int, default=196)
@@ -68,6 +70,8 @@ if __name__ == "__main__":
   parser.add_argument("--memory_metrics", action="store_true")
 
   args = parser.parse_args()
+  if args.packing and args.arch != "gpt2":
+    parser.error("--packing needs a block-diagonal attention mask, which is only implemented for --arch gpt2")
   args.expressive = (args.encoding == "EXPRESSIVE_ENCODER") and args.expressive
 
   dataset_cls = CustomDataset
@@ -139,7 +143,7 @@ if __name__ == "__main__":
 
   if args.arch == "gpt2":
     config = GPT2Config().from_json_file(args.config)
-    model_cls = GPT2LMHeadModel
+    model_cls = GPT2LMHeadModelPacked if args.packing else GPT2LMHeadModel
   elif args.arch == "xl":
     config = TransfoXLConfig().from_json_file(args.config)
     model_cls = TransfoXLLMHeadModel
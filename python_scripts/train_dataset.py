@@ -15,7 +15,7 @@ sys.path.append(os.path.dirname(os.getcwd()) + "/python_lib")
 import midigpt
 
 class CustomDataset:
-  def __init__(self, split_id=0, is_training=True, batch_size=32, dataset=None, num_bars=4, min_tracks=2, max_tracks=12, max_seq_len=2048, expressive=False, no_max_length=False, resolution=12, encoding=None, pad_value=-100, arch="gpt2", accum_steps=1, batches_per_epoch=1000, overload_batches_per_epoch=None, **kwargs):
+  def __init__(self, split_id=0, is_training=True, batch_size=32, dataset=None, num_bars=4, min_tracks=2, max_tracks=12, max_seq_len=2048, expressive=False, no_max_length=False, resolution=12, encoding=None, pad_value=-100, arch="gpt2", packing=False, sampling="SAMPLE_UNIFORM", accum_steps=1, batches_per_epoch=1000, overload_batches_per_epoch=None, **kwargs):
     # settings
     self.is_training = is_training
     self.batch_size = batch_size // accum_steps
@@ -25,6 +25,7 @@ class CustomDataset:
     self.dataset = list(range(self.batches_per_epoch)) # number of examples ??
     self.pad_value = pad_value
     self.arch = arch
+    self.packing = packing
 
     # create dataloader
     self.dataloader = midigpt.Jagged(dataset)
@@ -32,6 +33,8 @@ class CustomDataset:
     self.dataloader.set_min_tracks(min_tracks)
     self.dataloader.set_max_tracks(max_tracks)
     self.dataloader.set_max_seq_len(max_seq_len)
+    self.dataloader.set_packing(packing)
+    self.dataloader.set_sampling(getattr(midigpt.SAMPLING_MODE, sampling))
     seed = np.random.randint(2**20)
     self.dataloader.set_seed(seed)
     self.encoder_mode = midigpt.getEncoderType(encoding)
@@ -48,17 +51,20 @@ class CustomDataset:
     self.current = 0
   
   def _get_batch(self):
-    input_ids, mask = self.dataloader.read_batch_v2(
-      self.batch_size, self.split_id, self.encoder_mode, self.tc)
-    input_ids = np.array(input_ids)
-    mask = np.array(mask)
-    labels = np.copy(input_ids)
-    labels += (1-mask) * self.pad_value # set masked tokens to pad_value
+    # labels are input_ids with masked tokens set to pad_value
+    input_ids, mask, labels, position_ids, document_ids = self.dataloader.read_batch_numpy(
+      self.batch_size, self.split_id, self.encoder_mode, self.tc, self.pad_value)
     batch = {
       "input_ids" : torch.from_numpy(input_ids), 
       "attention_mask" : torch.from_numpy(mask),
       "labels" : torch.from_numpy(labels)
     }
+    if self.packing:
+      # positions restart at every packed segment and the attention is
+      # block-diagonal over the segments (see GPT2LMHeadModelPacked)
+      batch["position_ids"] = torch.from_numpy(position_ids)
+      batch["document_ids"] = torch.from_numpy(document_ids)
+      batch.pop("attention_mask")
     if self.arch == "xl":
       batch.pop("attention_mask")
       assert np.all(np.sum(mask,axis=1)==self.max_seq_len)
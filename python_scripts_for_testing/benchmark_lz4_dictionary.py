@@ -0,0 +1,25 @@
+import sys, os
+sys.path.append(os.path.dirname(os.getcwd()) + "/python_lib")
+import midigpt
+
+if __name__ == "__main__":
+
+  import argparse
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--dataset", type=str, required=True)
+  parser.add_argument("--train_records", type=int, default=1000)
+  parser.add_argument("--test_records", type=int, default=1000)
+  parser.add_argument("--repeats", type=int, default=10)
+  args = parser.parse_args()
+
+  # dictionaries are trained on the train split and measured on the valid split
+  jag = midigpt.Jagged(args.dataset)
+  n = min(args.train_records, jag.get_split_size(0))
+  samples = [jag.read_bytes(i, 0) for i in range(n)]
+
+  print("{:>10} {:>8} {:>14} {:>16}".format("dict", "ratio", "compress MB/s", "decompress MB/s"))
+  for size in [0, 4096, 16384, 65536]:
+    d = midigpt.train_lz4_dictionary(samples, size) if size else b""
+    result = jag.benchmark_lz4(d, 1, args.test_records, args.repeats)
+    print("{:>10} {:>8.2f} {:>14.1f} {:>16.1f}".format(
+      len(d), result["ratio"], result["compress_mb_per_second"], result["decompress_mb_per_second"]))
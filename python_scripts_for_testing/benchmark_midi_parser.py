@@ -0,0 +1,27 @@
+import sys, os, glob
+sys.path.append(os.path.dirname(os.getcwd()) + "/python_lib")
+import midigpt
+
+if __name__ == "__main__":
+
+  import argparse
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--data_dir", type=str, required=True)
+  parser.add_argument("--max_files", type=int, default=1000)
+  parser.add_argument("--repeats", type=int, default=5)
+  args = parser.parse_args()
+
+  paths = []
+  for ext in ["mid", "midi", "MID", "MIDI"]:
+    paths += glob.glob(os.path.join(args.data_dir, "**/*." + ext), recursive=True)
+  paths = sorted(paths)[:args.max_files]
+
+  # both readers parse the same files from memory, so the numbers do not
+  # include reading from disk
+  result = midigpt.benchmark_midi_parser(paths, args.repeats)
+  print("files : {}".format(int(result["files"])))
+  if "speedup" in result:
+    print("native   : {:>8.1f} MB/s ({} failed)".format(result["native_mb_per_second"], int(result["native_failed"])))
+    print("midifile : {:>8.1f} MB/s ({} failed)".format(result["midifile_mb_per_second"], int(result["midifile_failed"])))
+    print("speedup  : {:>8.2f}".format(result["speedup"]))
+    print("files where the readers disagree : {}".format(int(result["mismatches"])))
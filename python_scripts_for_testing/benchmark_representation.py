@@ -0,0 +1,16 @@
+import sys, os
+sys.path.append(os.path.dirname(os.getcwd()) + "/python_lib")
+import midigpt
+
+if __name__ == "__main__":
+
+  import argparse
+  parser = argparse.ArgumentParser()
+  parser.add_argument("--iterations", type=int, default=1000)
+  args = parser.parse_args()
+
+  e = midigpt.ExpressiveEncoder()
+  result = e.rep.benchmark_lookups(args.iterations)
+  for name in ["encode", "decode", "get_token_type"]:
+    print("{:<16} {:>8.2f} ns   map {:>8.2f} ns   speedup {:.1f}x".format(
+      name, result[name], result[name + "_map"], result[name + "_speedup"]))
@@ -3,9 +3,25 @@
 #include <vector>
 #include <tuple>
 #include <map>
+#include <set>
 #include <random>
 
 namespace data_structures {
+
+    // per-call state of an encoding (bar infilling and augmentation). it is
+    // kept apart from EncoderConfig so that one encoder can serve all threads
+    class EncoderState {
+    public:
+        EncoderState() {
+            do_multi_fill = false;
+            transpose = 0;
+        }
+
+        bool do_multi_fill;
+        int transpose;
+        std::set<std::tuple<int, int>> multi_fill;
+    };
+
     class EncoderConfig {
     public:
         EncoderConfig() {
@@ -56,6 +72,17 @@ namespace data_structures {
             }
         }
 
+        // state used by the encoder calls that do not take an EncoderState.
+        // do_multi_fill, transpose and multi_fill are only kept on the config
+        // for these calls and for the python bindings
+        EncoderState get_state() {
+            EncoderState state;
+            state.do_multi_fill = do_multi_fill;
+            state.transpose = transpose;
+            state.multi_fill = multi_fill;
+            return state;
+        }
+
         int delta_to_step(int delta, int res) {
             if (!use_microtiming) {
                 return 0;
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <bit>
 #include <map>
 #include <set>
+#include <tuple>
 
 #include "representation.h"
 
@@ -88,6 +90,69 @@ void protobuf_set_field(T *message, const std::string &feature_name, U value) {
     }
 }
 
+// a field of a protobuf message, looked up by name once and then read and
+// written through reflection without string lookups. a field that does not
+// exist in the message throws when it is used, like protobuf_get_field_value
+class PROTOBUF_FIELD {
+public:
+    PROTOBUF_FIELD() {}
+    PROTOBUF_FIELD(const google::protobuf::Descriptor *descriptor, const std::string &feature_name) {
+        name = feature_name;
+        fd = descriptor->FindFieldByName(feature_name);
+    }
+
+    int get_value(const google::protobuf::Message &message) const {
+        if (fd == NULL) {
+            throw std::runtime_error("INVALID FIELD NAME");
+        }
+        if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_INT32) {
+            return message.GetReflection()->GetInt32(message, fd);
+        }
+        if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+            return message.GetReflection()->GetEnumValue(message, fd);
+        }
+        std::cout << "field name: " << name << std::endl;
+        throw std::runtime_error("INVALID FIELD TYPE");
+    }
+
+    template <typename U>
+    void set(google::protobuf::Message *message, U value) const {
+        if (fd == NULL) {
+            throw std::runtime_error("INVALID FIELD NAME");
+        }
+        if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_INT32) {
+            message->GetReflection()->SetInt32(message, fd, value);
+        }
+        else if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_BOOL) {
+            message->GetReflection()->SetBool(message, fd, value);
+        }
+        else if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_FLOAT) {
+            message->GetReflection()->SetFloat(message, fd, value);
+        }
+        else if (fd->type() == google::protobuf::FieldDescriptor::Type::TYPE_ENUM) {
+            message->GetReflection()->SetEnumValue(message, fd, value);
+        }
+        else {
+            std::cout << "field name: " << name << std::endl;
+            throw std::runtime_error("INVALID FIELD TYPE");
+        }
+    }
+
+private:
+    const google::protobuf::FieldDescriptor *fd = NULL;
+    std::string name;
+};
+
+// the fields named by an entry of token_types_v2 in each message it is
+// read from or written to
+struct ATTRIBUTE_CONTROL_FIELDS {
+    PROTOBUF_FIELD piece;
+    PROTOBUF_FIELD track;
+    PROTOBUF_FIELD bar;
+    PROTOBUF_FIELD status_track;
+    PROTOBUF_FIELD status_bar;
+};
+
 class TOKEN_COUNTER {
 public:
     TOKEN_COUNTER(midi::TOKEN_TYPE tt) {
@@ -171,6 +236,55 @@ double map(double x, double in_min, double in_max, double out_min, double out_ma
     return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
 
+// The notes and onsets of each track of a piece, built the first time a
+// control asks for them and shared by all the controls computed on the
+// piece. The events of the piece must not change while the cache is used.
+class NOTE_CACHE {
+public:
+    NOTE_CACHE(midi::Piece *x) : x(x), tracks(x->tracks_size()) {}
+
+    // same as util_protobuf::TrackEventsToNotes
+    const std::vector<midi::Note> &notes(int track_num, int *max_tick) {
+        TRACK_CACHE &t = tracks[track_num];
+        if (!t.has_notes) {
+            t.notes = util_protobuf::TrackEventsToNotes(x, track_num, &t.max_tick);
+            t.has_notes = true;
+        }
+        *max_tick = std::max(*max_tick, t.max_tick);
+        return t.notes;
+    }
+
+    // the (time, pitch) of the onsets in each bar of the track
+    const std::vector<std::vector<std::tuple<int,int>>> &bar_onsets(int track_num) {
+        TRACK_CACHE &t = tracks[track_num];
+        if (!t.has_onsets) {
+            const midi::Track &track = x->tracks(track_num);
+            t.bar_onsets.resize(track.bars_size());
+            for (int bar_num=0; bar_num<track.bars_size(); bar_num++) {
+                for (const auto &event_index : track.bars(bar_num).events()) {
+                    const midi::Event &event = x->events(event_index);
+                    if (event.velocity()) {
+                        t.bar_onsets[bar_num].push_back(std::make_tuple(event.time(), event.pitch()));
+                    }
+                }
+            }
+            t.has_onsets = true;
+        }
+        return t.bar_onsets;
+    }
+
+private:
+    struct TRACK_CACHE {
+        bool has_notes = false;
+        std::vector<midi::Note> notes;
+        int max_tick = 0;
+        bool has_onsets = false;
+        std::vector<std::vector<std::tuple<int,int>>> bar_onsets;
+    };
+    midi::Piece *x;
+    std::vector<TRACK_CACHE> tracks;
+};
+
 class ATTRIBUTE_CONTROL {
 public:
 
@@ -180,31 +294,57 @@ public:
     std::vector<std::tuple<midi::TOKEN_TYPE,int,std::string>> token_types_v2;
     std::vector<std::tuple<midi::TOKEN_TYPE,int,int>> token_types_v3;
     bool precompute_on_piece;
+    std::vector<ATTRIBUTE_CONTROL_FIELDS> fields; // one for each entry of token_types_v2
 
     virtual ~ATTRIBUTE_CONTROL () {}
 
+    // looks up the fields of token_types_v2 once, so that the token and mask
+    // functions called for every track and bar do not search them by name.
+    // called by makeAttributeControl() once the control is constructed
+    void resolve_fields() {
+        fields.clear();
+        for (const auto &fn : token_types_v2) {
+            const std::string &name = std::get<2>(fn);
+            ATTRIBUTE_CONTROL_FIELDS f;
+            f.piece = PROTOBUF_FIELD(midi::PieceFeatures::descriptor(), name);
+            f.track = PROTOBUF_FIELD(midi::TrackFeatures::descriptor(), name);
+            f.bar = PROTOBUF_FIELD(midi::BarFeatures::descriptor(), name);
+            f.status_track = PROTOBUF_FIELD(midi::StatusTrack::descriptor(), name);
+            f.status_bar = PROTOBUF_FIELD(midi::StatusBar::descriptor(), name);
+            fields.push_back(f);
+        }
+    }
+
     virtual void compute_piece_features(midi::Piece *x, midi::PieceFeatures *pf) {
         // this function is responsible for computing the features that are needed for
         // this form of attribute control
         throw std::runtime_error("ATTRIBUTE CONTROL CLASS MUST DEFINE compute_piece_features()");
     }
 
-    virtual void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
+    virtual void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         // this function is responsible for computing the features that are needed for
         // this form of attribute control
         throw std::runtime_error("ATTRIBUTE CONTROL CLASS MUST DEFINE compute_track_features()");
     }
 
-    virtual void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf) {
+    virtual void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf, NOTE_CACHE *cache) {
         // this function is responsible for computing the features that are needed for
         // this form of attribute control
         throw std::runtime_error("ATTRIBUTE CONTROL CLASS MUST DEFINE compute_bar_features()");
     }
 
+    // training examples of pitched tracks can be transposed after the
+    // features are computed. controls whose values are pitches shift them by
+    // the same amount, either in the features or in already encoded track
+    // tokens (token shards store encoded track headers)
+    virtual void transpose_track_features(midi::TrackFeatures *tf, int transpose) {}
+
+    virtual void transpose_track_tokens(const std::shared_ptr<REPRESENTATION> &rep, int *tokens, int size, int transpose) {}
+
     virtual void append_piece_tokens(data_structures::TokenSequence *tokens, const std::shared_ptr<REPRESENTATION> &rep, midi::PieceFeatures *pf) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                tokens->push_back( rep->encode(std::get<0>(fn), protobuf_get_field_value(pf, std::get<2>(fn))) );
+            for (size_t i=0; i<token_types_v2.size(); i++) {
+                tokens->push_back( rep->encode(std::get<0>(token_types_v2[i]), fields[i].piece.get_value(*pf)) );
             }
         }
         else {
@@ -214,8 +354,8 @@ public:
 
     virtual void append_track_tokens(data_structures::TokenSequence *tokens, const std::shared_ptr<REPRESENTATION> &rep, midi::TrackFeatures *tf) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                tokens->push_back( rep->encode(std::get<0>(fn), protobuf_get_field_value(tf, std::get<2>(fn))) );
+            for (size_t i=0; i<token_types_v2.size(); i++) {
+                tokens->push_back( rep->encode(std::get<0>(token_types_v2[i]), fields[i].track.get_value(*tf)) );
             }
         }
         else {
@@ -225,8 +365,8 @@ public:
 
     virtual void append_bar_tokens(data_structures::TokenSequence *tokens, const std::shared_ptr<REPRESENTATION> &rep, midi::BarFeatures *bf) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                tokens->push_back( rep->encode(std::get<0>(fn), protobuf_get_field_value(bf, std::get<2>(fn))) );
+            for (size_t i=0; i<token_types_v2.size(); i++) {
+                tokens->push_back( rep->encode(std::get<0>(token_types_v2[i]), fields[i].bar.get_value(*bf)) );
             }
         }
         else {
@@ -241,8 +381,8 @@ public:
 
     virtual void set_track_mask(const std::shared_ptr<REPRESENTATION> &rep, std::vector<int> &mask, midi::StatusTrack *track) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                rep->set_mask(std::get<0>(fn), {protobuf_get_field_value(track, std::get<2>(fn))-1}, mask, 1);
+            for (size_t i=0; i<token_types_v2.size(); i++) {
+                rep->set_mask(std::get<0>(token_types_v2[i]), {fields[i].status_track.get_value(*track)-1}, mask, 1);
             }
         }
         else {
@@ -252,8 +392,8 @@ public:
 
     virtual void set_bar_mask(const std::shared_ptr<REPRESENTATION> &rep, std::vector<int> &mask, midi::StatusBar *bar) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                rep->set_mask(std::get<0>(fn), {protobuf_get_field_value(bar, std::get<2>(fn))-1}, mask, 1);
+            for (size_t i=0; i<token_types_v2.size(); i++) {
+                rep->set_mask(std::get<0>(token_types_v2[i]), {fields[i].status_bar.get_value(*bar)-1}, mask, 1);
             }
         }
         else {
@@ -263,10 +403,10 @@ public:
 
     virtual void override_track_feature(midi::TrackFeatures *tf, midi::StatusTrack *track) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                auto value = protobuf_get_field_value(track, std::get<2>(fn));
+            for (const auto &f : fields) {
+                auto value = f.status_track.get_value(*track);
                 if (value > 0) {
-                    protobuf_set_field(tf, std::get<2>(fn), value - 1); // copy value from status to piece
+                    f.track.set(tf, value - 1); // copy value from status to piece
                 }
             }
         }
@@ -277,10 +417,10 @@ public:
 
     virtual void override_bar_feature(midi::BarFeatures *bf, midi::StatusBar *bar) {
         if (token_types_v2.size() > 0) {
-            for (const auto &fn : token_types_v2) {
-                auto value = protobuf_get_field_value(bar, std::get<2>(fn));
+            for (const auto &f : fields) {
+                auto value = f.status_bar.get_value(*bar);
                 if (value > 0) {
-                    protobuf_set_field(bf, std::get<2>(fn), value - 1); // copy value from status to piece
+                    f.bar.set(bf, value - 1); // copy value from status to piece
                 }
             }
         }
@@ -333,36 +473,41 @@ public:
         compute_piece_features(x, pf);
     }
 
-    void compute_track_level_features(midi::Piece *x) {
+    void compute_track_level_features(midi::Piece *x, NOTE_CACHE *cache) {
         for (int track_num=0; track_num<x->tracks_size(); track_num++) {
             midi::TrackFeatures *tf = util_protobuf::GetTrackFeatures(x,track_num);
-            compute_track_features(x, track_num, tf);
+            compute_track_features(x, track_num, tf, cache);
         }
     }
 
-    void compute_bar_level_features(midi::Piece *x) {
+    void compute_bar_level_features(midi::Piece *x, NOTE_CACHE *cache) {
         for (int track_num=0; track_num<x->tracks_size(); track_num++) {
             midi::Track *track = x->mutable_tracks(track_num);
             for (int bar_num=0; bar_num<track->bars_size(); bar_num++) {
                 midi::BarFeatures *bf = util_protobuf::GetBarFeatures(track, bar_num);
-                compute_bar_features(x, track_num, bar_num, bf);
+                compute_bar_features(x, track_num, bar_num, bf, cache);
             }
         }
     }
 
     void compute_features(midi::Piece *x) {
+        NOTE_CACHE cache(x);
+        compute_features(x, &cache);
+    }
+
+    void compute_features(midi::Piece *x, NOTE_CACHE *cache) {
         switch(control_level) {
             case ATTRIBUTE_CONTROL_LEVEL_PIECE:
                 compute_piece_level_features(x);
                 break;
             case ATTRIBUTE_CONTROL_LEVEL_TRACK:
-                compute_track_level_features(x);
+                compute_track_level_features(x, cache);
                 break;
             case ATTRIBUTE_CONTROL_LEVEL_TRACK_PRE_INSTRUMENT:
-                compute_track_level_features(x);
+                compute_track_level_features(x, cache);
                 break;
             case ATTRIBUTE_CONTROL_LEVEL_BAR:
-                compute_bar_level_features(x);
+                compute_bar_level_features(x, cache);
                 break;
             default:
                 throw std::runtime_error("INVALID ATTRIBUTE CONTROL LEVEL");
@@ -523,19 +668,18 @@ public:
     }
     ~TrackLevelOnsetPolyphony() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
+        const midi::Track &track = x->tracks(track_num);
+        const auto &bar_onsets = cache->bar_onsets(track_num);
         tf->mutable_attribute_control_distributions()->clear_onset_polyphony();
 
         int bar_start = 0;
         std::map<int,int> concurrent_onsets;
-        for (const auto &bar : track.bars()) {
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    concurrent_onsets[bar_start + x->events(event_index).time()] += 1;
-                }
+        for (int bar_num=0; bar_num<track.bars_size(); bar_num++) {
+            for (const auto &onset : bar_onsets[bar_num]) {
+                concurrent_onsets[bar_start + std::get<0>(onset)] += 1;
             }
-            bar_start += x->resolution() * bar.internal_beat_length();
+            bar_start += x->resolution() * track.bars(bar_num).internal_beat_length();
         }
 
         int polyphony_min = INT_MAX;
@@ -556,7 +700,8 @@ public:
 
 
     double evaluate_track_feature(midi::Piece *x, int track_num, midi::TrackFeatures *tf, midi::StatusTrack *st) {
-        compute_track_features(x, track_num, tf);
+        NOTE_CACHE cache(x);
+        compute_track_features(x, track_num, tf, &cache);
         auto mapping = get_status_enum_mapping();
         auto domain = get_status_track_enum_domain();
         double range_min = mapping["onset_polyphony_min"][domain["onset_polyphony_min"][protobuf_get_field_value(st, "onset_polyphony_min")]];
@@ -598,13 +743,12 @@ public:
     }
     ~TrackLevelNoteDuration() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         // add in the note duration distribution for testing at some point ...
-        const auto track = x->tracks(track_num);
         tf->mutable_attribute_control_distributions()->note_duration();
 
         int max_tick = 0;
-        std::vector<midi::Note> notes = util_protobuf::TrackEventsToNotes(x, track_num, &max_tick);
+        const std::vector<midi::Note> &notes = cache->notes(track_num, &max_tick);
 
         // get note durations
         std::vector<int> durations;
@@ -631,7 +775,8 @@ public:
     }
 
     double evaluate_track_feature(midi::Piece *x, int track_num, midi::TrackFeatures *tf, midi::StatusTrack *st) {
-        compute_track_features(x, track_num, tf);
+        NOTE_CACHE cache(x);
+        compute_track_features(x, track_num, tf, &cache);
         std::map<int,std::string> mapping = {
             {0,"contains_note_duration_thirty_second"},
             {1,"contains_note_duration_sixteenth"},
@@ -671,17 +816,14 @@ public:
     }
     ~TrackLevelOnsetDensity() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         tf->mutable_attribute_control_distributions()->clear_onset_density();
 
         std::vector<int> unique_onsets_per_bar;
-        for (const auto &bar : track.bars()) {
+        for (const auto &onsets : cache->bar_onsets(track_num)) {
             std::set<int> unique_onsets;
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    unique_onsets.insert(x->events(event_index).time());
-                }
+            for (const auto &onset : onsets) {
+                unique_onsets.insert(std::get<0>(onset));
             }
             unique_onsets_per_bar.push_back( util_protobuf::clip((int)unique_onsets.size(), 0, get_token_domain_size(midi::TOKEN_TRACK_LEVEL_ONSET_DENSITY_MIN)-1) ); // 18 classes
         }
@@ -703,7 +845,8 @@ public:
     }
 
     double evaluate_track_feature(midi::Piece *x, int track_num, midi::TrackFeatures *tf, midi::StatusTrack *st) {
-        compute_track_features(x, track_num, tf);
+        NOTE_CACHE cache(x);
+        compute_track_features(x, track_num, tf, &cache);
         auto mapping = get_status_enum_mapping();
         auto domain = get_status_track_enum_domain();
         double range_min = mapping["onset_density_min"][domain["onset_density_min"][protobuf_get_field_value(st, "onset_density_min")]];
@@ -735,15 +878,10 @@ public:
     }
     ~BarLevelOnsetPolyphony() {}
 
-    void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf) {
-        const auto track = x->tracks(track_num);
-        const auto bar = track.bars(bar_num);
-
+    void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf, NOTE_CACHE *cache) {
         std::map<int,int> concurrent_onsets;
-        for (const auto &event_index : bar.events()) {
-            if (x->events(event_index).velocity()) {
-                concurrent_onsets[x->events(event_index).time()] += 1;
-            }
+        for (const auto &onset : cache->bar_onsets(track_num)[bar_num]) {
+            concurrent_onsets[std::get<0>(onset)] += 1;
         }
 
         // get the min and max of concurrent onsets
@@ -781,15 +919,10 @@ public:
     }
     ~BarLevelOnsetDensity() {}
 
-    void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf) {
-        const auto track = x->tracks(track_num);
-        const auto bar = track.bars(bar_num);
-
+    void compute_bar_features(midi::Piece *x, int track_num, int bar_num, midi::BarFeatures *bf, NOTE_CACHE *cache) {
         std::set<int> unique_onsets;
-        for (const auto &event_index : bar.events()) {
-            if (x->events(event_index).velocity()) {
-                unique_onsets.insert(x->events(event_index).time());
-            }
+        for (const auto &onset : cache->bar_onsets(track_num)[bar_num]) {
+            unique_onsets.insert(std::get<0>(onset));
         }
         
         bf->set_onset_density(util_protobuf::clip(
@@ -815,12 +948,11 @@ public:
     }
     ~PolyphonyQuantile() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         tf->mutable_attribute_control_distributions()->clear_polyphony_quantile();
 
         int max_tick = 0;
-        std::vector<midi::Note> notes = util_protobuf::TrackEventsToNotes(x, track_num, &max_tick);
+        const std::vector<midi::Note> &notes = cache->notes(track_num, &max_tick);
 		int nonzero_count = 0;
 		double count = 0;
 		std::vector<int> flat_roll(max_tick, 0);
@@ -867,12 +999,11 @@ public:
     }
     ~NoteDurationQuantile() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         tf->mutable_attribute_control_distributions()->clear_note_duration_quantile();
 
         int max_tick = 0;
-        std::vector<midi::Note> notes = util_protobuf::TrackEventsToNotes(x, track_num, &max_tick);
+        const std::vector<midi::Note> &notes = cache->notes(track_num, &max_tick);
 
         // get note durations
         std::vector<int> durations;
@@ -906,23 +1037,17 @@ public:
     }
     ~NoteDensity() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
+        const midi::Track &track = x->tracks(track_num);
 
         // calculate average notes per bar
         int num_notes = 0;
-        int bar_num = 0;
-        std::set<int> valid_bars;
-        for (const auto &bar : track.bars()) {
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    valid_bars.insert(bar_num);
-                    num_notes++;
-                }
-            }
-            bar_num++;
+        int valid_bars = 0;
+        for (const auto &onsets : cache->bar_onsets(track_num)) {
+            valid_bars += (int)(onsets.size() > 0);
+            num_notes += onsets.size();
         }
-        int num_bars = std::max((int)valid_bars.size(), 1);
+        int num_bars = std::max(valid_bars, 1);
         double av_notes_fp = (double)num_notes / num_bars;
         int av_notes = round(av_notes_fp);
 
@@ -962,20 +1087,17 @@ public:
     }
     ~PitchRange() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
-        const auto track = x->tracks(track_num);
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         int min_pitch = 127;
         int max_pitch = 0;
-        for (const auto &bar : track.bars()) {
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    int pitch = x->events(event_index).pitch();
-                    if (pitch < min_pitch) {
-                        min_pitch = pitch;
-                    }
-                    if (pitch > max_pitch) {
-                        max_pitch = pitch;
-                    }
+        for (const auto &onsets : cache->bar_onsets(track_num)) {
+            for (const auto &onset : onsets) {
+                int pitch = std::get<1>(onset);
+                if (pitch < min_pitch) {
+                    min_pitch = pitch;
+                }
+                if (pitch > max_pitch) {
+                    max_pitch = pitch;
                 }
             }
         }
@@ -983,6 +1105,36 @@ public:
         tf->set_max_pitch(max_pitch);
     }
 
+    void transpose_track_features(midi::TrackFeatures *tf, int transpose) {
+        // a track without notes keeps min_pitch > max_pitch
+        if (tf->min_pitch() <= tf->max_pitch()) {
+            tf->set_min_pitch(std::clamp(tf->min_pitch() + transpose, 0, 127));
+            tf->set_max_pitch(std::clamp(tf->max_pitch() + transpose, 0, 127));
+        }
+    }
+
+    void transpose_track_tokens(const std::shared_ptr<REPRESENTATION> &rep, int *tokens, int size, int transpose) {
+        int *min_token = NULL;
+        int *max_token = NULL;
+        for (int i=0; i<size; i++) {
+            midi::TOKEN_TYPE tt = rep->get_token_type(tokens[i]);
+            if (tt == midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MIN) {
+                min_token = &tokens[i];
+            }
+            else if (tt == midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MAX) {
+                max_token = &tokens[i];
+            }
+        }
+        if ((min_token) && (max_token)) {
+            midi::TrackFeatures tf;
+            tf.set_min_pitch(rep->decode(*min_token));
+            tf.set_max_pitch(rep->decode(*max_token));
+            transpose_track_features(&tf, transpose);
+            *min_token = rep->encode(midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MIN, tf.min_pitch());
+            *max_token = rep->encode(midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MAX, tf.max_pitch());
+        }
+    }
+
     void append_track_tokens(data_structures::TokenSequence *tokens, const std::shared_ptr<REPRESENTATION> &rep, midi::TrackFeatures *tf) {
         tokens->push_back( rep->encode(midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MIN, tf->min_pitch()) );
         tokens->push_back( rep->encode(midi::TOKEN_TRACK_LEVEL_PITCH_RANGE_MAX, tf->max_pitch()) );
@@ -1010,7 +1162,7 @@ public:
     }
     ~Genre() {}
 
-    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf) {
+    void compute_track_features(midi::Piece *x, int track_num, midi::TrackFeatures *tf, NOTE_CACHE *cache) {
         auto metadata_label = x->internal_metadata_labels().genre();
         if (metadata_label == midi::GENRE_MUSICMAP_ANY) {
             metadata_label = midi::GENRE_MUSICMAP_NONE;
@@ -1040,25 +1192,30 @@ public:
 // ================================================
 // ================================================
 
-std::unique_ptr<ATTRIBUTE_CONTROL> getAttributeControl(midi::ATTRIBUTE_CONTROL_TYPE ac_type) {
+std::unique_ptr<ATTRIBUTE_CONTROL> makeAttributeControl(midi::ATTRIBUTE_CONTROL_TYPE ac_type) {
+    std::unique_ptr<ATTRIBUTE_CONTROL> ac;
     switch(ac_type) {
-        case midi::ATTRIBUTE_CONTROL_NOTE_DENSITY: return std::make_unique<NoteDensity>();
-        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_ONSET_POLYPHONY: return std::make_unique<TrackLevelOnsetPolyphony>();
-        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_ONSET_DENSITY: return std::make_unique<TrackLevelOnsetDensity>();
-        case midi::ATTRIBUTE_CONTROL_PITCH_RANGE: return std::make_unique<PitchRange>();
-        case midi::ATTRIBUTE_CONTROL_GENRE: return std::make_unique<Genre>();
+        case midi::ATTRIBUTE_CONTROL_NOTE_DENSITY: ac = std::make_unique<NoteDensity>(); break;
+        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_ONSET_POLYPHONY: ac = std::make_unique<TrackLevelOnsetPolyphony>(); break;
+        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_ONSET_DENSITY: ac = std::make_unique<TrackLevelOnsetDensity>(); break;
+        case midi::ATTRIBUTE_CONTROL_PITCH_RANGE: ac = std::make_unique<PitchRange>(); break;
+        case midi::ATTRIBUTE_CONTROL_GENRE: ac = std::make_unique<Genre>(); break;
 
-        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_NOTE_DURATION: return std::make_unique<TrackLevelNoteDuration>();
+        case midi::ATTRIBUTE_CONTROL_TRACK_LEVEL_NOTE_DURATION: ac = std::make_unique<TrackLevelNoteDuration>(); break;
 
-        case midi::ATTRIBUTE_CONTROL_POLYPHONY_QUANTILE: return std::make_unique<PolyphonyQuantile>();
-        case midi::ATTRIBUTE_CONTROL_NOTE_DURATION_QUANTILE: return std::make_unique<NoteDurationQuantile>();
+        case midi::ATTRIBUTE_CONTROL_POLYPHONY_QUANTILE: ac = std::make_unique<PolyphonyQuantile>(); break;
+        case midi::ATTRIBUTE_CONTROL_NOTE_DURATION_QUANTILE: ac = std::make_unique<NoteDurationQuantile>(); break;
 
-        case midi::ATTRIBUTE_CONTROL_BAR_LEVEL_ONSET_DENSITY: return std::make_unique<BarLevelOnsetDensity>();
-        case midi::ATTRIBUTE_CONTROL_BAR_LEVEL_ONSET_POLYPHONY: return std::make_unique<BarLevelOnsetPolyphony>();
+        case midi::ATTRIBUTE_CONTROL_BAR_LEVEL_ONSET_DENSITY: ac = std::make_unique<BarLevelOnsetDensity>(); break;
+        case midi::ATTRIBUTE_CONTROL_BAR_LEVEL_ONSET_POLYPHONY: ac = std::make_unique<BarLevelOnsetPolyphony>(); break;
         case midi::ATTRIBUTE_CONTROL_END:
             throw std::runtime_error("encoder::getAttributeControl() midi::ATTRIBUTE_CONTROL_END is an invalid argument."); 
     }
-    throw std::runtime_error("encoder::getAttributeControl() switch statement missing case.");
+    if (!ac) {
+        throw std::runtime_error("encoder::getAttributeControl() switch statement missing case.");
+    }
+    ac->resolve_fields();
+    return ac;
 }
 
 std::unique_ptr<ATTRIBUTE_CONTROL> getAttributeControlStr(std::string &ac_type) {
@@ -1067,22 +1224,40 @@ std::unique_ptr<ATTRIBUTE_CONTROL> getAttributeControlStr(std::string &ac_type)
     if (value_descriptor == NULL) {
         throw std::runtime_error("encoder::getAttributeControlStr() invalid attribute control type.");
     }
-    return getAttributeControl(static_cast<midi::ATTRIBUTE_CONTROL_TYPE>(value_descriptor->index()));
+    return makeAttributeControl(static_cast<midi::ATTRIBUTE_CONTROL_TYPE>(value_descriptor->index()));
 }
 
-std::vector<std::unique_ptr<ATTRIBUTE_CONTROL>> getAttributeControls() {
-    std::vector<std::unique_ptr<ATTRIBUTE_CONTROL>> acs;
-    for(int i=0; i<midi::ATTRIBUTE_CONTROL_END; i++){
-        acs.push_back(getAttributeControl(static_cast<midi::ATTRIBUTE_CONTROL_TYPE>(i)));
-    }
+// the controls hold no state once constructed, so there is one of each,
+// indexed by midi::ATTRIBUTE_CONTROL_TYPE
+const std::vector<std::unique_ptr<ATTRIBUTE_CONTROL>> &getAttributeControls() {
+    static const std::vector<std::unique_ptr<ATTRIBUTE_CONTROL>> acs = [] {
+        std::vector<std::unique_ptr<ATTRIBUTE_CONTROL>> acs;
+        for(int i=0; i<midi::ATTRIBUTE_CONTROL_END; i++){
+            acs.push_back(makeAttributeControl(static_cast<midi::ATTRIBUTE_CONTROL_TYPE>(i)));
+        }
+        return acs;
+    }();
     return acs;
 }
 
-std::vector<midi::TOKEN_TYPE> getAttributeControlTokenTypes() {
-    std::vector<midi::TOKEN_TYPE> token_types;
-    for (const auto &ac : getAttributeControls()) {
-        token_types.push_back(ac->get_token_types()[0]);
+ATTRIBUTE_CONTROL *getAttributeControl(midi::ATTRIBUTE_CONTROL_TYPE ac_type) {
+    if (ac_type == midi::ATTRIBUTE_CONTROL_END) {
+        throw std::runtime_error("encoder::getAttributeControl() midi::ATTRIBUTE_CONTROL_END is an invalid argument.");
+    }
+    if ((ac_type < 0) || (ac_type > midi::ATTRIBUTE_CONTROL_END)) {
+        throw std::runtime_error("encoder::getAttributeControl() switch statement missing case.");
     }
+    return getAttributeControls()[ac_type].get();
+}
+
+const std::vector<midi::TOKEN_TYPE> &getAttributeControlTokenTypes() {
+    static const std::vector<midi::TOKEN_TYPE> token_types = [] {
+        std::vector<midi::TOKEN_TYPE> token_types;
+        for (const auto &ac : getAttributeControls()) {
+            token_types.push_back(ac->get_token_types()[0]);
+        }
+        return token_types;
+    }();
     return token_types;
 }
 
@@ -1268,13 +1443,63 @@ void override_attribute_controls(const std::shared_ptr<REPRESENTATION> &rep, mid
     }
 }
 
+// computes the controls in a single pass over the tracks and bars of the
+// piece, sharing the notes of each track between the controls
+void compute_attribute_controls(const std::vector<ATTRIBUTE_CONTROL*> &acs, midi::Piece *x) {
+    std::vector<ATTRIBUTE_CONTROL*> track_acs;
+    std::vector<ATTRIBUTE_CONTROL*> bar_acs;
+    for (const auto &ac : acs) {
+        switch(ac->control_level) {
+            case ATTRIBUTE_CONTROL_LEVEL_PIECE:
+                ac->compute_piece_level_features(x);
+                break;
+            case ATTRIBUTE_CONTROL_LEVEL_TRACK:
+            case ATTRIBUTE_CONTROL_LEVEL_TRACK_PRE_INSTRUMENT:
+                track_acs.push_back(ac);
+                break;
+            case ATTRIBUTE_CONTROL_LEVEL_BAR:
+                bar_acs.push_back(ac);
+                break;
+            default:
+                throw std::runtime_error("INVALID ATTRIBUTE CONTROL LEVEL");
+        }
+    }
+    if ((track_acs.size() == 0) && (bar_acs.size() == 0)) {
+        return;
+    }
+
+    NOTE_CACHE cache(x);
+    for (int track_num=0; track_num<x->tracks_size(); track_num++) {
+        if (track_acs.size()) {
+            midi::TrackFeatures *tf = util_protobuf::GetTrackFeatures(x, track_num);
+            for (const auto &ac : track_acs) {
+                ac->compute_track_features(x, track_num, tf, &cache);
+            }
+        }
+        if (bar_acs.size()) {
+            midi::Track *track = x->mutable_tracks(track_num);
+            for (int bar_num=0; bar_num<track->bars_size(); bar_num++) {
+                midi::BarFeatures *bf = util_protobuf::GetBarFeatures(track, bar_num);
+                for (const auto &ac : bar_acs) {
+                    ac->compute_bar_features(x, track_num, bar_num, bf, &cache);
+                }
+            }
+        }
+    }
+}
+
 void compute_attribute_controls(const std::shared_ptr<REPRESENTATION> &rep, midi::Piece *x) {
+    std::vector<ATTRIBUTE_CONTROL*> acs;
     for (const auto &kv : rep->token_domains) {
         auto ac_type = getAttributeControlTypeFromToken(kv.first);
         if (ac_type != midi::ATTRIBUTE_CONTROL_END) {
-            getAttributeControl(ac_type)->compute_features(x);
+            ATTRIBUTE_CONTROL *ac = getAttributeControl(ac_type);
+            if (std::find(acs.begin(), acs.end(), ac) == acs.end()) {
+                acs.push_back(ac);
+            }
         }
     }
+    compute_attribute_controls(acs, x);
 }
 
 void compute_piece_level_attribute_controls(const std::shared_ptr<REPRESENTATION> &rep, midi::Piece *x) {
@@ -1292,9 +1517,11 @@ void compute_piece_level_attribute_controls(const std::shared_ptr<REPRESENTATION
 std::string compute_all_attribute_controls_py(std::string &piece_json) {
     midi::Piece piece;
     util_protobuf::string_to_protobuf(piece_json, &piece);
+    std::vector<ATTRIBUTE_CONTROL*> acs;
     for (const auto &ac : getAttributeControls()) {
-        ac->compute_features(&piece);
+        acs.push_back(ac.get());
     }
+    compute_attribute_controls(acs, &piece);
     return util_protobuf::protobuf_to_string(&piece);
 }
 
@@ -1328,6 +1555,22 @@ void append_track_tokens(data_structures::TokenSequence *tokens, const std::shar
     }
 }
 
+// shifts the pitch valued features of a pitched track whose notes are
+// transposed by transpose
+void transpose_track_features(midi::TrackFeatures *tf, int transpose) {
+    for (const auto &ac : getAttributeControls()) {
+        ac->transpose_track_features(tf, transpose);
+    }
+}
+
+// token counterpart of transpose_track_features, for the encoded header of
+// a pitched track
+void transpose_track_tokens(const std::shared_ptr<REPRESENTATION> &rep, int *tokens, int size, int transpose) {
+    for (const auto &ac : getAttributeControls()) {
+        ac->transpose_track_tokens(rep, tokens, size, transpose);
+    }
+}
+
 void append_bar_tokens(data_structures::TokenSequence *tokens, const std::shared_ptr<REPRESENTATION> &rep, midi::BarFeatures *bf, bool is_drum) {
     // order of tokens is important here
     for (const auto &tt : getAttributeControlTokenTypes()) {
@@ -22,6 +22,147 @@ std::vector<T> operator+(std::vector<T> const &x, std::vector<T> const &y) {
   return vec;
 }
 
+// Vocabulary layout of the default ExpressiveEncoder scheme. The
+// REPRESENTATION built from the spec is checked against this table once
+// before it is shared, so a change to the spec that moves tokens fails loudly
+// instead of silently invalidating trained models. The encoder then encodes
+// and decodes the notes of the default scheme with TOKEN_CODER, whose offsets
+// are compile-time constants.
+namespace expressive_layout {
+
+  struct TOKEN_SPAN {
+    midi::TOKEN_TYPE tt;
+    int size;
+    bool range; // values are [0,size) and map directly onto the tokens
+  };
+
+  constexpr TOKEN_SPAN SPANS[] = {
+    {midi::TOKEN_PIECE_START, 2, true},
+    {midi::TOKEN_NUM_BARS, 2, false},
+    {midi::TOKEN_BAR, 1, true},
+    {midi::TOKEN_BAR_END, 1, true},
+    {midi::TOKEN_TIME_SIGNATURE, 36, false},
+    {midi::TOKEN_TRACK, 2, false},
+    {midi::TOKEN_TRACK_END, 1, true},
+    {midi::TOKEN_INSTRUMENT, 109, false},
+    {midi::TOKEN_NOTE_ONSET, 128, true},
+    {midi::TOKEN_NOTE_DURATION, 96, true},
+    {midi::TOKEN_TIME_ABSOLUTE_POS, 192, true},
+    {midi::TOKEN_FILL_IN_PLACEHOLDER, 1, true},
+    {midi::TOKEN_FILL_IN_START, 1, true},
+    {midi::TOKEN_FILL_IN_END, 1, true},
+    {midi::TOKEN_DELTA, 96, true},
+    {midi::TOKEN_DELTA_DIRECTION, 1, true},
+    {midi::TOKEN_VELOCITY_LEVEL, 128, true},
+    {midi::TOKEN_MIN_NOTE_DURATION, 6, true},
+    {midi::TOKEN_MAX_NOTE_DURATION, 6, true},
+    {midi::TOKEN_MIN_POLYPHONY, 10, true},
+    {midi::TOKEN_MAX_POLYPHONY, 10, true},
+    {midi::TOKEN_DENSITY_LEVEL, 10, true},
+  };
+
+  constexpr int NUM_SPANS = sizeof(SPANS) / sizeof(SPANS[0]);
+
+  // first token of tt, -1 if tt is not in the layout
+  constexpr int offset(midi::TOKEN_TYPE tt) {
+    int offset = 0;
+    for (int i=0; i<NUM_SPANS; i++) {
+      if (SPANS[i].tt == tt) {
+        return offset;
+      }
+      offset += SPANS[i].size;
+    }
+    return -1;
+  }
+
+  constexpr int vocab_size() {
+    int total = 0;
+    for (int i=0; i<NUM_SPANS; i++) {
+      total += SPANS[i].size;
+    }
+    return total;
+  }
+
+  // span of tt, NUM_SPANS if tt is not in the layout
+  constexpr int span_index(midi::TOKEN_TYPE tt) {
+    for (int i=0; i<NUM_SPANS; i++) {
+      if (SPANS[i].tt == tt) {
+        return i;
+      }
+    }
+    return NUM_SPANS;
+  }
+
+  constexpr bool is_range(midi::TOKEN_TYPE tt) {
+    return (span_index(tt) < NUM_SPANS) && (SPANS[span_index(tt)].range);
+  }
+
+  static_assert(offset(midi::TOKEN_NOTE_ONSET) == 154);
+  static_assert(vocab_size() == 840);
+
+  // REPRESENTATION_CODER for the default scheme. the range token types are
+  // encoded and decoded with constant offsets, values outside the domain and
+  // the other token types go through rep, so errors are the same
+  class TOKEN_CODER {
+  public:
+    TOKEN_CODER(REPRESENTATION *rep_) : rep(rep_) {}
+    template <midi::TOKEN_TYPE TT> int encode(int value) const {
+      if constexpr (is_range(TT)) {
+        if ((unsigned)value < (unsigned)SPANS[span_index(TT)].size) {
+          return offset(TT) + value;
+        }
+      }
+      return rep->encode(TT, value);
+    }
+    template <midi::TOKEN_TYPE TT> int encode_partial(int value) const {
+      if constexpr (is_range(TT)) {
+        if ((unsigned)value < (unsigned)SPANS[span_index(TT)].size) {
+          return value;
+        }
+      }
+      return rep->encode_partial(TT, value);
+    }
+    template <midi::TOKEN_TYPE TT> int decode(int token) const {
+      if constexpr (is_range(TT)) {
+        if ((unsigned)(token - offset(TT)) < (unsigned)SPANS[span_index(TT)].size) {
+          return token - offset(TT);
+        }
+      }
+      return rep->decode(token);
+    }
+    // every token of the vocabulary is in a span, others are checked by rep
+    template <midi::TOKEN_TYPE TT> bool is_token_type(int token) const {
+      if constexpr (span_index(TT) < NUM_SPANS) {
+        if ((unsigned)token < (unsigned)vocab_size()) {
+          return (unsigned)(token - offset(TT)) < (unsigned)SPANS[span_index(TT)].size;
+        }
+      }
+      return rep->is_token_type(token, TT);
+    }
+    REPRESENTATION *rep;
+  };
+
+  // throws if rep does not follow the layout
+  void validate(const std::shared_ptr<REPRESENTATION> &rep) {
+    if (rep->max_token() != vocab_size()) {
+      throw std::runtime_error("EXPRESSIVE ENCODER LAYOUT MISMATCH : VOCAB SIZE");
+    }
+    for (int i=0; i<NUM_SPANS; i++) {
+      midi::TOKEN_TYPE tt = SPANS[i].tt;
+      if ((rep->type_offsets[tt] != offset(tt)) || (rep->type_sizes[tt] != SPANS[i].size)) {
+        throw std::runtime_error("EXPRESSIVE ENCODER LAYOUT MISMATCH : " + util_protobuf::enum_to_string(tt));
+      }
+      for (int value=0; (SPANS[i].range) && (value<SPANS[i].size); value++) {
+        int token = offset(tt) + value;
+        if ((rep->encode(tt, value) != token) || (rep->encode_partial(tt, value) != value) || (rep->decode(token) != value)) {
+          throw std::runtime_error("EXPRESSIVE ENCODER LAYOUT MISMATCH : " + util_protobuf::enum_to_string(tt));
+        }
+      }
+    }
+  }
+
+}
+
 class ExpressiveEncoder : public ENCODER {
 public:
   ExpressiveEncoder() {
@@ -33,7 +174,24 @@ public:
     config->delta_resolution = 1920;
     config->decode_resolution = config->delta_resolution;
 
-    rep = std::make_shared<REPRESENTATION>(REPRESENTATION({
+    rep = default_representation();
+  }
+  ~ExpressiveEncoder() {}
+
+  // the default representation never changes, so it is built and checked
+  // once and shared by every encoder instance. set_scheme replaces rep
+  // instead of modifying it
+  static std::shared_ptr<REPRESENTATION> default_representation() {
+    static const std::shared_ptr<REPRESENTATION> default_rep = []() {
+      auto r = build_default_representation();
+      expressive_layout::validate(r);
+      return r;
+    }();
+    return default_rep;
+  }
+
+  static std::shared_ptr<REPRESENTATION> build_default_representation() {
+    return std::make_shared<REPRESENTATION>(REPRESENTATION({
       {midi::TOKEN_PIECE_START, TOKEN_DOMAIN(2)},
       {midi::TOKEN_NUM_BARS, TOKEN_DOMAIN({4,8}, INT_VALUES_DOMAIN)},
       {midi::TOKEN_BAR, TOKEN_DOMAIN(1)},
@@ -62,9 +220,26 @@ public:
       add_attribute_control_to_representation(midi::TOKEN_MAX_POLYPHONY),
       add_attribute_control_to_representation(midi::TOKEN_DENSITY_LEVEL),
     }));
+  }
 
+  // the default scheme encodes and decodes notes with constant offsets
+  void encode_notes(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts, const data_structures::EncoderState &state) {
+    if (rep == default_representation()) {
+      encode_notes_with(bar_num, track_num, p, ts, state, expressive_layout::TOKEN_CODER(rep.get()));
+    }
+    else {
+      ENCODER::encode_notes(bar_num, track_num, p, ts, state);
+    }
+  }
+
+  void decode_track_tokens(std::vector<int> &tokens, midi::Piece *p) {
+    if (rep == default_representation()) {
+      decode_track(tokens, p, rep, config, expressive_layout::TOKEN_CODER(rep.get()));
+    }
+    else {
+      ENCODER::decode_track_tokens(tokens, p);
+    }
   }
-  ~ExpressiveEncoder() {}
 
   void preprocess_piece(midi::Piece *p) {
     util_protobuf::calculate_note_durations(p);
@@ -72,7 +247,13 @@ public:
     util_protobuf::update_note_density(p);
   }
 
+  // replaces config and rep instead of modifying them, they may be referenced
+  // elsewhere (rep is the shared default representation)
   void set_scheme(int res, int delta_res, int delta_vocab_size, int abs_pos_vocab_size) {
+    if (shared) {
+      throw std::runtime_error("CAN NOT SET THE SCHEME OF A SHARED ENCODER");
+    }
+    config = std::make_shared<data_structures::EncoderConfig>(*config);
     config->resolution = res;
     config->delta_resolution = delta_res;
 
@@ -71,24 +71,40 @@ public:
   }
 
   std::vector<int> encode(midi::Piece *p) {
+    return encode(p, config->get_state());
+  }
+
+  std::vector<int> encode(midi::Piece *p, const data_structures::EncoderState &state) {
     preprocess_piece(p);
-    data_structures::TokenSequence ts = encode_piece(p);
+    data_structures::TokenSequence ts = encode_piece(p, state);
     return ts.tokens;
   }
 
   std::vector<int> encode_wo_preprocess(midi::Piece *p) {
-    data_structures::TokenSequence ts = encode_piece(p);
+    return encode_wo_preprocess(p, config->get_state());
+  }
+
+  std::vector<int> encode_wo_preprocess(midi::Piece *p, const data_structures::EncoderState &state) {
+    data_structures::TokenSequence ts = encode_piece(p, state);
     return ts.tokens;
   }
 
-  virtual void decode(std::vector<int> &tokens, midi::Piece *p) {
-    if (config->do_multi_fill == true) {
+  void decode(std::vector<int> &tokens, midi::Piece *p) {
+    decode(tokens, p, config->get_state());
+  }
+
+  virtual void decode(std::vector<int> &tokens, midi::Piece *p, const data_structures::EncoderState &state) {
+    if (state.do_multi_fill == true) {
       tokens = resolve_bar_infill_tokens(tokens, rep);
     }
     data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "AFTER BAR INFILL RESOLVED :: ");
     for (int tok : tokens) {
       data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, pretty(tok));
     }
+    decode_track_tokens(tokens, p);
+  }
+
+  virtual void decode_track_tokens(std::vector<int> &tokens, midi::Piece *p) {
     decode_track(tokens, p, rep, config);
   }
 
@@ -101,10 +117,24 @@ public:
     return json_string;
   }
 
+  std::string midi_bytes_to_json(std::string_view midi_bytes) {
+    midi::Piece p;
+    midi_io::ParseSongBytes(midi_bytes, &p, config);
+    preprocess_piece(&p);
+    std::string json_string;
+    google::protobuf::util::MessageToJsonString(p, &json_string);
+    return json_string;
+  }
+
   void midi_to_piece(const std::string& filepath, midi::Piece* p) {
     midi_io::ParseSong(filepath, p, config);
     preprocess_piece(p);
   }
+
+  void midi_bytes_to_piece(std::string_view midi_bytes, midi::Piece* p) {
+    midi_io::ParseSongBytes(midi_bytes, p, config);
+    preprocess_piece(p);
+  }
   
   std::vector<int> midi_to_tokens(std::string &filepath) {
     midi::Piece p;
@@ -113,12 +143,25 @@ public:
     return encode(&p);
   }
 
+  std::vector<int> midi_bytes_to_tokens(std::string_view midi_bytes) {
+    midi::Piece p;
+    midi_io::ParseSongBytes(midi_bytes, &p, config);
+    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("Parsed File :: ",util_protobuf::protobuf_to_string(&p)));
+    return encode(&p);
+  }
+
   void json_to_midi(std::string &json_string, std::string &filepath) {
     midi::Piece p;
     google::protobuf::util::JsonStringToMessage(json_string.c_str(), &p);
     midi_io::write_midi(&p, filepath, -1);
   }
 
+  std::string json_to_midi_bytes(std::string &json_string) {
+    midi::Piece p;
+    google::protobuf::util::JsonStringToMessage(json_string.c_str(), &p);
+    return midi_io::write_midi_bytes(&p, -1);
+  }
+
   std::string json_to_json(std::string &json_string_in) {
     midi::Piece p;
     google::protobuf::util::JsonStringToMessage(json_string_in.c_str(), &p);
@@ -239,8 +282,12 @@ public:
   }
 
   void tokens_to_json_array(std::vector<std::vector<int>> &seqs, std::vector<midi::Piece> &output) {
+    tokens_to_json_array(seqs, output, config->get_state());
+  }
+
+  void tokens_to_json_array(std::vector<std::vector<int>> &seqs, std::vector<midi::Piece> &output, const data_structures::EncoderState &state) {
     for (int i=0; i<(int)seqs.size(); i++) {
-      decode(seqs[i], &(output[i]));
+      decode(seqs[i], &(output[i]), state);
     }
   }
 
@@ -250,6 +297,12 @@ public:
     midi_io::write_midi(&p, filepath, -1);
   }
 
+  std::string tokens_to_midi_bytes(std::vector<int> &tokens) {
+    midi::Piece p;
+    decode(tokens, &p);
+    return midi_io::write_midi_bytes(&p, -1);
+  }
+
   // ====================
   // expose methods of rep that we need
 
@@ -272,7 +325,13 @@ public:
 
   // ====================
 
-  void encode_notes(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts) {
+  virtual void encode_notes(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts, const data_structures::EncoderState &state) {
+    encode_notes_with(bar_num, track_num, p, ts, state, REPRESENTATION_CODER(rep.get()));
+  }
+
+  // coder encodes the note tokens (see REPRESENTATION_CODER)
+  template <typename CODER>
+  void encode_notes_with(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts, const data_structures::EncoderState &state, const CODER &coder) {
     const auto track = p->tracks(track_num);
     const auto bar = track.bars(bar_num);
     const auto is_drum = data_structures::is_drum_track(track.track_type());
@@ -306,38 +365,39 @@ public:
       // checking for onset > 0 is to make things backwards compatible with the old representation
       // however for randomly ordering onset times we need to include onset == 0
       if ((onset > 0)) { 
-        ts->push_back( rep->encode(midi::TOKEN_TIME_ABSOLUTE_POS, onset) );
+        ts->push_back( coder.template encode<midi::TOKEN_TIME_ABSOLUTE_POS>(onset) );
       }
       
       for (const auto &i : notes_by_onset[onset]) {
         midi::Event event = p->events(i);
         d_onset = delta_onsets[i];
         if (rep->has_token_type(midi::TOKEN_VELOCITY_LEVEL)) {
-          int current_velocity = rep->encode_partial(midi::TOKEN_VELOCITY_LEVEL, event.velocity());
+          int current_velocity = coder.template encode_partial<midi::TOKEN_VELOCITY_LEVEL>(event.velocity());
           if ((current_velocity > 0) && (current_velocity != last_velocity)) {
-            ts->push_back( rep->encode(midi::TOKEN_VELOCITY_LEVEL, event.velocity()) );
+            ts->push_back( coder.template encode<midi::TOKEN_VELOCITY_LEVEL>(event.velocity()) );
             last_velocity = current_velocity;
           }
         }
         if (config->use_microtiming) {
           if (d_onset < 0) {
-            ts->push_back( rep->encode(midi::TOKEN_DELTA_DIRECTION, 0) );
+            ts->push_back( coder.template encode<midi::TOKEN_DELTA_DIRECTION>(0) );
             d_onset *= -1;
           }
           d_onset = std::min(N_TIME_TOKENS - 1, d_onset);
           if (d_onset > 0) {
-            ts->push_back( rep->encode(midi::TOKEN_DELTA, d_onset) );
+            ts->push_back( coder.template encode<midi::TOKEN_DELTA>(d_onset) );
           }
         }
-        ts->push_back( rep->encode(midi::TOKEN_NOTE_ONSET, event.pitch()) );
+        // drum pitches are instruments and are never transposed
+        ts->push_back( coder.template encode<midi::TOKEN_NOTE_ONSET>(is_drum ? event.pitch() : event.pitch() + state.transpose) );
         if (!is_drum) {
-          ts->push_back( rep->encode(midi::TOKEN_NOTE_DURATION, std::min(event.internal_duration(), N_DURATION_TOKENS)-1) );
+          ts->push_back( coder.template encode<midi::TOKEN_NOTE_DURATION>(std::min(event.internal_duration(), N_DURATION_TOKENS)-1) );
         }
       }
     }
   }
 
-  void encode_bar(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts, bool infill) {
+  void encode_bar(int bar_num, int track_num, midi::Piece *p, data_structures::TokenSequence *ts, bool infill, const data_structures::EncoderState &state) {
     auto track = p->tracks(track_num);
     const auto bar = track.bars(bar_num);
     const auto is_drum = data_structures::is_drum_track(track.track_type());
@@ -346,7 +406,7 @@ public:
 
     if (infill) {
       ts->push_back( rep->encode(midi::TOKEN_FILL_IN_START, 0) );
-      encode_notes(bar_num, track_num, p, ts);
+      encode_notes(bar_num, track_num, p, ts, state);
       ts->push_back( rep->encode(midi::TOKEN_FILL_IN_END, 0) );
     }
     else {
@@ -359,20 +419,28 @@ public:
         ts->push_back( rep->encode(midi::TOKEN_TIME_SIGNATURE, std::make_tuple(bar.ts_numerator(), bar.ts_denominator())) );
       }
 
-      if ((config->do_multi_fill) && (config->multi_fill.find(std::make_pair(track_num,bar_num)) != config->multi_fill.end())) {
+      if ((state.do_multi_fill) && (state.multi_fill.find(std::make_pair(track_num,bar_num)) != state.multi_fill.end())) {
         ts->push_back( rep->encode(midi::TOKEN_FILL_IN_PLACEHOLDER, 0) );
       }
       else {
-        encode_notes(bar_num, track_num, p, ts);
+        encode_notes(bar_num, track_num, p, ts, state);
       }
       ts->push_back( rep->encode(midi::TOKEN_BAR_END, 0) );
     }
   }
 
-  void encode_track(int track_num, midi::Piece *p, data_structures::TokenSequence *ts) {
+  void encode_track(int track_num, midi::Piece *p, data_structures::TokenSequence *ts, const data_structures::EncoderState &state) {
     const auto track = p->tracks(track_num);
     const auto is_drum = data_structures::is_drum_track(track.track_type());
-    const auto f = util_protobuf::GetTrackFeatures(p, track_num);
+    midi::TrackFeatures *f = util_protobuf::GetTrackFeatures(p, track_num);
+
+    // controls that hold pitches follow the transposed notes
+    midi::TrackFeatures transposed;
+    if ((!is_drum) && (state.transpose != 0)) {
+      transposed = *f;
+      transpose_track_features(&transposed, state.transpose);
+      f = &transposed;
+    }
 
     ts->on_track_start(p, rep);
 
@@ -388,13 +456,17 @@ public:
     append_track_tokens(ts, rep, f, is_drum);
 
     for (int i=0; i<track.bars_size(); i++) {
-      encode_bar(i, track_num, p, ts, false);
+      encode_bar(i, track_num, p, ts, false, state);
     }
 
     ts->push_back( rep->encode(midi::TOKEN_TRACK_END, 0) );
   }
 
   data_structures::TokenSequence encode_piece(midi::Piece *p) {
+    return encode_piece(p, config->get_state());
+  }
+
+  data_structures::TokenSequence encode_piece(midi::Piece *p, const data_structures::EncoderState &state) {
 
     // make sure that rep does not try use deprecated note encodings
     if ((!rep->has_token_type(midi::TOKEN_NOTE_DURATION)) || (!rep->has_token_type(midi::TOKEN_TIME_ABSOLUTE_POS))) {
@@ -404,19 +476,19 @@ public:
     data_structures::TokenSequence ts(rep);
 
     ts.push_back( rep->encode(
-      midi::TOKEN_PIECE_START, std::min((int)config->do_multi_fill,rep->get_domain_size(midi::TOKEN_PIECE_START)-1)));
+      midi::TOKEN_PIECE_START, std::min((int)state.do_multi_fill,rep->get_domain_size(midi::TOKEN_PIECE_START)-1)));
 
     if (rep->has_token_type(midi::TOKEN_NUM_BARS)) {
       ts.push_back( rep->encode(midi::TOKEN_NUM_BARS, util_protobuf::GetNumBars(p)) );
     }
 
     for (int i=0; i<p->tracks_size(); i++) {
-      encode_track(i, p, &ts);
+      encode_track(i, p, &ts, state);
     }
 
-    if (config->do_multi_fill) {
-      for (const auto &track_bar : config->multi_fill) {      
-        encode_bar(std::get<1>(track_bar), std::get<0>(track_bar), p, &ts, true);
+    if (state.do_multi_fill) {
+      for (const auto &track_bar : state.multi_fill) {      
+        encode_bar(std::get<1>(track_bar), std::get<0>(track_bar), p, &ts, true, state);
       }
     }
 
@@ -430,6 +502,7 @@ public:
   std::shared_ptr<data_structures::EncoderConfig> config;
   std::shared_ptr<REPRESENTATION> rep;
   std::vector<midi::ATTRIBUTE_CONTROL_TYPE> attribute_control_types;
+  bool shared = false; // set by enums::getSharedEncoder, config and rep must not change
 };
 
 }
@@ -8,6 +8,10 @@
 #include <iostream>
 #include <sstream>
 #include <variant>
+#include <chrono>
+#include <functional>
+#include <climits>
+#include <algorithm>
 
 #include "token_domain.h"
 #include "../data_structures/verbosity.h"
@@ -63,8 +67,99 @@ public:
       domains.insert( std::make_pair(tt,domain.output_domain.size()) );
       token_domains.insert( std::make_pair(tt,domain) );
     }
+    build_tables(spec);
   }
+
+  void build_tables(const std::vector<std::pair<midi::TOKEN_TYPE,TOKEN_DOMAIN>> &spec) {
+
+    /*
+    Builds dense tables from the maps so that the calls in the inner loops (encode, decode, get_token_type) are plain array lookups.
+    Token ids index directly into the token tables. Integer values of each token type index into int_tables[tt] after subtracting int_min[tt].
+    Anything not covered by the tables (string and time signature values, sparse int domains) goes through the maps.
+    */
+
+    token_types.assign(vocab_size, -1);
+    token_int_values.assign(vocab_size, 0);
+    token_input_types.assign(vocab_size, TI_INT);
+    for (const auto &kv : backward) {
+      token_types[kv.first] = std::get<0>(kv.second);
+      token_input_types[kv.first] = backward_types[kv.first];
+      if (std::holds_alternative<int>(std::get<1>(kv.second))) {
+        token_int_values[kv.first] = std::get<int>(std::get<1>(kv.second));
+      }
+    }
+
+    type_offsets.assign(midi::TOKEN_TYPE_ARRAYSIZE, -1);
+    type_sizes.assign(midi::TOKEN_TYPE_ARRAYSIZE, 0);
+    int offset = 0;
+    for (const auto &token_domain : spec) {
+      midi::TOKEN_TYPE tt = std::get<0>(token_domain);
+      type_offsets[tt] = offset;
+      type_sizes[tt] = std::get<1>(token_domain).output_domain.size();
+      offset += type_sizes[tt];
+    }
+
+    // integer domains, including the output indices of string and time signature domains
+    std::vector<int> int_max(midi::TOKEN_TYPE_ARRAYSIZE, INT_MIN);
+    int_min.assign(midi::TOKEN_TYPE_ARRAYSIZE, INT_MAX);
+    for (const auto &kv : forward) {
+      if (std::holds_alternative<int>(std::get<1>(kv.first))) {
+        int tt = std::get<0>(kv.first);
+        int value = std::get<int>(std::get<1>(kv.first));
+        int_min[tt] = std::min(int_min[tt], value);
+        int_max[tt] = std::max(int_max[tt], value);
+      }
+    }
+    int_tables.assign(midi::TOKEN_TYPE_ARRAYSIZE, std::vector<int>());
+    for (int tt=0; tt<midi::TOKEN_TYPE_ARRAYSIZE; tt++) {
+      if ((int_max[tt] >= int_min[tt]) && ((int64_t)int_max[tt] - int_min[tt] < MAX_DENSE_INT_DOMAIN)) {
+        int_tables[tt].assign(int_max[tt] - int_min[tt] + 1, -1);
+      }
+    }
+    for (const auto &kv : forward) {
+      if (std::holds_alternative<int>(std::get<1>(kv.first))) {
+        int tt = std::get<0>(kv.first);
+        if (int_tables[tt].size()) {
+          int_tables[tt][std::get<int>(std::get<1>(kv.first)) - int_min[tt]] = kv.second;
+        }
+      }
+    }
+
+    type_tokens.assign(midi::TOKEN_TYPE_ARRAYSIZE, std::vector<int>());
+    for (const auto &kv : token_domains) {
+      for (const auto &value : kv.second.input_domain) {
+        type_tokens[kv.first].push_back( forward[std::make_tuple(kv.first,value)] );
+      }
+    }
+  }
+
+  inline bool valid_type(int tt) {
+    return (tt >= 0) && (tt < (int)type_offsets.size());
+  }
+
+  // returns -1 if (tt,value) is not in the dense tables
+  inline int encode_int(midi::TOKEN_TYPE tt, int value) {
+    if (!valid_type(tt)) {
+      return -1;
+    }
+    const std::vector<int> &table = int_tables[tt];
+    int64_t index = (int64_t)value - int_min[tt];
+    if ((index < 0) || (index >= (int64_t)table.size())) {
+      return -1;
+    }
+    return table[index];
+  }
+
   int encode(midi::TOKEN_TYPE tt, TOKEN_VARIANT value) {
+    if (std::holds_alternative<int>(value)) {
+      int token = encode_int(tt, std::get<int>(value));
+      if (token >= 0) {
+        return token;
+      }
+    }
+    return encode_fallback(tt, value);
+  }
+  int encode_fallback(midi::TOKEN_TYPE tt, TOKEN_VARIANT value) {
     std::tuple<midi::TOKEN_TYPE,TOKEN_VARIANT> key = std::make_tuple(tt,value);
     auto it = forward.find(key);
     if (it == forward.end()) {
@@ -105,34 +200,43 @@ public:
   }
   int decode(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_INT) {
+    if (token_types[token] >= 0) {
+      if (token_input_types[token] != TI_INT) {
+        throw std::runtime_error("TOKEN CAN NOT BE DECODED AS INT");
+      }
+      return token_int_values[token];
+    }
+    return decode_fallback(token);
+  }
+  int decode_fallback(int token) {
+    token_in_range(token);
+    if (backward_types.at(token) != TI_INT) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS INT");
     }
-    return std::get<int>(std::get<1>(backward[token]));
+    return std::get<int>(std::get<1>(backward.at(token)));
   }
   std::string decode_string(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_STRING) {
+    if (backward_types.at(token) != TI_STRING) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS STRING");
     }
-    return std::get<std::string>(std::get<1>(backward[token]));
+    return std::get<std::string>(std::get<1>(backward.at(token)));
   }
   std::tuple<int,int> decode_timesig(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_TIMESIG) {
+    if (backward_types.at(token) != TI_TIMESIG) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS TIMESIG");
     }
-    return std::get<std::tuple<int,int>>(std::get<1>(backward[token]));
+    return std::get<std::tuple<int,int>>(std::get<1>(backward.at(token)));
   }
   int max_token() {
     return vocab_size;
   }
   int get_domain_size(midi::TOKEN_TYPE tt) {
-    auto it = domains.find(tt);
-    if (it == domains.end()) {
+    if (!valid_type(tt)) {
       return 0;
     }
-    return it->second;
+    return type_sizes[tt];
   }
   bool in_domain(midi::TOKEN_TYPE tt, int value) {
     auto it = token_domains.find(tt);
@@ -168,6 +272,9 @@ public:
   }
 
   void check_token(int token) {
+    if ((token >= 0) && (token < vocab_size) && (token_types[token] >= 0)) {
+      return;
+    }
     auto it = backward.find(token);
     if (it == backward.end()) {
       std::ostringstream buffer;
@@ -177,14 +284,21 @@ public:
   }
   bool is_token_type(int token, midi::TOKEN_TYPE tt) {
     check_token(token);
-    return std::get<0>(backward[token]) == tt;
+    return token_types[token] == tt;
   }
   midi::TOKEN_TYPE get_token_type(int token) {
     check_token(token);
-    return std::get<0>(backward[token]);
+    return static_cast<midi::TOKEN_TYPE>(token_types[token]);
+  }
+  midi::TOKEN_TYPE get_token_type_fallback(int token) {
+    auto it = backward.find(token);
+    if (it == backward.end()) {
+      check_token(token);
+    }
+    return std::get<0>(it->second);
   }
   bool has_token_type(midi::TOKEN_TYPE tt) {
-    return token_domains.find(tt) != token_domains.end();
+    return valid_type(tt) && (type_offsets[tt] >= 0);
   }
   bool has_token_types(std::vector<midi::TOKEN_TYPE> tts) {
     for (const auto &tt : tts) {
@@ -223,12 +337,11 @@ public:
 
   template <typename T>
   void set_mask(midi::TOKEN_TYPE tt, std::vector<int> values, std::vector<T> &mask, T mask_value) {
-    auto it = token_domains.find(tt);
-    if (it != token_domains.end()) {
+    if (has_token_type(tt)) {
       for (const auto &value : values) {
         if (value == -1) {
-          for (const auto &v : it->second.input_domain) {
-            mask[encode(tt, v)] = mask_value;
+          for (const auto &token : type_tokens[tt]) {
+            mask[token] = mask_value;
           }
         }
         else {
@@ -257,8 +370,9 @@ public:
   std::vector<int> get_type_mask(std::vector<midi::TOKEN_TYPE> tts) {
     std::vector<int> mask(vocab_size,0);
     for (int i=0; i<vocab_size; i++) {
+      check_token(i);
       for (const auto &tt : tts) {
-        if (is_token_type(i,tt)) {
+        if (token_types[i] == tt) {
           mask[i] = 1;
           break;
         }
@@ -286,13 +400,15 @@ public:
   }
 
   std::string pretty(int token) {
-    auto token_value = backward[token];
-    TOKEN_INPUT_TYPE ti = backward_types[token];
+    check_token(token);
+    auto token_value = backward.at(token);
+    TOKEN_INPUT_TYPE ti = backward_types.at(token);
     return util_protobuf::enum_to_string(std::get<0>(token_value)) + std::string(" = ") + token_variant_to_string(ti, std::get<1>(token_value));
   }
 
   std::string pretty_type(int token) {
-    auto token_value = backward[token];
+    check_token(token);
+    auto token_value = backward.at(token);
     return util_protobuf::enum_to_string(std::get<0>(token_value));
   }
 
@@ -314,6 +430,55 @@ public:
     }
   }
 
+  // microbenchmark of the dense tables against the map based lookups.
+  // returns the average time per call in nanoseconds
+  std::map<std::string,double> benchmark_lookups(int iterations) {
+    std::vector<std::tuple<midi::TOKEN_TYPE,int>> int_tokens;
+    std::vector<int> tokens;
+    for (const auto &kv : backward) {
+      if (backward_types.at(kv.first) == TI_INT) {
+        int_tokens.push_back( std::make_tuple(std::get<0>(kv.second), std::get<int>(std::get<1>(kv.second))) );
+        tokens.push_back( kv.first );
+      }
+    }
+    if ((!tokens.size()) || (iterations <= 0)) {
+      return {};
+    }
+    double n = (double)tokens.size() * iterations;
+    volatile int sink = 0;
+    auto time = [&](const std::function<void()> &f) {
+      auto start = std::chrono::high_resolution_clock::now();
+      for (int i=0; i<iterations; i++) {
+        f();
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      return std::chrono::duration<double,std::nano>(end - start).count() / n;
+    };
+    std::map<std::string,double> result;
+    result["encode"] = time([&]() {
+      for (const auto &t : int_tokens) sink = sink + encode(std::get<0>(t), std::get<1>(t));
+    });
+    result["encode_map"] = time([&]() {
+      for (const auto &t : int_tokens) sink = sink + encode_fallback(std::get<0>(t), std::get<1>(t));
+    });
+    result["decode"] = time([&]() {
+      for (const auto &t : tokens) sink = sink + decode(t);
+    });
+    result["decode_map"] = time([&]() {
+      for (const auto &t : tokens) sink = sink + decode_fallback(t);
+    });
+    result["get_token_type"] = time([&]() {
+      for (const auto &t : tokens) sink = sink + get_token_type(t);
+    });
+    result["get_token_type_map"] = time([&]() {
+      for (const auto &t : tokens) sink = sink + get_token_type_fallback(t);
+    });
+    for (const auto &name : {"encode", "decode", "get_token_type"}) {
+      result[std::string(name) + "_speedup"] = result[std::string(name) + "_map"] / std::max(result[name], 1e-9);
+    }
+    return result;
+  }
+
   // function to determine if pretrain instrument mapping is used
   bool has_pretrain_instrument_mapping() {
     auto it = token_domains.find(midi::TOKEN_INSTRUMENT);
@@ -330,6 +495,39 @@ public:
 
   std::map<midi::TOKEN_TYPE,int> domains; // maps each token type to its domain output size
   std::map<midi::TOKEN_TYPE,TOKEN_DOMAIN> token_domains; // maps each token type to its token domain
+
+  // dense tables (see build_tables)
+  static const int MAX_DENSE_INT_DOMAIN = 1<<16;
+  std::vector<int> token_types; // token type of each token, -1 if the token can not be decoded
+  std::vector<int> token_int_values; // int value of each token (only valid for TI_INT tokens)
+  std::vector<TOKEN_INPUT_TYPE> token_input_types;
+  std::vector<int> type_offsets; // first token of each token type, -1 if not in representation
+  std::vector<int> type_sizes; // domain output size of each token type
+  std::vector<int> int_min; // smallest int value of each token type
+  std::vector<std::vector<int>> int_tables; // token for each int value, -1 if not in domain
+  std::vector<std::vector<int>> type_tokens; // tokens of the whole input domain of each token type
+};
+
+// The note encoding and the track decoding are templates over a token coder
+// with this interface, so an encoder whose vocabulary is fixed can pass one
+// that resolves the token type at compile time (see
+// expressive_layout::TOKEN_CODER). This one goes through the tables of rep.
+class REPRESENTATION_CODER {
+public:
+  REPRESENTATION_CODER(REPRESENTATION *rep_) : rep(rep_) {}
+  template <midi::TOKEN_TYPE TT> int encode(int value) const {
+    return rep->encode(TT, value);
+  }
+  template <midi::TOKEN_TYPE TT> int encode_partial(int value) const {
+    return rep->encode_partial(TT, value);
+  }
+  template <midi::TOKEN_TYPE TT> int decode(int token) const {
+    return rep->decode(token);
+  }
+  template <midi::TOKEN_TYPE TT> bool is_token_type(int token) const {
+    return rep->is_token_type(token, TT);
+  }
+  REPRESENTATION *rep;
 };
 
 }
@@ -28,7 +28,10 @@ namespace encoder {
 // - encode a track
 // - encode a piece
 
-void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_ptr<encoder::REPRESENTATION> &rep, const std::shared_ptr<data_structures::EncoderConfig> &ec) {
+// coder encodes and decodes the tokens (see REPRESENTATION_CODER), rep is
+// only used for the token types that are not ints
+template <typename CODER>
+void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_ptr<encoder::REPRESENTATION> &rep, const std::shared_ptr<data_structures::EncoderConfig> &ec, const CODER &coder) {
   p->set_resolution(ec->resolution);
 
   std::map<int,int> inst_to_track;
@@ -46,7 +49,7 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
   std::set<int> offset_remain;
 
   for (const auto &token : tokens) {
-    if (rep->is_token_type(token, midi::TOKEN_TRACK)) {
+    if (coder.template is_token_type<midi::TOKEN_TRACK>(token)) {
       current_time = 0; // restart the time
       current_note_time = 0;
       current_instrument = 0; // reset instrument
@@ -59,14 +62,14 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
       else {
         t = p->mutable_tracks(track_count);
       }
-      t->set_track_type( (midi::TRACK_TYPE)rep->decode(token) );
+      t->set_track_type( (midi::TRACK_TYPE)coder.template decode<midi::TOKEN_TRACK>(token) );
       util_protobuf::GetTrackFeatures(p, track_count);
     }
-    else if (rep->is_token_type(token, midi::TOKEN_TRACK_END)) {
+    else if (coder.template is_token_type<midi::TOKEN_TRACK_END>(token)) {
       track_count++;
       t = NULL;
     }
-    else if (rep->is_token_type(token, midi::TOKEN_BAR)) {
+    else if (coder.template is_token_type<midi::TOKEN_BAR>(token)) {
       // when we start new bar we need to decrement time of remaining offsets
       for (const auto &index : offset_remain) {
         midi::Event *e = p->mutable_events(index);
@@ -82,45 +85,45 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
       }
       bar_count++;
     }
-    else if (rep->is_token_type(token, midi::TOKEN_TIME_SIGNATURE)) {
+    else if (coder.template is_token_type<midi::TOKEN_TIME_SIGNATURE>(token)) {
       std::tuple<int,int> ts = rep->decode_timesig(token);
       beat_length = 4 * std::get<0>(ts) / std::get<1>(ts);
       b->set_ts_numerator( std::get<0>(ts) );
       b->set_ts_denominator( std::get<1>(ts) );
     }
-    else if (rep->is_token_type(token, midi::TOKEN_BAR_END)) {
+    else if (coder.template is_token_type<midi::TOKEN_BAR_END>(token)) {
       if (b) {
         b->set_internal_beat_length(beat_length);
       }
       current_time = beat_length * p->resolution();
       current_note_time = current_time;
     }
-    else if (rep->is_token_type(token, midi::TOKEN_TIME_ABSOLUTE_POS)) {
-      current_time = rep->decode(token); // simply update instead of increment
+    else if (coder.template is_token_type<midi::TOKEN_TIME_ABSOLUTE_POS>(token)) {
+      current_time = coder.template decode<midi::TOKEN_TIME_ABSOLUTE_POS>(token); // simply update instead of increment
       current_note_time = current_time;
       delta_direction = 1;
       delta_total = 0;
     }
-    else if (rep->is_token_type(token, midi::TOKEN_DELTA_DIRECTION)) {
+    else if (coder.template is_token_type<midi::TOKEN_DELTA_DIRECTION>(token)) {
       delta_direction = -1;
       delta_total = 0;
     }
-    else if (rep->is_token_type(token, midi::TOKEN_DELTA)) {
+    else if (coder.template is_token_type<midi::TOKEN_DELTA>(token)) {
       last_abs_token = last_token;
-      int delta_val = rep->decode(token);
+      int delta_val = coder.template decode<midi::TOKEN_DELTA>(token);
       delta_total += delta_direction * delta_val;
       
     }
-    else if (rep->is_token_type(token, midi::TOKEN_INSTRUMENT)) {
+    else if (coder.template is_token_type<midi::TOKEN_INSTRUMENT>(token)) {
       if (t) {
-        current_instrument = rep->decode(token);
+        current_instrument = coder.template decode<midi::TOKEN_INSTRUMENT>(token);
         t->set_instrument( current_instrument );
       }
     }
-    else if (rep->is_token_type(token, midi::TOKEN_VELOCITY_LEVEL)) {
-      current_velocity = rep->decode(token);
+    else if (coder.template is_token_type<midi::TOKEN_VELOCITY_LEVEL>(token)) {
+      current_velocity = coder.template decode<midi::TOKEN_VELOCITY_LEVEL>(token);
     }
-    else if (rep->is_token_type(token, midi::TOKEN_NOTE_ONSET)) {
+    else if (coder.template is_token_type<midi::TOKEN_NOTE_ONSET>(token)) {
       if (b && t) {
         
         if (data_structures::is_drum_track(t->track_type())) {
@@ -128,7 +131,7 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
           int current_note_index = p->events_size();
           current_note_time = current_time;
           e = p->add_events();
-          e->set_pitch( rep->decode(token) );
+          e->set_pitch( coder.template decode<midi::TOKEN_NOTE_ONSET>(token) );
           e->set_velocity( current_velocity );
           e->set_time( current_note_time );
 
@@ -140,7 +143,7 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
 
           current_note_index = p->events_size();
           e = p->add_events();
-          e->set_pitch( rep->decode(token) );
+          e->set_pitch( coder.template decode<midi::TOKEN_NOTE_ONSET>(token) );
           e->set_velocity( 0 );
           e->set_time( current_note_time + 1 );
           b->add_events( current_note_index );
@@ -149,14 +152,14 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
         }
       }
     }
-    else if (rep->is_token_type(token, midi::TOKEN_NOTE_DURATION)) {
-      if (b && t && (last_token >= 0) && (rep->is_token_type(last_token, midi::TOKEN_NOTE_ONSET))) {
+    else if (coder.template is_token_type<midi::TOKEN_NOTE_DURATION>(token)) {
+      if (b && t && (last_token >= 0) && (coder.template is_token_type<midi::TOKEN_NOTE_ONSET>(last_token))) {
 
         // add onset
         int current_note_index = p->events_size();
         current_note_time = current_time;
         e = p->add_events();
-        e->set_pitch( rep->decode(last_token) );
+        e->set_pitch( coder.template decode<midi::TOKEN_NOTE_ONSET>(last_token) );
         e->set_velocity( current_velocity );
         e->set_time( current_note_time );
         e->set_delta( delta_total );
@@ -167,9 +170,9 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
         // add offset
         current_note_index = p->events_size();
         e = p->add_events();
-        e->set_pitch( rep->decode(last_token) );
+        e->set_pitch( coder.template decode<midi::TOKEN_NOTE_ONSET>(last_token) );
         e->set_velocity( 0 );
-        e->set_time( current_note_time + rep->decode(token) + 1 );
+        e->set_time( current_note_time + coder.template decode<midi::TOKEN_NOTE_DURATION>(token) + 1 );
         e->set_delta( 0 );
 
         if (e->time() <= beat_length * p->resolution()) {
@@ -183,7 +186,7 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
         b->set_internal_has_notes( true );
       }
     }
-    else if (rep->is_token_type(token, midi::TOKEN_GENRE)) {
+    else if (coder.template is_token_type<midi::TOKEN_GENRE>(token)) {
       midi::TrackFeatures *f;
       if (!t->internal_features_size()) {
         f = t->add_internal_features(); 
@@ -212,5 +215,9 @@ void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_pt
   p->add_internal_valid_tracks((1<<p->tracks_size())-1);
 }
 
+void decode_track(std::vector<int> &tokens, midi::Piece *p, const std::shared_ptr<encoder::REPRESENTATION> &rep, const std::shared_ptr<data_structures::EncoderConfig> &ec) {
+  decode_track(tokens, p, rep, ec, REPRESENTATION_CODER(rep.get()));
+}
+
 }
 // END OF NAMESPACE
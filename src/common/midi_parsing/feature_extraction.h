@@ -1,34 +1,103 @@
 #pragma once
 
+#include <atomic>
+#include <cstdio>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include "../../common/midi_parsing/util_protobuf.h"
+#include "../../common/midi_parsing/midi_io.h"
 #include "../../../libraries/protobuf/build/midi.pb.h"
 
 namespace feature_extraction {
 
+struct ONSET {
+    int time;
+    int pitch;
+    int velocity;
+    int bar_num;
+};
+
+std::map<int,int> compute_metric_depth_counts(const std::vector<ONSET> &onsets, int tpq, int max_depth, int offset);
+
+// The onsets of a track, gathered in a single walk over its bars, which
+// every feature extractor reads instead of walking the piece again.
+class TRACK_VIEW {
+public:
+    TRACK_VIEW(midi::Piece *x, int track_num) : track_num(track_num) {
+        const midi::Track &track = x->tracks(track_num);
+        instrument = track.instrument();
+        is_drum = data_structures::is_drum_track(track.track_type());
+        int bar_num = 0;
+        for (const auto &bar : track.bars()) {
+            bar_beat_lengths.push_back(bar.internal_beat_length());
+            for (const auto &event_index : bar.events()) {
+                const midi::Event &event = x->events(event_index);
+                if (event.velocity()) {
+                    onsets.push_back({event.time(), event.pitch(), event.velocity(), bar_num});
+                }
+            }
+            bar_num++;
+        }
+    }
+
+    // shared by the metric depth features
+    const std::map<int,int> &metric_depth_counts(int tpq, int max_depth, int offset) {
+        auto key = std::make_tuple(tpq, max_depth, offset);
+        auto it = metric_depth_cache.find(key);
+        if (it == metric_depth_cache.end()) {
+            it = metric_depth_cache.emplace(key, compute_metric_depth_counts(onsets, tpq, max_depth, offset)).first;
+        }
+        return it->second;
+    }
+
+    int track_num;
+    int instrument;
+    bool is_drum;
+    std::vector<ONSET> onsets; // in bar order
+    std::vector<float> bar_beat_lengths;
+
+private:
+    std::map<std::tuple<int,int,int>,std::map<int,int>> metric_depth_cache;
+};
+
+std::vector<TRACK_VIEW> make_track_views(midi::Piece *x) {
+    std::vector<TRACK_VIEW> views;
+    views.reserve(x->tracks_size());
+    for (int track_num=0; track_num<x->tracks_size(); track_num++) {
+        views.emplace_back(x, track_num);
+    }
+    return views;
+}
+
 class FEATURE_EXTRACTOR {
 public:
 
     virtual ~FEATURE_EXTRACTOR() {}
 
-    virtual void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
+    virtual void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         throw std::runtime_error("FEATURE_EXTRACTOR::compute_track_feature() not implemented");
     }
 
-    virtual void compute_piece_feature(midi::Piece *x, midi::Features *f, std::string &filepath) {
+    virtual void compute_piece_feature(midi::Piece *x, std::vector<TRACK_VIEW> &tracks, midi::Features *f, std::string &filepath) {
         throw std::runtime_error("FEATURE_EXTRACTOR::compute_piece_feature() not implemented");
     }
 
     void compute_feature(midi::Piece *x, midi::Features *f, std::string &filepath) {
+        std::vector<TRACK_VIEW> tracks = make_track_views(x);
+        compute_feature(x, tracks, f, filepath);
+    }
+
+    void compute_feature(midi::Piece *x, std::vector<TRACK_VIEW> &tracks, midi::Features *f, std::string &filepath) {
         if (track_level) {
-            for (int track_num=0; track_num<x->tracks_size(); track_num++) {
-                compute_track_feature(x, track_num, f, filepath);
+            for (auto &track : tracks) {
+                compute_track_feature(x, track, f, filepath);
             }
         }
         else {
-            compute_piece_feature(x, f, filepath);
+            compute_piece_feature(x, tracks, f, filepath);
         }
     }
 
@@ -45,31 +114,21 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
-        const auto track = x->tracks(track_num);
-
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         // ignore drum tracks
-        if (data_structures::is_drum_track(track.track_type())) {
+        if (track.is_drum) {
             return;
         }
 
         int min_pitch = INT_MAX;
         int max_pitch = INT_MIN;
-        for (const auto &bar : track.bars()) {
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    if (x->events(event_index).pitch() < min_pitch) {
-                        min_pitch = x->events(event_index).pitch();
-                    }
-                    if (x->events(event_index).pitch() > max_pitch) {
-                        max_pitch = x->events(event_index).pitch();
-                    }
-                }
-            }
+        for (const auto &onset : track.onsets) {
+            min_pitch = std::min(min_pitch, onset.pitch);
+            max_pitch = std::max(max_pitch, onset.pitch);
         }
 
         auto fm = f->add_pitch_range();
-        fm->set_instrument(track.instrument());
+        fm->set_instrument(track.instrument);
         fm->set_min(min_pitch);
         fm->set_max(max_pitch);
     }
@@ -83,30 +142,14 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
-        const auto track = x->tracks(track_num);
-
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         if (!x->internal_has_time_signatures()) {
             return;
         }
 
-        int downbeat_count = 0;
-        int onset_count = 0;
-
         std::map<int,int> onset_counts;
-        for (const auto &bar : track.bars()) {
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-
-                    onset_counts[x->events(event_index).time()] += 1;
-                    
-                    if (x->events(event_index).time() == 0) {
-                        downbeat_count++;
-                    }
-                    onset_count++;
-
-                }
-            }
+        for (const auto &onset : track.onsets) {
+            onset_counts[onset.time] += 1;
         }
 
         int max_non_downbeat = 1;
@@ -117,27 +160,25 @@ public:
         }
 
         auto fm = f->add_downbeat_proportion();
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
+        fm->set_track_num(track.track_num);
 
         fm->set_downbeat_proportion(float(onset_counts[0]) / float(max_non_downbeat));
 
     }
 };
 
-std::map<int,int> compute_metric_depth_counts(midi::Piece *x, int track_num, int max_depth, int offset) {
-    const auto track = x->tracks(track_num);
-
+std::map<int,int> compute_metric_depth_counts(const std::vector<ONSET> &onsets, int tpq, int max_depth, int offset) {
     int max_duple_depth = 0;
     int max_triplet_depth = 0;
     int total_depth = max_depth * 2;
 
-    while ((x->internal_ticks_per_quarter() % int(pow(2,max_duple_depth))) == 0) {
+    while ((tpq % int(pow(2,max_duple_depth))) == 0) {
         max_duple_depth += 1;
     }
-    while ((x->internal_ticks_per_quarter() * 2) % (int(pow(2,max_triplet_depth)) * 3) == 0) {
+    while ((tpq * 2) % (int(pow(2,max_triplet_depth)) * 3) == 0) {
         max_triplet_depth += 1;
     }
 
@@ -145,33 +186,29 @@ std::map<int,int> compute_metric_depth_counts(midi::Piece *x, int track_num, int
     max_triplet_depth = std::min(max_triplet_depth, max_depth);
 
     std::map<int,int> metric_depth_counts;
-    for (const auto &bar : track.bars()) {
-        for (const auto &event_index : bar.events()) {
-            if (x->events(event_index).velocity()) {
-                bool found_depth = false;
-                for (int i=0; i<max_duple_depth; i++) {
-                    int period = (x->internal_ticks_per_quarter()) / int(pow(2,i));
-                    if (((x->events(event_index).time()) + offset) % period == 0) {
-                        metric_depth_counts[2*i] += 1;
-                        found_depth = true;
-                        break;
-                    }
-                }
-                if (!found_depth) {
-                    for (int i=0; i<max_triplet_depth; i++) {
-                        int period = (x->internal_ticks_per_quarter() * 2) / (int(pow(2,i)) * 3);
-                        if ((x->events(event_index).time() + offset) % period == 0) {
-                            metric_depth_counts[2*i + 1] += 1;
-                            found_depth = true;
-                            break;
-                        }
-                    }
-                }
-                if (!found_depth) {
-                    metric_depth_counts[total_depth] += 1;
+    for (const auto &onset : onsets) {
+        bool found_depth = false;
+        for (int i=0; i<max_duple_depth; i++) {
+            int period = tpq / int(pow(2,i));
+            if ((onset.time + offset) % period == 0) {
+                metric_depth_counts[2*i] += 1;
+                found_depth = true;
+                break;
+            }
+        }
+        if (!found_depth) {
+            for (int i=0; i<max_triplet_depth; i++) {
+                int period = (tpq * 2) / (int(pow(2,i)) * 3);
+                if ((onset.time + offset) % period == 0) {
+                    metric_depth_counts[2*i + 1] += 1;
+                    found_depth = true;
+                    break;
                 }
             }
         }
+        if (!found_depth) {
+            metric_depth_counts[total_depth] += 1;
+        }
     }
     return metric_depth_counts;
 }
@@ -184,17 +221,16 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         
         int max_depth = 6;
-        auto metric_depth_counts = compute_metric_depth_counts(x, track_num, max_depth, 0);
-        const auto track = x->tracks(track_num);
+        auto metric_depth_counts = track.metric_depth_counts(x->internal_ticks_per_quarter(), max_depth, 0);
 
         auto fm = f->add_metric_depth();
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_track_num(track.track_num);
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         fm->set_has_time_signatures(x->internal_has_time_signatures());
         fm->set_tpq(x->internal_ticks_per_quarter());
         for (int i=0; i<=max_depth*2; i++) {
@@ -215,11 +251,10 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         
         int max_depth = 6;
-        auto metric_depth_counts = compute_metric_depth_counts(x, track_num, max_depth, 0);
-        const auto track = x->tracks(track_num);
+        auto metric_depth_counts = track.metric_depth_counts(x->internal_ticks_per_quarter(), max_depth, 0);
 
 
         int max_count = 0;
@@ -233,9 +268,9 @@ public:
 
         auto fm = f->add_most_frequent_metric_depth();
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_track_num(track.track_num);
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         fm->set_has_time_signatures(x->internal_has_time_signatures());
         fm->set_tpq(x->internal_ticks_per_quarter());
         fm->set_most_frequent_metric_depth(max_index);
@@ -251,11 +286,10 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
         
         int max_depth = 6;
-        auto metric_depth_counts = compute_metric_depth_counts(x, track_num, max_depth, 0);
-        const auto track = x->tracks(track_num);
+        auto metric_depth_counts = track.metric_depth_counts(x->internal_ticks_per_quarter(), max_depth, 0);
 
 
         int total = 0;
@@ -276,9 +310,9 @@ public:
 
         auto fm = f->add_median_metric_depth();
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_track_num(track.track_num);
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         fm->set_has_time_signatures(x->internal_has_time_signatures());
         fm->set_tpq(x->internal_ticks_per_quarter());
         fm->set_median_metric_depth(median_depth);
@@ -293,13 +327,12 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
 
         x->set_internal_ticks_per_quarter(12);
 
         int max_depth = 6;
         int tpq = x->internal_ticks_per_quarter();
-        const auto track = x->tracks(track_num);
 
         if (tpq > 10000) {
             throw std::runtime_error("AlignedMetricDepthFeature::compute_track_feature() must have tpq <= 10000.");
@@ -308,7 +341,7 @@ public:
         int best_score_offset = 0;
         int best_score = max_depth * 100;
         for (int offset=0; offset<tpq; offset++) {
-            auto metric_depth_counts = compute_metric_depth_counts(x, track_num, max_depth, offset);
+            const auto &metric_depth_counts = track.metric_depth_counts(tpq, max_depth, offset);
 
             // need to get median score
             int total = 0;
@@ -338,9 +371,9 @@ public:
 
         auto fm = f->add_aligned_metric_depth();
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_track_num(track.track_num);
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         
         fm->set_aligned_offset(best_score_offset);
     }
@@ -355,28 +388,22 @@ public:
         track_level = true;
     }
 
-    void compute_track_feature(midi::Piece *x, int track_num, midi::Features *f, std::string &filepath) {
-
-        const auto track = x->tracks(track_num);
+    void compute_track_feature(midi::Piece *x, TRACK_VIEW &track, midi::Features *f, std::string &filepath) {
 
+        std::map<std::tuple<int,int>,int> onsets; // (bar, time) -> count
+        for (const auto &onset : track.onsets) {
+            onsets[std::make_tuple(onset.bar_num, onset.time)] += 1;
+        }
         int simultaneous_onset_count = 0;
-        for (const auto &bar : track.bars()) {
-            std::map<int,int> onsets;
-            for (const auto &event_index : bar.events()) {
-                if (x->events(event_index).velocity()) {
-                    onsets[x->events(event_index).time()] += 1;
-                }
-            }
-            for (const auto &kv : onsets) {
-                simultaneous_onset_count += (int)(kv.second > 1);
-            }
+        for (const auto &kv : onsets) {
+            simultaneous_onset_count += (int)(kv.second > 1);
         }
 
         auto fm = f->add_simultaneous_onset();
         fm->set_filepath(filepath);
-        fm->set_track_num(track_num);
-        fm->set_instrument(track.instrument());
-        fm->set_is_drum(data_structures::is_drum_track(track.track_type()));
+        fm->set_track_num(track.track_num);
+        fm->set_instrument(track.instrument);
+        fm->set_is_drum(track.is_drum);
         
         fm->set_simultaneous_onset_count(simultaneous_onset_count);
     }
@@ -412,24 +439,16 @@ public:
         track_level = false;
     }
 
-    void compute_piece_feature(midi::Piece *x, midi::Features *f, std::string &filepath) {
+    void compute_piece_feature(midi::Piece *x, std::vector<TRACK_VIEW> &tracks, midi::Features *f, std::string &filepath) {
         std::map<int,int> drum_counts_per_bar;
         std::map<int,int> inst_counts_per_bar;
-        for (const auto &track : x->tracks()) {
-            int bar_num = 0;
-            bool is_drum = data_structures::is_drum_track(track.track_type());
-            for (const auto &bar : track.bars()) {
-                for (const auto &event_index : bar.events()) {
-                    auto event = x->events(event_index);
-                    if (event.velocity()) {
-                        if (is_drum) {
-                            drum_counts_per_bar[bar_num]++;
-                        } else {
-                            inst_counts_per_bar[bar_num]++;
-                        }
-                    }
+        for (const auto &track : tracks) {
+            for (const auto &onset : track.onsets) {
+                if (track.is_drum) {
+                    drum_counts_per_bar[onset.bar_num]++;
+                } else {
+                    inst_counts_per_bar[onset.bar_num]++;
                 }
-                bar_num++;
             }
         }
 
@@ -457,27 +476,27 @@ public:
         track_level = false;
     }
 
-    void compute_piece_feature(midi::Piece *x, midi::Features *f, std::string &filepath) {
+    void compute_piece_feature(midi::Piece *x, std::vector<TRACK_VIEW> &tracks, midi::Features *f, std::string &filepath) {
 
         int max_beat_num = 0;
         std::map<int,double> beat_total_weights;
         std::map<std::tuple<int,int>,int> onset_weights;
-        for (const auto &track : x->tracks()) {
+        std::vector<int> bar_start_beats;
+        for (const auto &track : tracks) {
             int total_beat_num = 0;
-            for (const auto &bar : track.bars()) {
-                for (const auto &event_index : bar.events()) {
-                    auto event = x->events(event_index);
-                    int beat_num = total_beat_num + event.time() / 12;
-                    if (event.velocity()) {
-                        // try extra weight for drums
-                        onset_weights[std::make_tuple(beat_num,event.time() % 12)] += event.velocity(); // * (is_drum ? 2 : 1);
-                        beat_total_weights[beat_num] += event.velocity();
-                    }
-                }
-                if (abs(bar.internal_beat_length() - std::round(bar.internal_beat_length())) > 1e-4) {
+            bar_start_beats.clear();
+            for (const auto &beat_length : track.bar_beat_lengths) {
+                if (abs(beat_length - std::round(beat_length)) > 1e-4) {
                     return; // the piece is invalid and we cannot compute
                 }
-                total_beat_num += bar.internal_beat_length();
+                bar_start_beats.push_back(total_beat_num);
+                total_beat_num += beat_length;
+            }
+            for (const auto &onset : track.onsets) {
+                int beat_num = bar_start_beats[onset.bar_num] + onset.time / 12;
+                // try extra weight for drums
+                onset_weights[std::make_tuple(beat_num,onset.time % 12)] += onset.velocity; // * (is_drum ? 2 : 1);
+                beat_total_weights[beat_num] += onset.velocity;
             }
             max_beat_num = std::max(max_beat_num, total_beat_num);
         }
@@ -522,13 +541,16 @@ std::unique_ptr<FEATURE_EXTRACTOR> getFeature(std::string feature_name) {
 }
 
 
-std::string compute_features(std::string &filepath, std::vector<std::string> &feature_names) {
-
+// Parses the file once and derives a quantized and an unquantized piece
+// from the same events, as needed by the features. The tracks of each piece
+// are gathered once and every feature is computed from them.
+std::string compute_features(midi_io::MidiParsedData *parsed_file, std::string &filepath, std::vector<std::string> &feature_names) {
 
-    std::map<int,std::vector<std::string>> features;
+    std::map<int,std::vector<std::unique_ptr<FEATURE_EXTRACTOR>>> features;
 
     for (const auto &feature_name : feature_names) {
-        features[(int)getFeature(feature_name)->quantized].push_back(feature_name);
+        auto feature = getFeature(feature_name);
+        features[(int)feature->quantized].push_back(std::move(feature));
     }
 
     auto encoder_config = std::make_shared<data_structures::EncoderConfig>();
@@ -540,9 +562,19 @@ std::string compute_features(std::string &filepath, std::vector<std::string> &fe
         if (features.find(i) != features.end()) {
             midi::Piece p;
             encoder_config->unquantized = 1-i;
-            midi_io::ParseSong(filepath, &p, encoder_config);
-            for (const auto &feature_name : features[i]) {
-                getFeature(feature_name)->compute_feature(&p, &f, filepath);
+            midi_io::Parser parser(parsed_file, &p, encoder_config);
+            std::vector<TRACK_VIEW> tracks = make_track_views(&p);
+            for (auto &track : tracks) {
+                for (const auto &feature : features[i]) {
+                    if (feature->track_level) {
+                        feature->compute_track_feature(&p, track, &f, filepath);
+                    }
+                }
+            }
+            for (const auto &feature : features[i]) {
+                if (!feature->track_level) {
+                    feature->compute_piece_feature(&p, tracks, &f, filepath);
+                }
             }
         }
     }
@@ -550,5 +582,48 @@ std::string compute_features(std::string &filepath, std::vector<std::string> &fe
     return util_protobuf::protobuf_to_string(&f);
 }
 
+std::string compute_features(std::string &filepath, std::vector<std::string> &feature_names) {
+    midi_io::MidiParsedData parsed_file(filepath);
+    return compute_features(&parsed_file, filepath, feature_names);
+}
+
+// features of a midi file that is already in memory. name is stored in
+// place of the filepath in the feature metadata
+std::string compute_features(std::string_view midi_bytes, std::string name, std::vector<std::string> &feature_names) {
+    midi_io::MidiParsedData parsed_file(midi_bytes.data(), midi_bytes.size());
+    return compute_features(&parsed_file, name, feature_names);
+}
 
-}
\ No newline at end of file
+// computes the features of many files on num_threads threads. the result of
+// a file that can not be parsed is an empty string
+std::vector<std::string> compute_features_batch(const std::vector<std::string> &filepaths, std::vector<std::string> &feature_names, int num_threads) {
+    for (const auto &feature_name : feature_names) {
+        getFeature(feature_name); // throws on an unknown feature
+    }
+    std::vector<std::string> results(filepaths.size());
+    std::atomic<size_t> next_file(0);
+    auto work = [&]() {
+        size_t index;
+        while ((index = next_file++) < filepaths.size()) {
+            std::string filepath = filepaths[index];
+            try {
+                results[index] = compute_features(filepath, feature_names);
+            }
+            catch (const std::exception &exc) {
+                std::fprintf(stderr, "%s : %s\n", filepath.c_str(), exc.what());
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t=1; t<std::min(num_threads, (int)filepaths.size()); t++) {
+        workers.push_back(std::thread(work));
+    }
+    work();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return results;
+}
+
+
+}
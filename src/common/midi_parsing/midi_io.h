@@ -1,10 +1,13 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <tuple>
 #include <map>
 #include <set>
+#include <string_view>
 
 #include <iostream>
 #include <fstream>
@@ -18,6 +21,7 @@
 #include "../../common/data_structures/encoder_config.h"
 
 #include "../../common/midi_parsing/adjacent_range.h"
+#include "../../common/midi_parsing/smf_reader.h"
 
 #include <google/protobuf/util/json_util.h>
 
@@ -67,23 +71,38 @@ using TRACK_IDENTIFIER = std::tuple<int,int,int,int>;
 
 class MidiParsedData {
 public:
-    smf::MidiFile midi_file;
+    std::vector<SmfTrack> tracks;
     int track_count;
     int ticks_per_quarter_note;
 
     MidiParsedData(std::string file_path) {
-        QUIET_CALL(midi_file.read(file_path));
-        midi_file.makeAbsoluteTicks();
-        midi_file.linkNotePairs();
-        track_count = midi_file.getTrackCount();
-        ticks_per_quarter_note = midi_file.getTPQ();
+        MidiFileBytes bytes(file_path);
+        read(bytes.data(), bytes.size());
+    }
+    MidiParsedData(const char *data, size_t size) {
+        read(data, size);
+    }
+
+private:
+    void read(const char *data, size_t size) {
+        read_smf(data, size, &ticks_per_quarter_note, &tracks);
+        track_count = tracks.size();
     }
 };
 
 class Parser {
 public:
   Parser(std::string filepath, midi::Piece *piece, const std::shared_ptr<data_structures::EncoderConfig> &config) {
-      Parse(filepath, piece, config);
+      MidiParsedData parsed_file = MidiParsedData(filepath);
+      Parse(&parsed_file, piece, config);
+  }
+  Parser(std::string_view midi_bytes, midi::Piece *piece, const std::shared_ptr<data_structures::EncoderConfig> &config) {
+      MidiParsedData parsed_file = MidiParsedData(midi_bytes.data(), midi_bytes.size());
+      Parse(&parsed_file, piece, config);
+  }
+  // a file that is already read can be parsed with several configs
+  Parser(MidiParsedData *parsed_file, midi::Piece *piece, const std::shared_ptr<data_structures::EncoderConfig> &config) {
+      Parse(parsed_file, piece, config);
   }
   static const int DRUM_CHANNEL = 9;
   std::shared_ptr<data_structures::EncoderConfig> ec;
@@ -93,7 +112,7 @@ public:
   int current_track;
   int max_tick;
   int tempo;
-  smf::MidiEvent *mevent;
+  const SmfEvent *mevent;
   std::map<TRACK_IDENTIFIER,int> track_map;
   std::map<int,TRACK_IDENTIFIER> rev_track_map; // transposed of track_map
   std::map<int,std::tuple<int,int,int>> timesigs;
@@ -119,20 +138,23 @@ public:
       for (int track = 0; track < parsed_file->track_count; track++) {
           current_track = track;
           std::fill(instruments.begin(), instruments.end(), 0); // zero instruments
-          for (int event = 0; event < parsed_file->midi_file[track].size(); event++) {
-              mevent = &(parsed_file->midi_file[track][event]);
-              if (mevent->isPatchChange()) {
-                  handle_patch_message(mevent);
-              }
-              else if (mevent->isTimeSignature()) {
-                  handle_time_sig_message(mevent);
-              }
-              else if (mevent->isTempo()) {
-                  tempo = mevent->getTempoBPM();
-                  piece->set_tempo(tempo);
-              }
-              else if (mevent->isNoteOn() || mevent->isNoteOff()) {
-                  handle_note_message(mevent);
+          for (const auto &event : parsed_file->tracks[track]) {
+              mevent = &event;
+              switch (mevent->type) {
+                  case SMF_PATCH_CHANGE:
+                      handle_patch_message(mevent);
+                      break;
+                  case SMF_TIME_SIGNATURE:
+                      handle_time_sig_message(mevent);
+                      break;
+                  case SMF_TEMPO:
+                      tempo = mevent->tempo_bpm();
+                      piece->set_tempo(tempo);
+                      break;
+                  case SMF_NOTE_ON:
+                  case SMF_NOTE_OFF:
+                      handle_note_message(mevent);
+                      break;
               }
           }
       }
@@ -210,12 +232,11 @@ public:
   }
 
     
-  void Parse(std::string filepath, midi::Piece* piece, const std::shared_ptr<data_structures::EncoderConfig> &config) {
-    MidiParsedData parsed_file = MidiParsedData(filepath);
-    SetMemberVariables(config, &parsed_file);
-    FillPiece(piece, &parsed_file, config);
-    ProcessTimeSignatures(&parsed_file);
-    CreateMidiPiece(piece, &parsed_file);
+  void Parse(MidiParsedData* parsed_file, midi::Piece* piece, const std::shared_ptr<data_structures::EncoderConfig> &config) {
+    SetMemberVariables(config, parsed_file);
+    FillPiece(piece, parsed_file, config);
+    ProcessTimeSignatures(parsed_file);
+    CreateMidiPiece(piece, parsed_file);
   }
 
   int infer_voice(int channel, int inst) {
@@ -248,14 +269,14 @@ public:
     return std::make_tuple(it->first, std::get<0>(it->second), std::get<1>(it->second));
   }
 
-  void handle_patch_message(smf::MidiEvent *mevent) {
-    int channel = mevent->getChannelNibble();
-    instruments[channel] = (int)((*mevent)[1]);
+  void handle_patch_message(const SmfEvent *mevent) {
+    int channel = mevent->channel;
+    instruments[channel] = (int)mevent->data1;
   }
 
-  void handle_time_sig_message(smf::MidiEvent *mevent) {
-    int numerator = (*mevent)[3];
-    int denominator = 1<<(*mevent)[4];
+  void handle_time_sig_message(const SmfEvent *mevent) {
+    int numerator = mevent->data1;
+    int denominator = 1<<mevent->data2;
     int barlength = (double)(TPQ * 4 * numerator / denominator);
 
     if (barlength >= 0) {
@@ -283,8 +304,8 @@ public:
     return std::get<2>(time_sig);
   }
 
-  bool is_event_offset(smf::MidiEvent *mevent) {
-    return ((*mevent)[2]==0) || (mevent->isNoteOff());
+  bool is_event_offset(const SmfEvent *mevent) {
+    return (mevent->data2==0) || (mevent->type == SMF_NOTE_OFF);
   }
 
   void add_event(TRACK_IDENTIFIER &track_info, int tick, int pitch, int velocity, int delta) {
@@ -296,17 +317,17 @@ public:
     events[track_map[track_info]].push_back( event );
   }
 
-  void handle_note_message(smf::MidiEvent *mevent) {
-    int channel = mevent->getChannelNibble();
-    int pitch = (int)(*mevent)[1];
-    int velocity = (int)(*mevent)[2];
+  void handle_note_message(const SmfEvent *mevent) {
+    int channel = mevent->channel;
+    int pitch = (int)mevent->data1;
+    int velocity = (int)mevent->data2;
 
-    if ((!mevent->isLinked()) && (channel != 9)) {
+    if ((!mevent->linked) && (channel != 9)) {
       // we do not include unlinked notes unless they are drum
       return;
     }
 
-    if (mevent->isNoteOff()) {
+    if (mevent->type == SMF_NOTE_OFF) {
       velocity = 0; // sometimes this is not the case
     }
 
@@ -362,13 +383,134 @@ void ParseSong(std::string filepath, midi::Piece *midi_piece, const std::shared_
   Parser parser(filepath, midi_piece, encoder_config);
 }
 
-void write_midi(midi::Piece* p, std::string& path, int single_track = -1) {
+// parses a midi file that is already in memory
+void ParseSongBytes(std::string_view midi_bytes, midi::Piece *midi_piece, const std::shared_ptr<data_structures::EncoderConfig> &encoder_config) {
+  Parser parser(midi_bytes, midi_piece, encoder_config);
+}
+
+// the events the Parser uses, as read by midifile
+std::vector<SmfTrack> smf_tracks_from_midifile(smf::MidiFile &midi_file) {
+  std::vector<SmfTrack> tracks(midi_file.getTrackCount());
+  for (int track = 0; track < midi_file.getTrackCount(); track++) {
+    for (int event = 0; event < midi_file[track].size(); event++) {
+      smf::MidiEvent *mevent = &(midi_file[track][event]);
+      SmfEvent e = {mevent->tick, 0, SMF_NOTE_ON, (uint8_t)mevent->getChannelNibble(), 0, 0, mevent->isLinked()};
+      if (mevent->isPatchChange()) {
+        e.type = SMF_PATCH_CHANGE;
+        e.data1 = (*mevent)[1];
+        e.linked = false;
+      }
+      else if (mevent->isTimeSignature()) {
+        e = {mevent->tick, 0, SMF_TIME_SIGNATURE, 0, (*mevent)[3], (*mevent)[4], false};
+      }
+      else if (mevent->isTempo()) {
+        e = {mevent->tick, mevent->getTempoMicroseconds(), SMF_TEMPO, 0, 0, 0, false};
+      }
+      else if (mevent->isNoteOn() || mevent->isNoteOff()) {
+        e.type = mevent->isNoteOff() ? SMF_NOTE_OFF : SMF_NOTE_ON;
+        e.data1 = (*mevent)[1];
+        e.data2 = (*mevent)[2];
+      }
+      else {
+        continue;
+      }
+      tracks[track].push_back(e);
+    }
+  }
+  return tracks;
+}
+
+// reads the files with the native reader and with midifile, and reports
+// the throughput of each and the number of files on which they disagree
+std::map<std::string,double> benchmark_midi_parser(const std::vector<std::string> &paths, int repeats) {
+  std::vector<std::string> files;
+  size_t total_bytes = 0;
+  for (const auto &path : paths) {
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (stream.is_open()) {
+      files.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+      total_bytes += files.back().size();
+    }
+  }
+  std::map<std::string,double> result = {{"files", (double)files.size()}};
+  if ((!total_bytes) || (repeats <= 0)) {
+    return result;
+  }
+
+  auto same_event = [](const SmfEvent &a, const SmfEvent &b) {
+    return (a.tick == b.tick) && (a.value == b.value) && (a.type == b.type) && (a.channel == b.channel) &&
+      (a.data1 == b.data1) && (a.data2 == b.data2) && (a.linked == b.linked);
+  };
+  int mismatches = 0;
+  int native_failed = 0;
+  int midifile_failed = 0;
+  for (const auto &file : files) {
+    std::vector<SmfTrack> tracks;
+    int tpq = 0;
+    try {
+      read_smf(file.data(), file.size(), &tpq, &tracks);
+    }
+    catch (const std::exception &e) {
+      native_failed++;
+      tracks.clear();
+    }
+    smf::MidiFile midi_file;
+    std::stringstream stream(file);
+    bool ok = true;
+    QUIET_CALL(ok = midi_file.read(stream));
+    if (!ok) {
+      midifile_failed++;
+      continue;
+    }
+    midi_file.makeAbsoluteTicks();
+    midi_file.linkNotePairs();
+    std::vector<SmfTrack> expected = smf_tracks_from_midifile(midi_file);
+    bool same = (tpq == midi_file.getTPQ()) && (tracks.size() == expected.size());
+    for (size_t t = 0; same && (t < tracks.size()); t++) {
+      same = std::equal(tracks[t].begin(), tracks[t].end(), expected[t].begin(), expected[t].end(), same_event);
+    }
+    mismatches += !same;
+  }
+
+  auto time = [&](const std::function<void(const std::string&)> &f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) {
+      for (const auto &file : files) {
+        try {
+          f(file);
+        }
+        catch (const std::exception &e) {}
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)total_bytes * repeats / seconds / 1e6;
+  };
+  double native_mbs = time([](const std::string &file) {
+    MidiParsedData parsed_file(file.data(), file.size());
+  });
+  double midifile_mbs = time([](const std::string &file) {
+    smf::MidiFile midi_file;
+    std::stringstream stream(file);
+    QUIET_CALL(midi_file.read(stream));
+    midi_file.makeAbsoluteTicks();
+    midi_file.linkNotePairs();
+  });
+
+  result["native_failed"] = native_failed;
+  result["midifile_failed"] = midifile_failed;
+  result["mismatches"] = mismatches;
+  result["native_mb_per_second"] = native_mbs;
+  result["midifile_mb_per_second"] = midifile_mbs;
+  result["speedup"] = native_mbs / midifile_mbs;
+  return result;
+}
+
+void fill_midi_file(midi::Piece* p, smf::MidiFile &outputfile, int single_track = -1) {
     static const int DRUM_CHANNEL = 9;
 
     if (p->tracks_size() >= 15) {
         throw std::runtime_error("TOO MANY TRACKS FOR MIDI OUTPUT");
     }
-    smf::MidiFile outputfile;
     outputfile.absoluteTicks();
     outputfile.setTicksPerQuarterNote(p->resolution());
     outputfile.addTempo(0, 0, p->tempo());
@@ -402,7 +544,21 @@ void write_midi(midi::Piece* p, std::string& path, int single_track = -1) {
     }
 
     outputfile.sortTracks();         // make sure data is in correct order
+}
+
+void write_midi(midi::Piece* p, std::string& path, int single_track = -1) {
+    smf::MidiFile outputfile;
+    fill_midi_file(p, outputfile, single_track);
     outputfile.write(path.c_str()); // write Standard MIDI File twinkle.mid
 }
+
+// the bytes of the Standard MIDI File write_midi would write
+std::string write_midi_bytes(midi::Piece* p, int single_track = -1) {
+    smf::MidiFile outputfile;
+    fill_midi_file(p, outputfile, single_track);
+    std::ostringstream stream(std::ios::out | std::ios::binary);
+    outputfile.write(stream);
+    return stream.str();
+}
 }
 // END OF NAMESPACE
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A reader for Standard MIDI Files that works on a byte span and only keeps
+// the events the Parser uses. Ticks are absolute, and note events are paired
+// per track the way smf::MidiFile::linkNotePairs does it : a note off closes
+// the most recent open note on of the same channel and key.
+
+// START OF NAMESPACE
+namespace midi_io {
+
+enum SMF_EVENT_TYPE : uint8_t {
+  SMF_NOTE_ON,
+  SMF_NOTE_OFF, // includes note ons with a velocity of 0
+  SMF_PATCH_CHANGE,
+  SMF_TEMPO,
+  SMF_TIME_SIGNATURE
+};
+
+struct SmfEvent {
+  int tick;
+  int value; // microseconds per quarter note for tempo events
+  SMF_EVENT_TYPE type;
+  uint8_t channel;
+  uint8_t data1; // key, program or time signature numerator
+  uint8_t data2; // velocity or time signature denominator (power of two)
+  bool linked; // the note on or off has a matching note off or on
+
+  double tempo_bpm() const {
+    return 60000000. / value;
+  }
+};
+
+using SmfTrack = std::vector<SmfEvent>;
+
+// the bytes of a midi file, memory-mapped when possible
+class MidiFileBytes {
+public:
+  MidiFileBytes(const std::string &path) {
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("COULD NOT OPEN MIDI FILE");
+    }
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+      void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        mapped = (const char*)p;
+        mapped_size = st.st_size;
+      }
+    }
+    ::close(fd);
+    if (mapped) {
+      return;
+    }
+#endif
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+      throw std::runtime_error("COULD NOT OPEN MIDI FILE");
+    }
+    buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+  }
+  ~MidiFileBytes() {
+#ifndef _WIN32
+    if (mapped) {
+      munmap((void*)mapped, mapped_size);
+    }
+#endif
+  }
+  MidiFileBytes(const MidiFileBytes&) = delete;
+  MidiFileBytes &operator=(const MidiFileBytes&) = delete;
+
+  const char *data() const {
+    return mapped ? mapped : buffer.data();
+  }
+  size_t size() const {
+    return mapped ? mapped_size : buffer.size();
+  }
+
+private:
+  const char *mapped = NULL;
+  size_t mapped_size = 0;
+  std::string buffer;
+};
+
+class SmfReader {
+public:
+  // reads the header and the track chunks. a file cut short keeps the
+  // events read before the end, unknown chunks are skipped
+  void read(const char *data, size_t size, int *ticks_per_quarter_note, std::vector<SmfTrack> *tracks) {
+    const uint8_t *p = (const uint8_t*)data;
+    const uint8_t *end = p + size;
+    if ((size < 14) || (std::memcmp(p, "MThd", 4) != 0)) {
+      throw std::runtime_error("INVALID MIDI FILE");
+    }
+    uint32_t header_size = read_u32(p + 4);
+    int num_tracks = read_u16(p + 10);
+    int division = read_u16(p + 12);
+    if (division & 0x8000) {
+      // smpte frames per second times ticks per frame
+      int fps = 256 - ((division >> 8) & 0xff);
+      *ticks_per_quarter_note = fps * (division & 0xff);
+    }
+    else {
+      *ticks_per_quarter_note = division;
+    }
+    p += std::min((size_t)8 + header_size, size);
+
+    tracks->clear();
+    tracks->reserve(num_tracks);
+    while (((int)tracks->size() < num_tracks) && (end - p >= 8)) {
+      uint32_t chunk_size = read_u32(p + 4);
+      bool is_track = (std::memcmp(p, "MTrk", 4) == 0);
+      p += 8;
+      const uint8_t *chunk_end = p + std::min((size_t)chunk_size, (size_t)(end - p));
+      if (is_track) {
+        tracks->emplace_back();
+        read_track(p, chunk_end, &tracks->back());
+      }
+      p = chunk_end;
+    }
+  }
+
+private:
+  static uint32_t read_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+  }
+
+  static int read_u16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+  }
+
+  // variable length quantity of at most 4 bytes. false if the chunk ends
+  static bool read_vlq(const uint8_t *&p, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for (int i=0; i<4; i++) {
+      if (p >= end) {
+        return false;
+      }
+      uint8_t byte = *p++;
+      *value = (*value << 7) | (byte & 0x7f);
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return true;
+  }
+
+  void read_track(const uint8_t *p, const uint8_t *end, SmfTrack *track) {
+    track->reserve((end - p) / 4);
+    int tick = 0;
+    uint8_t running_status = 0;
+    uint32_t delta, length;
+
+    while (p < end) {
+      if (!read_vlq(p, end, &delta) || (p >= end)) {
+        break;
+      }
+      tick += delta;
+      uint8_t status = *p;
+      if (status < 0x80) {
+        // running status, which is not changed by meta and sysex events
+        if (!running_status) {
+          break;
+        }
+        status = running_status;
+      }
+      else {
+        p++;
+      }
+
+      if (status == 0xff) {
+        if (p >= end) {
+          break;
+        }
+        uint8_t meta_type = *p++;
+        if ((!read_vlq(p, end, &length)) || (length > (uint32_t)(end - p))) {
+          break;
+        }
+        if (meta_type == 0x2f) {
+          break; // end of track
+        }
+        if ((meta_type == 0x51) && (length >= 3)) {
+          int usec = (p[0] << 16) | (p[1] << 8) | p[2];
+          if (usec > 0) {
+            add(track, tick, SMF_TEMPO, 0, 0, 0, usec);
+          }
+        }
+        else if ((meta_type == 0x58) && (length == 4)) {
+          add(track, tick, SMF_TIME_SIGNATURE, 0, p[0], p[1], 0);
+        }
+        p += length;
+        continue;
+      }
+      if ((status == 0xf0) || (status == 0xf7)) {
+        if ((!read_vlq(p, end, &length)) || (length > (uint32_t)(end - p))) {
+          break;
+        }
+        p += length;
+        continue;
+      }
+      if (status >= 0xf0) {
+        break; // system common and real time messages are not valid in a file
+      }
+
+      running_status = status;
+      uint8_t command = status & 0xf0;
+      uint8_t channel = status & 0x0f;
+      int num_data = ((command == 0xc0) || (command == 0xd0)) ? 1 : 2;
+      if (end - p < num_data) {
+        break;
+      }
+      uint8_t data1 = p[0];
+      uint8_t data2 = (num_data == 2) ? p[1] : 0;
+      p += num_data;
+
+      if (command == 0x90) {
+        if (data2 > 0) {
+          note_on(track, tick, channel, data1, data2);
+        }
+        else {
+          note_off(track, tick, channel, data1, data2);
+        }
+      }
+      else if (command == 0x80) {
+        note_off(track, tick, channel, data1, data2);
+      }
+      else if (command == 0xc0) {
+        add(track, tick, SMF_PATCH_CHANGE, channel, data1, 0, 0);
+      }
+    }
+
+    // notes still open at the end of the track stay unlinked
+    for (const auto &key : open_keys) {
+      open_notes[key].clear();
+    }
+    open_keys.clear();
+  }
+
+  static void add(SmfTrack *track, int tick, SMF_EVENT_TYPE type, uint8_t channel, uint8_t data1, uint8_t data2, int value) {
+    track->push_back({tick, value, type, channel, data1, data2, false});
+  }
+
+  void note_on(SmfTrack *track, int tick, uint8_t channel, uint8_t key, uint8_t velocity) {
+    int index = channel * 128 + key;
+    if (open_notes[index].empty()) {
+      open_keys.push_back(index);
+    }
+    open_notes[index].push_back(track->size());
+    add(track, tick, SMF_NOTE_ON, channel, key, velocity, 0);
+  }
+
+  void note_off(SmfTrack *track, int tick, uint8_t channel, uint8_t key, uint8_t velocity) {
+    add(track, tick, SMF_NOTE_OFF, channel, key, velocity, 0);
+    std::vector<int> &open = open_notes[channel * 128 + key];
+    if (!open.empty()) {
+      (*track)[open.back()].linked = true;
+      track->back().linked = true;
+      open.pop_back();
+    }
+  }
+
+  std::vector<int> open_notes[16 * 128]; // indices of the open note ons for each channel and key
+  std::vector<int> open_keys;
+};
+
+// reads a midi file from memory. the reader keeps its buffers between calls
+// on the same thread
+void read_smf(const char *data, size_t size, int *ticks_per_quarter_note, std::vector<SmfTrack> *tracks) {
+  static thread_local SmfReader reader;
+  reader.read(data, size, ticks_per_quarter_note, tracks);
+}
+
+}
+// END OF NAMESPACE
@@ -214,6 +214,7 @@ namespace util_protobuf {
 		UpdateHasNotes(midi_piece);
 		midi_piece->clear_internal_valid_segments();
 		midi_piece->clear_internal_valid_tracks();
+		midi_piece->clear_internal_valid_tracks_v2();
 
 		if (midi_piece->tracks_size() < min_tracks) { return; } // no valid tracks
 
@@ -499,6 +500,16 @@ namespace util_protobuf {
 		return std::make_pair(min_pitch, max_pitch);
 	}
 
+	int select_random_transpose(std::tuple<int, int> pitch_ext, std::mt19937* engine) {
+		std::vector<int> choices;
+		for (int tr = -6; tr < 6; tr++) {
+			if ((std::get<0>(pitch_ext) + tr >= 0) && (std::get<1>(pitch_ext) + tr < 128)) {
+				choices.push_back(tr);
+			}
+		}
+		return choices[random_on_range(choices.size(), engine)];
+	}
+
 	void select_random_segment_indices(midi::Piece* x, int num_bars, int min_tracks, int max_tracks, std::mt19937* engine, std::vector<int>& valid_tracks, int* start) {
 		UpdateValidSegments(x, num_bars, min_tracks);
 
@@ -575,9 +586,7 @@ namespace util_protobuf {
 		prune_tracks(x, valid_tracks, bars);
 	}
 
-	std::set<std::tuple<int, int>> make_bar_mask(midi::Piece* x, float proportion, std::mt19937* engine) {
-		int num_tracks = x->tracks_size();
-		int num_bars = GetNumBars(x);
+	std::set<std::tuple<int, int>> make_bar_mask(int num_tracks, int num_bars, float proportion, std::mt19937* engine) {
 		int max_filled_bars = (int)round(num_tracks * num_bars * proportion);
 		int n_fill = random_on_range(max_filled_bars, engine);
 		std::vector<std::tuple<int, int>> choices;
@@ -594,6 +603,10 @@ namespace util_protobuf {
 		return mask;
 	}
 
+	std::set<std::tuple<int, int>> make_bar_mask(midi::Piece* x, float proportion, std::mt19937* engine) {
+		return make_bar_mask(x->tracks_size(), GetNumBars(x), proportion, engine);
+	}
+
 	std::string get_piece_string(midi::Piece* x) {
 		std::string output;
 		google::protobuf::util::JsonPrintOptions opt;
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iostream>
 #include <cstring>
+#include <stdexcept>
 #include "../../../libraries/protobuf/build/midi.pb.h"
 #include "../../../include/dataset_creation/dataset_manipulation/bytes_to_file.h"
 #include "../../../include/dataset_creation/compression/lz4.h"
@@ -12,6 +13,7 @@ namespace dataset_manipulation {
 	BytesToFile::BytesToFile(std::string user_filepath_) {
 		filepath_ = user_filepath_;
 		header_filepath_ = user_filepath_ + ".header";
+		index_filepath_ = user_filepath_ + ".index";
 		flush_count_ = 0;
 		can_write = false;
 	}
@@ -20,6 +22,7 @@ namespace dataset_manipulation {
 		if (can_write) { return; }
 		// check that the current file is empty unless force flag is present ?
 		file_stream_.open(filepath_, std::ios::out | std::ios::binary);
+		index_writer_.open(index_filepath_, false, 0);
 		can_write = true;
 	}
 
@@ -27,6 +30,14 @@ namespace dataset_manipulation {
 		//file_stream_.open(filepath_, std::ios::out | std::ios::binary);
 		enableWrite();
 		
+		midi::Item* item;
+		switch (split_id) {
+		case 0: item = dataset_split_protobuf_.add_train(); break;
+		case 1: item = dataset_split_protobuf_.add_valid(); break;
+		case 2: item = dataset_split_protobuf_.add_test(); break;
+		default: throw std::runtime_error("INVALID SPLIT ID");
+		}
+
 		//Start compression ==============================
 		size_t stream_position_start = file_stream_.tellp();
 		size_t source_size = sizeof(char) * bytes_as_string.size();
@@ -39,25 +50,28 @@ namespace dataset_manipulation {
 		size_t stream_position_end = file_stream_.tellp();
 		// end compression ===============================
 
-		midi::Item* item;
-		switch (split_id) {
-		case 0: item = dataset_split_protobuf_.add_train(); break;
-		case 1: item = dataset_split_protobuf_.add_valid(); break;
-		case 2: item = dataset_split_protobuf_.add_test(); break;
-		}
 		item->set_start(stream_position_start);
 		item->set_end(stream_position_end);
 		item->set_src_size(source_size);
+		index_writer_.append(makeIndexEntry(stream_position_start, destination_size, source_size,
+			contentHash(bytes_as_string.data(), bytes_as_string.size()), 0, 0, split_id, INDEX_RECORD));
 		flush_count_++;
 
 		if (flush_count_ >= 1000) {
-			writeFile();
+			flush();
 			flush_count_ = 0;
 		};
 	}
 
-	void BytesToFile::writeFile() {
+	// the records written so far stay readable through the index if the
+	// header is never written
+	void BytesToFile::flush() {
 		file_stream_.flush();
+		index_writer_.flush();
+	}
+
+	void BytesToFile::writeFile() {
+		flush();
 		//TODO: Check if the header stuff actually makes sense... we might not be using the header ever.
 		header_file_stream_.open(header_filepath_, std::ios::out | std::ios::binary);
 		if (!dataset_split_protobuf_.SerializeToOstream(&header_file_stream_)) {
@@ -70,6 +84,7 @@ namespace dataset_manipulation {
 	{
 		writeFile();
 		file_stream_.close();
+		index_writer_.close();
 		header_file_stream_.close();
 	}
 }
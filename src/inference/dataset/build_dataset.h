@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "lz4.h"
+#include "jagged.h"
+#include "../../common/midi_parsing/midi_io.h"
+#include "../../common/data_structures/train_config.h"
+
+// START OF NAMESPACE
+namespace compression {
+
+// XXH3 over a canonical note stream of a piece, so that files which only
+// differ in their encoding (track order, meta events, running status ...)
+// get the same hash. each track is hashed on its own and the sorted track
+// hashes are hashed together
+uint64_t hash_piece_notes(const midi::Piece &p) {
+  std::vector<uint64_t> track_hashes;
+  std::vector<int32_t> stream;
+  for (const auto &track : p.tracks()) {
+    stream.clear();
+    stream.push_back(track.track_type());
+    stream.push_back(track.instrument());
+    for (const auto &bar : track.bars()) {
+      stream.push_back(-1);
+      stream.push_back(bar.ts_numerator());
+      stream.push_back(bar.ts_denominator());
+      for (const auto &event_index : bar.events()) {
+        const midi::Event &e = p.events(event_index);
+        stream.push_back(e.time());
+        stream.push_back(e.pitch());
+        stream.push_back(e.velocity());
+        stream.push_back(e.delta());
+      }
+    }
+    track_hashes.push_back(XXH3_64bits(stream.data(), stream.size() * sizeof(int32_t)));
+  }
+  std::sort(track_hashes.begin(), track_hashes.end());
+  track_hashes.push_back(p.resolution());
+  return XXH3_64bits(track_hashes.data(), track_hashes.size() * sizeof(uint64_t));
+}
+
+// parses a midi file held in memory into a serialized midi::Piece with its
+// valid segments and metadata labels (json). returns the number of valid
+// segments
+int midi_bytes_to_piece_bytes(std::string_view midi_bytes, data_structures::TrainConfig *tc, const std::string &metadata_labels, std::string *out, uint64_t *note_hash=NULL) {
+  midi::Piece p;
+  auto config = std::make_shared<data_structures::EncoderConfig>();
+  config->resolution = tc->resolution;
+  config->decode_resolution = tc->decode_resolution;
+  config->delta_resolution = tc->delta_resolution;
+  config->use_microtiming = tc->use_microtiming;
+  midi_io::ParseSongBytes(midi_bytes, &p, config);
+  if (note_hash) {
+    *note_hash = hash_piece_notes(p);
+  }
+  util_protobuf::UpdateValidSegments(&p, tc->num_bars, tc->min_tracks);
+  if (!p.internal_valid_segments_size()) {
+    out->clear();
+    return 0;
+  }
+  google::protobuf::util::JsonStringToMessage(metadata_labels, p.mutable_internal_metadata_labels());
+  p.SerializeToString(out);
+  return p.internal_valid_segments_size();
+}
+
+int midi_to_piece_bytes(const std::string &filepath, data_structures::TrainConfig *tc, const std::string &metadata_labels, std::string *out, uint64_t *note_hash=NULL) {
+  midi_io::MidiFileBytes bytes(filepath);
+  return midi_bytes_to_piece_bytes(std::string_view(bytes.data(), bytes.size()), tc, metadata_labels, out, note_hash);
+}
+
+// FNV-1a over the inputs, so a resumed build can check that it gets the
+// same inputs in the same order
+uint64_t hash_dataset_inputs(const std::vector<std::string> &paths, const std::vector<int> &split_ids) {
+  uint64_t h = dataset_manipulation::fnv1a(NULL, 0); // offset basis
+  for (size_t i=0; i<paths.size(); i++) {
+    h = dataset_manipulation::fnv1a(paths[i].data(), paths[i].size() + 1, h);
+    h = dataset_manipulation::fnv1a((const char*)&split_ids[i], sizeof(int), h);
+  }
+  return h;
+}
+
+// Builds a Jagged dataset from midi files. num_threads workers parse,
+// validate and compress the files while the calling thread writes the
+// records in input order, so the output does not depend on the number of
+// threads. With resume the build continues after the inputs consumed
+// before the last index flush of a previous build of the same inputs.
+//
+// The XXH3 hashes of every file and of its note stream are stored in the
+// index. A file is a duplicate when either hash matches a record written
+// before it, whatever their splits. Duplicates are counted, and with dedup
+// they are not written, so that the same piece can not end up in two splits.
+// Files whose bytes match a record already written are then not parsed.
+//
+// Records are compressed with lz4_dictionary when it is not empty (see
+// train_lz4_dictionary). A resumed build must use the same dictionary.
+std::map<std::string,double> build_dataset(const std::vector<std::string> &paths, const std::vector<int> &split_ids, const std::vector<std::string> &metadata_labels, data_structures::TrainConfig *tc, const std::string &output, int num_threads, bool resume, bool dedup, const std::string &lz4_dictionary) {
+  if ((paths.size() != split_ids.size()) || (paths.size() != metadata_labels.size())) {
+    throw std::runtime_error("PATHS, SPLIT_IDS AND METADATA_LABELS MUST HAVE THE SAME LENGTH");
+  }
+  for (const auto &split_id : split_ids) {
+    if ((split_id < 0) || (split_id > 2)) {
+      throw std::runtime_error("INVALID SPLIT ID");
+    }
+  }
+
+  struct RESULT {
+    bool ok = false;
+    bool duplicate = false;
+    std::string data;
+    size_t src_size = 0;
+    uint64_t content_hash = 0;
+    uint64_t note_hash = 0;
+    int num_segments = 0;
+    size_t input_size = 0;
+  };
+
+  uint64_t inputs_hash = hash_dataset_inputs(paths, split_ids);
+  Jagged jag(output);
+  size_t start = resume ? jag.resume_write(inputs_hash) : 0;
+  if (start == 0) {
+    jag.set_lz4_dictionary(lz4_dictionary);
+    jag.enable_write();
+  }
+  else if (jag.get_lz4_dictionary() != lz4_dictionary) {
+    throw std::runtime_error("LZ4 DICTIONARY DOES NOT MATCH THE DATASET BEING RESUMED");
+  }
+  size_t num_inputs = paths.size();
+  start = std::min(start, num_inputs);
+
+  // hashes of the records written so far, guarded by mtx
+  std::set<uint64_t> seen_content;
+  std::set<uint64_t> seen_notes;
+  if (start > 0) {
+    std::vector<dataset_manipulation::IndexEntry> entries;
+    dataset_manipulation::readIndex(output + ".index", std::filesystem::file_size(output), entries);
+    for (const auto &entry : entries) {
+      if (entry.kind == dataset_manipulation::INDEX_RECORD) {
+        seen_content.insert(entry.content_hash);
+        seen_notes.insert(entry.note_hash);
+      }
+    }
+  }
+  num_threads = std::max(num_threads, 1);
+  size_t window = 16 * num_threads;
+
+  std::mutex mtx;
+  std::condition_variable ready_cv;
+  std::condition_variable space_cv;
+  std::map<size_t,RESULT> results;
+  size_t next_input = start;
+  size_t next_write = start;
+
+  std::vector<std::thread> workers;
+  for (int t=0; t<num_threads; t++) {
+    workers.push_back(std::thread([&]() {
+      std::string piece;
+      while (true) {
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          space_cv.wait(lock, [&]() {
+            return (next_input >= num_inputs) || (next_input < next_write + window);
+          });
+          if (next_input >= num_inputs) {
+            return;
+          }
+          index = next_input++;
+        }
+        RESULT r;
+        try {
+          midi_io::MidiFileBytes raw(paths[index]);
+          r.input_size = raw.size();
+          r.content_hash = dataset_manipulation::contentHash(raw.data(), raw.size());
+          if (dedup) {
+            std::lock_guard<std::mutex> lock(mtx);
+            r.duplicate = seen_content.find(r.content_hash) != seen_content.end();
+          }
+          if (!r.duplicate) {
+            r.num_segments = midi_bytes_to_piece_bytes(std::string_view(raw.data(), raw.size()), tc, metadata_labels[index], &piece, &r.note_hash);
+          }
+          if (r.num_segments > 0) {
+            r.src_size = piece.size();
+            jag.compress_record(piece.data(), piece.size(), &r.data);
+            r.ok = true;
+          }
+        }
+        catch (const std::exception &exc) {
+          std::fprintf(stderr, "%s : %s\n", paths[index].c_str(), exc.what());
+        }
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          results[index] = std::move(r);
+        }
+        ready_cv.notify_all();
+      }
+    }));
+  }
+
+  // single ordered writer
+  auto t0 = std::chrono::steady_clock::now();
+  auto last_report = t0;
+  size_t num_written = 0;
+  size_t num_duplicates = 0;
+  size_t input_bytes = 0;
+  size_t output_bytes = 0;
+  auto report = [&](bool done) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    size_t files = next_write - start;
+    std::printf("build_dataset : %zu/%zu files, %zu written, %zu duplicates, %.1f files/s, %.2f MB/s%s", next_write, num_inputs, num_written, num_duplicates, seconds > 0 ? files / seconds : 0., seconds > 0 ? input_bytes / seconds / 1e6 : 0., done ? "\n" : "\r");
+    std::fflush(stdout);
+  };
+  auto stop_workers = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      next_input = num_inputs;
+    }
+    space_cv.notify_all();
+    for (auto &t : workers) {
+      t.join();
+    }
+  };
+  try {
+    while (next_write < num_inputs) {
+      RESULT r;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        ready_cv.wait(lock, [&]() {
+          return results.find(next_write) != results.end();
+        });
+        auto it = results.find(next_write);
+        r = std::move(it->second);
+        results.erase(it);
+      }
+      // the progress is recorded before the record, so an index flush
+      // triggered by this record already counts it
+      jag.set_build_inputs(next_write + 1, inputs_hash);
+      bool duplicate = r.duplicate;
+      if (r.ok) {
+        std::lock_guard<std::mutex> lock(mtx);
+        duplicate = (seen_content.find(r.content_hash) != seen_content.end()) || (seen_notes.find(r.note_hash) != seen_notes.end());
+      }
+      num_duplicates += duplicate;
+      if ((r.ok) && (!(dedup && duplicate))) {
+        jag.append_compressed(r.data.data(), r.data.size(), r.src_size, split_ids[next_write], r.content_hash, r.note_hash, r.num_segments);
+        num_written++;
+        output_bytes += r.data.size();
+      }
+      input_bytes += r.input_size;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (r.ok) {
+          seen_content.insert(r.content_hash);
+          seen_notes.insert(r.note_hash);
+        }
+        next_write++;
+      }
+      space_cv.notify_all();
+      auto now = std::chrono::steady_clock::now();
+      if (std::chrono::duration<double>(now - last_report).count() > 2.) {
+        report(false);
+        last_report = now;
+      }
+    }
+  }
+  catch (...) {
+    stop_workers();
+    throw;
+  }
+  stop_workers();
+  jag.set_build_inputs(num_inputs, inputs_hash);
+  jag.close();
+  report(true);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  return {
+    {"inputs", (double)num_inputs},
+    {"resumed_from", (double)start},
+    {"processed", (double)(num_inputs - start)},
+    {"written", (double)num_written},
+    {"skipped", (double)(num_inputs - start - num_written)},
+    {"duplicates", (double)num_duplicates},
+    {"input_bytes", (double)input_bytes},
+    {"output_bytes", (double)output_bytes},
+    {"seconds", seconds},
+    {"files_per_second", seconds > 0 ? (num_inputs - start) / seconds : 0.},
+    {"mb_per_second", seconds > 0 ? input_bytes / seconds / 1e6 : 0.}
+  };
+}
+
+}
+// END OF NAMESPACE
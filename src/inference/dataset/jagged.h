@@ -1,18 +1,40 @@
+#pragma once
+
 #include <iostream>
 #include <vector>
 #include <tuple>
 #include <map>
 #include <set>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <google/protobuf/util/json_util.h>
 
 #include "lz4.h"
+#include "lz4_dictionary.h"
 #include "../../../libraries/protobuf/build/midi.pb.h"
 #include "../../common/encoder/encoder_all.h"
 #include "../../common/midi_parsing/midi_io.h"
 #include "../enum/encoder_types.h"
 #include "../../common/data_structures/train_config.h"
 #include "../random.h"
+#include "token_shard.h"
+#include "split_index.h"
+#include "../../../include/dataset_creation/dataset_manipulation/dataset_index.h"
 
 // START OF NAMESPACE
 namespace compression {
@@ -57,12 +79,69 @@ public:
   std::vector<std::vector<T>> batch;
 };
 
+// Packs several sequences into each of nrows rows instead of padding one
+// sequence per row. A sequence goes into the first row with enough room and
+// the batch is complete once a sequence does not fit in any row. add leaves
+// such a sequence untouched so the caller can start the next batch with it.
+// doc holds the 1-based index of the sequence within its row, 0 for padding.
+template <class T>
+class Packer {
+public:
+  Packer( int mmaxlen, int nrows, std::mt19937 *e) {
+    maxlen = mmaxlen;
+    max_rows = nrows;
+    batch_maxlen = 0;
+    num_sequences = 0;
+    engine = e;
+  }
+  bool add( std::vector<T> &seq ) {
+    size_t len = std::min(seq.size(), maxlen);
+    size_t row = 0;
+    while ((row < batch.size()) && (batch[row].size() + len > maxlen)) {
+      row++;
+    }
+    if (row == batch.size()) {
+      if ((int)batch.size() == max_rows) {
+        return false;
+      }
+      batch.push_back( std::vector<T>() );
+      doc.push_back( std::vector<int>() );
+      docs_in_row.push_back( 0 );
+    }
+    size_t off = 0;
+    if (seq.size() > maxlen) {
+      off = random_on_range((int)seq.size() - maxlen + 1, engine);
+    }
+    docs_in_row[row]++;
+    batch[row].insert(batch[row].end(), seq.begin() + off, seq.begin() + off + len);
+    doc[row].insert(doc[row].end(), len, docs_in_row[row]);
+    batch_maxlen = std::max(batch[row].size(), batch_maxlen);
+    num_sequences++;
+    return true;
+  }
+  void pad( T value ) {
+    for (size_t i=0; i<batch.size(); i++) {
+      doc[i].insert(doc[i].end(), batch_maxlen-batch[i].size(), 0);
+      batch[i].insert(batch[i].end(), batch_maxlen-batch[i].size(), value);
+    }
+  }
+  std::mt19937 *engine;
+  size_t maxlen;
+  int max_rows;
+  size_t batch_maxlen;
+  size_t num_sequences;
+  std::vector<int> docs_in_row;
+  std::vector<std::vector<T>> batch;
+  std::vector<std::vector<int>> doc;
+};
+
 
 class Jagged {
 public:
   Jagged(std::string filepath_) {
     filepath = filepath_;
     header_filepath = filepath_ + ".header";
+    index_filepath = filepath_ + ".index";
     can_write = false;
     can_read = false;
     flush_count = 0;
@@ -70,15 +149,52 @@ public:
     min_tracks = 2;
     max_tracks = 12;
     max_seq_len = 2048;
+    use_mmap = true;
+    map_data = NULL;
+    map_size = 0;
+    prefetch_workers = 0;
+    prefetch_depth = 4;
+    packing = false;
+    sampling = enums::SAMPLE_UNIFORM;
 
-    engine.seed(time(NULL));
+    seed = time(NULL);
+    engine.seed(seed);
 
     encoder = NULL;
   }
 
-  void set_seed(int seed) {
+  ~Jagged() {
+    stop_prefetch();
+    unmap();
+  }
+
+  void set_seed(int s) {
+    stop_prefetch();
+    pack_carry.clear();
+    seed = s;
     srand(seed); // set the seed
     engine.seed(seed);
+    for (auto &split : splits) {
+      split.reset_epoch();
+    }
+  }
+
+  // how the record of each example is picked (see enums::SAMPLING_MODE).
+  // with SAMPLE_EPOCH every batch reads its own slots of the epoch (see
+  // EPOCH_CURSOR), so with prefetching the records of a batch do not depend
+  // on the scheduling
+  void set_sampling(enums::SAMPLING_MODE mode) {
+    stop_prefetch();
+    sampling = mode;
+    for (auto &split : splits) {
+      split.reset_epoch();
+    }
+  }
+
+  // number of completed epochs of a split with SAMPLE_EPOCH
+  uint64_t get_epoch(size_t split_id) {
+    enable_read();
+    return get_split(split_id).get_epoch();
   }
 
   void set_num_bars(int x) {
@@ -94,52 +210,121 @@ public:
   }
 
   void set_max_seq_len(int x) {
+    stop_prefetch();
+    pack_carry.clear();
     max_seq_len = x;
   }
 
+  // pack several segments into each max_seq_len row (see Packer). the
+  // batches then also carry position and document ids. a segment that ends
+  // a batch because it fits in no row is kept per split and encoder and
+  // starts the next batch, so long segments are not dropped more often
+  // than short ones
+  void set_packing(bool x) {
+    stop_prefetch();
+    pack_carry.clear();
+    packing = x;
+  }
+
+  // read records through a read-only shared mapping of the .arr file instead
+  // of an fstream. worker processes reading the same file then share one
+  // copy in the page cache. must be called before the first read
+  void set_use_mmap(bool x) {
+    assert(can_read == false);
+    use_mmap = x;
+  }
+
+  // the header is only written on close. records are indexed as they are
+  // appended (see dataset_manipulation::IndexWriter), and a header holding
+  // only the dataset options is written up front so that a dataset that was
+  // not closed can still be opened
   void enable_write() {
     assert(can_read == false);
     if (can_write) { return; }
     // check that the current file is empty unless force flag is present ?
     fs.open(filepath, std::ios::out | std::ios::binary);
+    index_writer.open(index_filepath, false, 0);
+    write_header();
     can_write = true;
   }
   
   void enable_read() {
     assert(can_write == false);
     if (can_read) { return; }
-    fs.open(filepath, std::ios::in | std::ios::binary);
-    if (!fs.is_open()) {
-      throw std::runtime_error("COULD NOT OPEN FILE!");
+    if ((!use_mmap) || (!map_file())) {
+      fs.open(filepath, std::ios::in | std::ios::binary);
+      if (!fs.is_open()) {
+        throw std::runtime_error("COULD NOT OPEN FILE!");
+      }
     }
     header_fs.open(header_filepath, std::ios::in | std::ios::binary);
     header.ParseFromIstream(&header_fs);
+    header_fs.close();
+    load_dictionary();
+    load_index();
+    load_splits();
     can_read = true;
   }
 
-  void append(std::string &s, size_t split_id) {
+  // compress every record against a shared dictionary (see
+  // train_lz4_dictionary), stored in the header. must be set before the
+  // first record is written
+  void set_lz4_dictionary(const std::string &d) {
+    assert(can_read == false);
+    if (header.train_size() + header.valid_size() + header.test_size()) {
+      throw std::runtime_error("LZ4 DICTIONARY MUST BE SET BEFORE WRITING");
+    }
+    if (d.size()) {
+      header.set_lz4_dictionary(d);
+    }
+    else {
+      header.clear_lz4_dictionary();
+    }
+    load_dictionary();
+    if (can_write) {
+      write_header();
+    }
+  }
+
+  std::string get_lz4_dictionary() {
+    return header.lz4_dictionary();
+  }
+
+  // compresses a record the way append does. safe to call from several
+  // threads while another one appends
+  void compress_record(const char *src, size_t size, std::string *out) const {
+    lz4_compress_record(dictionary.get(), src, size, out);
+  }
+
+  // num_segments is the number of valid segments of the record, used by
+  // SAMPLE_WEIGHTED (0 if unknown)
+  void append(std::string &s, size_t split_id, int num_segments) {
+    std::string &dst = compress_buffer();
+    compress_record(s.data(), s.size(), &dst);
+    append_compressed(dst.data(), dst.size(), s.size(), split_id, dataset_manipulation::contentHash(s.data(), s.size()), 0, num_segments);
+  }
+
+  // appends a record that was already compressed with compress_record. the hashes are
+  // stored in the index (see dataset_manipulation::IndexEntry)
+  void append_compressed(const char *data, size_t size, size_t src_size, size_t split_id, uint64_t content_hash, uint64_t note_hash, int num_segments) {
     enable_write();
 
-    size_t start = fs.tellp();
-    // begin compress ===============================
-    size_t src_size = sizeof(char)*s.size();
-    size_t dst_capacity = LZ4_compressBound(src_size);
-    char* dst = new char[dst_capacity];
-    size_t dst_size = LZ4_compress_default(
-      (char*)s.c_str(), dst, src_size, dst_capacity);
-    fs.write(dst, dst_size);
-    delete[] dst;
-    // end compress =================================
-    size_t end = fs.tellp();
     midi::Item *item;
     switch (split_id) {
       case 0: item = header.add_train(); break;
       case 1: item = header.add_valid(); break;
       case 2: item = header.add_test(); break;
+      default: throw std::runtime_error("INVALID SPLIT ID");
     }
+    size_t start = fs.tellp();
+    fs.write(data, size);
+    size_t end = fs.tellp();
     item->set_start(start);
     item->set_end(end);
     item->set_src_size(src_size);
+    item->set_num_segments(num_segments);
+    index_writer.append(dataset_manipulation::makeIndexEntry(
+      start, size, src_size, content_hash, note_hash, num_segments, split_id, dataset_manipulation::INDEX_RECORD));
     flush_count++;
 
     if (flush_count >= 1000) {
@@ -148,23 +333,189 @@ public:
     }
   }
 
+  // reopens a dataset written by build_dataset for appending. records after
+  // the last progress entry of the index are dropped. returns the number of
+  // inputs that were consumed, or 0 if there is nothing to resume
+  uint64_t resume_write(uint64_t inputs_hash) {
+    assert(can_read == false);
+    if (can_write) {
+      return header.build_inputs();
+    }
+    std::fstream hfs(header_filepath, std::ios::in | std::ios::binary);
+    midi::Dataset h;
+    std::vector<dataset_manipulation::IndexEntry> entries;
+    std::error_code ec;
+    uint64_t data_size = std::filesystem::file_size(filepath, ec);
+    if (hfs.is_open()) {
+      h.ParseFromIstream(&hfs);
+    }
+    if ((ec) || (!dataset_manipulation::readIndex(index_filepath, data_size, entries))) {
+      enable_write();
+      return 0;
+    }
+    size_t num_entries = 0;
+    for (size_t i=0; i<entries.size(); i++) {
+      if (entries[i].kind == dataset_manipulation::INDEX_PROGRESS) {
+        num_entries = i + 1;
+      }
+    }
+    if (num_entries == 0) {
+      enable_write();
+      return 0;
+    }
+    const dataset_manipulation::IndexEntry &progress = entries[num_entries - 1];
+    if (progress.content_hash != inputs_hash) {
+      throw std::runtime_error("INPUTS DO NOT MATCH THE DATASET BEING RESUMED");
+    }
+    entries.resize(num_entries);
+    set_items(entries, &h);
+    h.set_build_inputs(progress.start);
+    h.set_build_inputs_hash(progress.content_hash);
+    uint64_t end = 0;
+    for (const auto &entry : entries) {
+      if (entry.kind == dataset_manipulation::INDEX_RECORD) {
+        end = std::max(end, entry.start + entry.length);
+      }
+    }
+    std::filesystem::resize_file(filepath, end);
+    index_writer.open(index_filepath, true, num_entries);
+    fs.open(filepath, std::ios::in | std::ios::out | std::ios::binary);
+    if (!fs.is_open()) {
+      throw std::runtime_error("COULD NOT OPEN FILE!");
+    }
+    fs.seekp(end);
+    header = h;
+    load_dictionary();
+    can_write = true;
+    return header.build_inputs();
+  }
+
+  // progress of build_dataset, stored in the index on the next flush
+  void set_build_inputs(uint64_t num_inputs, uint64_t inputs_hash) {
+    header.set_build_inputs(num_inputs);
+    header.set_build_inputs_hash(inputs_hash);
+  }
+
   std::string read(size_t index, size_t split_id) {
+    std::string x;
+    read_into(index, split_id, &x);
+    return x;
+  }
+
+  // decompresses a record into out, reusing its capacity. with a mapped
+  // file the record is decompressed straight from the mapping
+  void read_into(size_t index, size_t split_id, std::string *out) {
     enable_read();
 
-    midi::Item item;
-    switch (split_id) {
-      case 0: item = header.train(index); break;
-      case 1: item = header.valid(index); break;
-      case 2: item = header.test(index); break;
-    }
-    size_t csize = item.end() - item.start();
-    char* src = new char[csize/sizeof(char)];
-    fs.seekg(item.start());
-    fs.read(src, csize);
-    std::string x(item.src_size(), ' ');
-    LZ4_decompress_safe(src,(char*)x.c_str(),csize,item.src_size());
-    delete[] src;
-    return x;
+    const SPLIT_INDEX &split = get_split(split_id);
+    if (index >= split.size()) {
+      throw std::runtime_error("INVALID INDEX");
+    }
+    uint64_t start = split.start[index];
+    size_t csize = split.length[index];
+    size_t src_size = split.src_size[index];
+    out->resize(src_size);
+    const char *src;
+    if (map_data) {
+      if (start + csize > map_size) {
+        throw std::runtime_error("RECORD IS OUTSIDE OF DATASET FILE");
+      }
+      src = map_data + start;
+    }
+    else {
+      std::string &buffer = read_buffer();
+      buffer.resize(csize);
+      std::lock_guard<std::mutex> lock(fs_mtx);
+      fs.seekg(start);
+      fs.read(&buffer[0], csize);
+      src = buffer.data();
+    }
+    int size = dictionary ?
+      dictionary->decompress(src, csize, &(*out)[0], src_size) :
+      LZ4_decompress_safe(src, &(*out)[0], csize, src_size);
+    if (size != (int)src_size) {
+      throw std::runtime_error("FAILED TO DECOMPRESS RECORD");
+    }
+  }
+
+  // compression ratio and throughput of the first num_records records of a
+  // split when compressed with dictionary (no dictionary if empty)
+  std::map<std::string,double> benchmark_lz4(const std::string &d, size_t split_id, int num_records, int repeats) {
+    std::vector<std::string> records(std::min(num_records, get_split_size(split_id)));
+    size_t src_bytes = 0;
+    for (size_t i=0; i<records.size(); i++) {
+      read_into(i, split_id, &records[i]);
+      src_bytes += records[i].size();
+    }
+    if ((!src_bytes) || (repeats <= 0)) {
+      return {};
+    }
+    std::unique_ptr<LZ4_DICTIONARY> dict;
+    if (d.size()) {
+      dict = std::make_unique<LZ4_DICTIONARY>(d);
+    }
+    std::vector<std::string> compressed(records.size());
+    std::string out;
+    auto time = [&](const std::function<void()> &f) {
+      auto start = std::chrono::steady_clock::now();
+      for (int r=0; r<repeats; r++) {
+        f();
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      return (double)src_bytes * repeats / seconds / 1e6;
+    };
+    double compress_mbs = time([&]() {
+      for (size_t i=0; i<records.size(); i++) {
+        lz4_compress_record(dict.get(), records[i].data(), records[i].size(), &compressed[i]);
+      }
+    });
+    size_t compressed_bytes = 0;
+    for (const auto &c : compressed) {
+      compressed_bytes += c.size();
+    }
+    double decompress_mbs = time([&]() {
+      for (size_t i=0; i<records.size(); i++) {
+        out.resize(records[i].size());
+        int size = dict ?
+          dict->decompress(compressed[i].data(), compressed[i].size(), &out[0], out.size()) :
+          LZ4_decompress_safe(compressed[i].data(), &out[0], compressed[i].size(), out.size());
+        if (size != (int)records[i].size()) {
+          throw std::runtime_error("FAILED TO DECOMPRESS RECORD");
+        }
+      }
+    });
+    return {
+      {"records", (double)records.size()},
+      {"dictionary_bytes", dict ? (double)dict->data.size() : 0.},
+      {"ratio", (double)src_bytes / compressed_bytes},
+      {"compress_mb_per_second", compress_mbs},
+      {"decompress_mb_per_second", decompress_mbs}
+    };
+  }
+
+  // per-thread buffer for compressed records when the file is not mapped
+  static std::string &read_buffer() {
+    static thread_local std::string buffer;
+    return buffer;
+  }
+
+  static std::string &compress_buffer() {
+    static thread_local std::string buffer;
+    return buffer;
+  }
+
+  // per-thread buffer for records that are parsed right away
+  static std::string &record_buffer() {
+    static thread_local std::string buffer;
+    return buffer;
+  }
+
+  void parse_record(size_t index, size_t split_id, google::protobuf::MessageLite *p) {
+    std::string &buffer = record_buffer();
+    read_into(index, split_id, &buffer);
+    if (!p->ParseFromArray(buffer.data(), buffer.size())) {
+      throw std::runtime_error("FAILED TO PARSE RECORD");
+    }
   }
 
   py::bytes read_bytes(size_t index, size_t split_id) {
@@ -173,8 +524,7 @@ public:
 
   std::string read_json(size_t index, size_t split_id) {
     midi::Piece p;
-    std::string serialized_data = read(index, split_id);
-    p.ParseFromString(serialized_data);
+    parse_record(index, split_id, &p);
     std::string json_string;
     google::protobuf::util::MessageToJsonString(p, &json_string);
     return json_string;
@@ -182,63 +532,74 @@ public:
 
   // below is functions for dataset
   int select_random_transpose(midi::Piece *p) {
-    std::tuple<int,int> pitch_ext = util_protobuf::get_pitch_extents(p);
-    std::vector<int> choices;
-    for (int tr=-6; tr<6; tr++) {
-      if ((std::get<0>(pitch_ext)+tr >= 0) && (std::get<1>(pitch_ext)+tr < 128)) {
-        choices.push_back( tr );
-      }
-    }
-    return choices[random_on_range(choices.size(),&engine)];
+    return select_random_transpose(p, &engine);
+  }
+
+  int select_random_transpose(midi::Piece *p, std::mt19937 *e) {
+    return util_protobuf::select_random_transpose(util_protobuf::get_pitch_extents(p), e);
   }
 
   void load_random_piece(midi::Piece *p, size_t split_id) {
-    int nitems = get_split_size(split_id);
-    int index = random_on_range(nitems, &engine);
-    std::string serialized_data = read(index, split_id);
-    p->ParseFromString(serialized_data);
+    load_random_piece(p, split_id, &engine);
+  }
+
+  void load_random_piece(midi::Piece *p, size_t split_id, std::mt19937 *e, EPOCH_CURSOR *cursor=NULL) {
+    if (is_token_shard()) {
+      throw std::runtime_error("DATASET IS A TOKEN SHARD");
+    }
+    int index = sample_index(split_id, e, cursor);
+    parse_record(index, split_id, p);
   }
 
   std::string load_random_piece_string(size_t split_id) {
-    int nitems = get_split_size(split_id);
-    int index = random_on_range(nitems, &engine);
-    std::string serialized_data=read(index, split_id);
+    if (is_token_shard()) {
+      throw std::runtime_error("DATASET IS A TOKEN SHARD");
+    }
+    int index = sample_index(split_id, &engine);
     midi::Piece p;
-    p.ParseFromString(serialized_data);
+    parse_record(index, split_id, &p);
     std::string json_string;
     google::protobuf::util::MessageToJsonString(p, &json_string);
     return json_string;
   }
 
-  void load_random_segment(midi::Piece *p, size_t split_id, encoder::ENCODER *enc, data_structures::TrainConfig *tc) {
+  void load_random_segment(midi::Piece *p, size_t split_id, encoder::ENCODER *enc, data_structures::TrainConfig *tc, data_structures::EncoderState *state, std::mt19937 *e, EPOCH_CURSOR *cursor=NULL) {
 
-    load_random_piece(p, split_id);
+    load_random_piece(p, split_id, e, cursor);
 
     if (tc->use_microtiming) {
-      //enc->config->use_microtiming = random_on_unit(&engine) < tc->microtiming;
+      //enc->config->use_microtiming = random_on_unit(e) < tc->microtiming;
       if (p->internal_metadata_labels().nomml() == 12) {
-        enc->config->use_microtiming = random_on_unit(&engine) < tc->microtiming;
+        enc->config->use_microtiming = random_on_unit(e) < tc->microtiming;
       }
     }
 
     compute_piece_level_attribute_controls(enc->rep,p);
 
     util_protobuf::select_random_segment(
-      p, tc->num_bars, tc->min_tracks, tc->max_tracks, &engine);
-    enc->config->transpose = select_random_transpose(p);
+      p, tc->num_bars, tc->min_tracks, tc->max_tracks, e);
+    state->transpose = select_random_transpose(p, e);
 
     // 75 % of the time we do bar infill
     if (enc->config->both_in_one) {
-      enc->config->do_multi_fill = random_on_unit(&engine) < .75;
+      state->do_multi_fill = random_on_unit(e) < .75;
     }
 
     // pick bars for infilling if needed
-    if (enc->config->do_multi_fill) {
-      enc->config->multi_fill = util_protobuf::make_bar_mask(
-        p, tc->max_mask_percentage, &engine);
+    if (state->do_multi_fill) {
+      state->multi_fill = util_protobuf::make_bar_mask(
+        p, tc->max_mask_percentage, e);
     }
   }
 
+  // token shard counterpart of load_random_segment followed by encode
+  std::vector<int> load_random_shard_sequence(size_t split_id, encoder::ENCODER *enc, data_structures::TrainConfig *tc, data_structures::EncoderState *state, std::mt19937 *e, EPOCH_CURSOR *cursor=NULL) {
+    int index = sample_index(split_id, e, cursor);
+    midi::TokenShardPiece sp;
+    parse_record(index, split_id, &sp);
+    return assemble_token_shard_sequence(sp, enc, tc, state, e);
+  }
+
   std::string load_random_piece_py(size_t split_id) {
     midi::Piece p;
     load_random_piece(&p, split_id);
@@ -251,26 +612,57 @@ public:
     midi::Piece p;
     load_random_piece(&p, split_id);
 
-    std::unique_ptr<encoder::ENCODER> enc = getEncoder(et);
+    std::shared_ptr<encoder::ENCODER> enc = getSharedEncoder(et);
     if (!enc) {
       throw std::runtime_error("ENCODER TYPE DOES NOT EXIST");
     }
 
     util_protobuf::select_random_segment(&p, tc->num_bars, tc->min_tracks, tc->max_tracks, &engine);
 
-    enc->config->transpose = select_random_transpose(&p);
-    return enc->encode(&p);
+    data_structures::EncoderState state;
+    state.transpose = select_random_transpose(&p);
+    return enc->encode(&p, state);
   }
 
+  // called without the GIL (see lib.cpp). returns the tokens and the
+  // attention mask
   std::tuple<matrix<int>,matrix<int>> read_batch(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc) {
+    auto batch = read_document_batch(batch_size, split_id, et, tc);
+    for (auto &row : std::get<1>(batch)) {
+      for (auto &v : row) {
+        v = std::min(v, 1);
+      }
+    }
+    return batch;
+  }
+
+  // returns the tokens and the document ids (see Packer). without packing
+  // every row holds a single document. with prefetching enabled the batch
+  // comes from the queue, otherwise it is built on the calling thread
+  std::tuple<matrix<int>,matrix<int>> read_document_batch(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc) {
     enable_read();
+    if (prefetch_workers > 0) {
+      return pop_batch(batch_size, split_id, et, tc);
+    }
+    uint64_t first_slot = get_split(split_id).reserve_slots(batch_size);
+    return make_batch(batch_size, split_id, et, tc, &engine, &pack_carry[std::make_tuple(split_id,(int)et)], first_slot);
+  }
+
+  // carry holds the packed segment left over from the previous batch, if
+  // any, and receives the one left over from this batch. with SAMPLE_EPOCH
+  // the batch reads the epoch slots starting at first_slot
+  std::tuple<matrix<int>,matrix<int>> make_batch(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc, std::mt19937 *e, std::vector<int> *carry, uint64_t first_slot) {
+    // private encoder, load_random_segment changes use_microtiming on its config
     std::unique_ptr<encoder::ENCODER> enc = getEncoder(et);
     if (!enc) {
       throw std::runtime_error("ENCODER TYPE DOES NOT EXIST");
     }
 
-    Batcher<int> batch(max_seq_len, &engine);
-    Batcher<int> att_mask(max_seq_len, &engine);
+    Batcher<int> batch(max_seq_len, e);
+    Batcher<int> att_mask(max_seq_len, e);
+    Packer<int> packer(max_seq_len, batch_size, e);
+    EPOCH_CURSOR cursor(first_slot, batch_size);
+    bool full = false;
 
     // switch number of bars
     std::vector<int> num_bar_choices;
@@ -281,72 +673,488 @@ public:
       }
     }
 
-    while((int)batch.batch_size < batch_size) {
+    if (is_token_shard()) {
+      check_token_shard(et, tc, num_bar_choices);
+    }
+
+    if ((packing) && (carry->size())) {
+      packer.add( *carry );
+      carry->clear();
+      add_carried_stats();
+    }
+
+    while((!full) && ((packing) || ((int)batch.batch_size < batch_size))) {
 
       // pick random number of bars from domain
       if (enc->rep->has_token_type(midi::TOKEN_NUM_BARS)) {
-        int index = random_on_range(num_bar_choices.size(), &engine);
+        int index = random_on_range(num_bar_choices.size(), e);
         tc->num_bars = num_bar_choices[index];
       }
 
       try {
-        midi::Piece p;
-        load_random_segment(&p, split_id, enc.get(), tc);
-        std::vector<int> tokens = enc->encode(&p);
-        std::vector<int> mask(tokens.size(),1);
-        batch.add( tokens );
-        att_mask.add( mask );
+        data_structures::EncoderState state;
+        std::vector<int> tokens;
+        if (is_token_shard()) {
+          tokens = load_random_shard_sequence(split_id, enc.get(), tc, &state, e, &cursor);
+        }
+        else {
+          midi::Piece p;
+          load_random_segment(&p, split_id, enc.get(), tc, &state, e, &cursor);
+          tokens = enc->encode(&p, state);
+        }
+        if (packing) {
+          full = !packer.add( tokens );
+          if (full) {
+            carry->swap( tokens );
+          }
+        }
+        else {
+          std::vector<int> mask(tokens.size(),1);
+          batch.add( tokens );
+          att_mask.add( mask );
+        }
       }
       catch (const std::exception &exc)
       {
         std::cerr << exc.what() << std::endl;
       }
     }
+    if (packing) {
+      packer.pad(0);
+      add_packing_stats(packer.doc, packer.num_sequences);
+      return make_tuple(packer.batch, packer.doc);
+    }
     batch.pad(0);
     att_mask.pad(0);
+    add_packing_stats(att_mask.batch, batch.batch_size);
     return make_tuple(batch.batch, att_mask.batch);
   }
 
+  // fraction of the batch positions that hold tokens, over all batches
+  std::map<std::string,double> get_packing_stats() {
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    return {
+      {"packing", (double)packing},
+      {"batches", (double)num_batches},
+      {"rows", (double)num_rows},
+      {"documents", (double)num_documents},
+      {"tokens", (double)num_tokens},
+      {"positions", (double)num_positions},
+      {"carried", (double)num_carried},
+      {"efficiency", num_positions ? (double)num_tokens / num_positions : 0.},
+      {"documents_per_row", num_rows ? (double)num_documents / num_rows : 0.}
+    };
+  }
+
+  void reset_packing_stats() {
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    num_batches = 0;
+    num_rows = 0;
+    num_documents = 0;
+    num_tokens = 0;
+    num_positions = 0;
+    num_carried = 0;
+  }
+
+  // read_batch flattened into contiguous row-major (rows, cols) buffers.
+  // labels are the tokens with padded positions and the first token of
+  // every packed document after the first set to pad_value, so no document
+  // is trained to predict the next one. position_ids restart at every
+  // document
+  template <typename T>
+  struct FLAT_BATCH {
+    int rows = 0;
+    int cols = 0;
+    std::vector<T> input_ids;
+    std::vector<T> attention_mask;
+    std::vector<T> labels;
+    std::vector<T> position_ids;
+    std::vector<T> document_ids;
+  };
+
+  template <typename T>
+  FLAT_BATCH<T> read_flat_batch(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc, int pad_value) {
+    auto nested = read_document_batch(batch_size, split_id, et, tc);
+    const matrix<int> &tokens = std::get<0>(nested);
+    const matrix<int> &doc = std::get<1>(nested);
+    FLAT_BATCH<T> b;
+    b.rows = tokens.size();
+    b.cols = b.rows ? tokens[0].size() : 0;
+    size_t n = (size_t)b.rows * b.cols;
+    b.input_ids.resize(n);
+    b.attention_mask.resize(n);
+    b.labels.resize(n);
+    b.position_ids.resize(n);
+    b.document_ids.resize(n);
+    for (int i=0; i<b.rows; i++) {
+      T *ids = b.input_ids.data() + (size_t)i * b.cols;
+      T *att = b.attention_mask.data() + (size_t)i * b.cols;
+      T *lab = b.labels.data() + (size_t)i * b.cols;
+      T *pos = b.position_ids.data() + (size_t)i * b.cols;
+      T *dis = b.document_ids.data() + (size_t)i * b.cols;
+      int position = 0;
+      for (int j=0; j<b.cols; j++) {
+        bool starts_document = (j > 0) && (doc[i][j] != doc[i][j-1]);
+        if (starts_document) {
+          position = 0;
+        }
+        ids[j] = tokens[i][j];
+        att[j] = (doc[i][j] > 0);
+        lab[j] = ((doc[i][j] > 0) && (!starts_document)) ? tokens[i][j] : pad_value;
+        pos[j] = position++;
+        dis[j] = doc[i][j];
+      }
+    }
+    return b;
+  }
+
+  // Background batch prefetching. num_workers threads build batches into a
+  // queue that holds at most depth batches ahead of the consumer. Batch i is
+  // built with an engine seeded from (seed, i) and batches are handed out in
+  // order, so the sequence of batches only depends on the seed, not on the
+  // number of workers or their timing. The exception is packing, where each
+  // worker carries its left over segment into the next batch it builds, so
+  // with several workers that segment lands in a batch that depends on the
+  // scheduling. num_workers = 0 disables prefetching.
+  void set_prefetch(int num_workers, int depth) {
+    stop_prefetch();
+    prefetch_workers = std::max(num_workers, 0);
+    prefetch_depth = std::max(depth, 1);
+  }
+
+  void stop_prefetch() {
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mtx);
+      prefetch_stopping = true;
+    }
+    space_cv.notify_all();
+    for (auto &t : workers) {
+      t.join();
+    }
+    workers.clear();
+    prefetched.clear();
+    prefetch_stopping = false;
+    prefetch_args = "";
+  }
+
+  std::map<std::string,double> get_prefetch_stats() {
+    std::lock_guard<std::mutex> lock(prefetch_mtx);
+    return {
+      {"workers", (double)workers.size()},
+      {"depth", (double)prefetch_depth},
+      {"ready", (double)prefetched.size()},
+      {"batches", (double)next_pop},
+      {"waits", (double)num_prefetch_waits}
+    };
+  }
+
+  // marks the dataset being written as a token shard (see token_shard.h)
+  void set_token_shard(const std::string &encoder_name, int shard_min_tracks, const std::vector<int> &shard_num_bars) {
+    midi::TokenShardInfo *info = header.mutable_token_shard();
+    info->set_encoder(encoder_name);
+    info->set_min_tracks(shard_min_tracks);
+    info->clear_num_bars();
+    for (const auto &nb : shard_num_bars) {
+      info->add_num_bars(nb);
+    }
+  }
+
+  bool is_token_shard() {
+    enable_read();
+    return header.has_token_shard();
+  }
+
   int get_size() {
     enable_read();
-    return header.train_size() + header.valid_size() + header.test_size();
+    return splits[0].size() + splits[1].size() + splits[2].size();
   }
 
   int get_split_size(int split_id) {
     enable_read();
-    switch (split_id) {
-      case 0 : return header.train_size();
-      case 1 : return header.valid_size();
-      case 2 : return header.test_size();
+    if ((split_id < 0) || (split_id > 2)) {
+      return 0; // invalid split id
     }
-    return 0; // invalid split id
+    return splits[split_id].size();
   }
 
+  // the data is flushed before the index, so the index never points past
+  // the end of the data written to disk
   void flush() {
+    if (!can_write) { return; }
     fs.flush();
-    header_fs.open(header_filepath, std::ios::out | std::ios::binary);
-    if (!header.SerializeToOstream(&header_fs)) {
-      std::cerr << "ERROR : Failed to write header file" << std::endl;
+    if (header.has_build_inputs()) {
+      index_writer.append(dataset_manipulation::makeIndexEntry(
+        header.build_inputs(), 0, 0, header.build_inputs_hash(), 0, 0, 0, dataset_manipulation::INDEX_PROGRESS));
     }
-    header_fs.close();
+    index_writer.flush();
   }
 
   void close() {
-    flush();
+    stop_prefetch();
+    if (can_write) {
+      flush();
+      write_header();
+    }
     fs.close();
+    index_writer.close();
     header_fs.close();
+    unmap();
     can_read = false;
     can_write = false;
   }
   
 private:
+  void write_header() {
+    header_fs.open(header_filepath, std::ios::out | std::ios::binary);
+    if (!header.SerializeToOstream(&header_fs)) {
+      std::cerr << "ERROR : Failed to write header file" << std::endl;
+    }
+    header_fs.close();
+  }
+
+  void load_dictionary() {
+    dictionary.reset();
+    if (header.lz4_dictionary().size()) {
+      dictionary = std::make_shared<const LZ4_DICTIONARY>(header.lz4_dictionary());
+    }
+  }
+
+  // replaces the items of h with the records of the index
+  static void set_items(const std::vector<dataset_manipulation::IndexEntry> &entries, midi::Dataset *h) {
+    h->clear_train();
+    h->clear_valid();
+    h->clear_test();
+    for (const auto &entry : entries) {
+      if (entry.kind != dataset_manipulation::INDEX_RECORD) {
+        continue;
+      }
+      midi::Item *item;
+      switch (entry.split_id) {
+        case 0: item = h->add_train(); break;
+        case 1: item = h->add_valid(); break;
+        case 2: item = h->add_test(); break;
+        default: throw std::runtime_error("INVALID SPLIT ID");
+      }
+      item->set_start(entry.start);
+      item->set_end(entry.start + entry.length);
+      item->set_src_size(entry.src_size);
+      item->set_num_segments(entry.num_segments);
+    }
+  }
+
+  // the items are taken from the index when there is one, so that a
+  // dataset that was not closed can be read up to its last complete record
+  void load_index() {
+    std::error_code ec;
+    uint64_t data_size = std::filesystem::file_size(filepath, ec);
+    std::vector<dataset_manipulation::IndexEntry> entries;
+    if ((!ec) && (dataset_manipulation::readIndex(index_filepath, data_size, entries))) {
+      set_items(entries, &header);
+    }
+  }
+
+  // moves the items of the header into the split indices
+  void load_splits() {
+    for (int split_id=0; split_id<3; split_id++) {
+      const auto &items = (split_id == 0) ? header.train() : (split_id == 1) ? header.valid() : header.test();
+      SPLIT_INDEX &split = splits[split_id];
+      split.clear();
+      for (const auto &item : items) {
+        split.add(item);
+      }
+      split.finalize();
+    }
+    header.clear_train();
+    header.clear_valid();
+    header.clear_test();
+  }
+
+  SPLIT_INDEX &get_split(size_t split_id) {
+    if (split_id > 2) {
+      throw std::runtime_error("INVALID SPLIT ID");
+    }
+    return splits[split_id];
+  }
+
+  int sample_index(size_t split_id, std::mt19937 *e, EPOCH_CURSOR *cursor=NULL) {
+    return get_split(split_id).sample(sampling, seed, split_id, e, cursor);
+  }
+
+  // a shard only holds the segments it was built for
+  void check_token_shard(enums::ENCODER_TYPE et, data_structures::TrainConfig *tc, const std::vector<int> &num_bar_choices) {
+    const midi::TokenShardInfo &info = header.token_shard();
+    if (info.encoder() != enums::getEncoderTypeString(et)) {
+      throw std::runtime_error("TOKEN SHARD WAS BUILT FOR A DIFFERENT ENCODER");
+    }
+    if (info.min_tracks() != tc->min_tracks) {
+      throw std::runtime_error("TOKEN SHARD WAS BUILT FOR A DIFFERENT MIN_TRACKS");
+    }
+    std::vector<int> required = num_bar_choices;
+    if (required.size() == 0) {
+      required.push_back(tc->num_bars);
+    }
+    for (const auto &nb : required) {
+      if (std::find(info.num_bars().begin(), info.num_bars().end(), nb) == info.num_bars().end()) {
+        throw std::runtime_error("TOKEN SHARD DOES NOT HAVE SEGMENTS FOR NUM_BARS");
+      }
+    }
+  }
+
+  bool map_file() {
+#ifndef _WIN32
+    int fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+      ::close(fd);
+      return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping stays valid
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+    map_data = (const char*)data;
+    map_size = st.st_size;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  struct PREFETCHED_BATCH {
+    std::tuple<matrix<int>,matrix<int>> batch;
+    std::exception_ptr error = nullptr;
+  };
+
+  std::tuple<matrix<int>,matrix<int>> pop_batch(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc) {
+    // the workers are restarted whenever the requested batches change
+    auto tc_json = tc->ToJson();
+    std::string args = data_structures::to_str(batch_size, ",", split_id, ",", (int)et);
+    for (const auto &kv : tc_json) {
+      if (kv.first != "num_bars") { // overwritten per batch
+        args += "," + kv.first + "=" + kv.second;
+      }
+    }
+    if ((args != prefetch_args) || (!workers.size())) {
+      stop_prefetch();
+      prefetch_args = args;
+      next_batch = 0;
+      next_pop = 0;
+      num_prefetch_waits = 0;
+      data_structures::TrainConfig worker_tc(*tc);
+      // batch i reads the epoch slots that batch would have read without
+      // prefetching. batches dropped by a restart give their slots back
+      uint64_t first_slot = get_split(split_id).get_next_slot();
+      for (int i=0; i<prefetch_workers; i++) {
+        workers.push_back(std::thread([=, this]() {
+          prefetch_loop(batch_size, split_id, et, worker_tc, first_slot);
+        }));
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(prefetch_mtx);
+    if (prefetched.find(next_pop) == prefetched.end()) {
+      num_prefetch_waits++;
+    }
+    ready_cv.wait(lock, [&]() {
+      return prefetched.find(next_pop) != prefetched.end();
+    });
+    auto it = prefetched.find(next_pop);
+    PREFETCHED_BATCH result = std::move(it->second);
+    prefetched.erase(it);
+    next_pop++;
+    lock.unlock();
+    space_cv.notify_all();
+    get_split(split_id).reserve_slots(batch_size);
+    if (result.error) {
+      std::rethrow_exception(result.error);
+    }
+    return std::move(result.batch);
+  }
+
+  void prefetch_loop(int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig tc, uint64_t first_slot) {
+    std::vector<int> carry;
+    while (true) {
+      uint64_t index;
+      {
+        std::unique_lock<std::mutex> lock(prefetch_mtx);
+        space_cv.wait(lock, [&]() {
+          return prefetch_stopping || (next_batch < next_pop + prefetch_depth);
+        });
+        if (prefetch_stopping) {
+          return;
+        }
+        index = next_batch++;
+      }
+      std::seed_seq seq{(uint32_t)seed, (uint32_t)index, (uint32_t)(index >> 32)};
+      std::mt19937 e(seq);
+      data_structures::TrainConfig batch_tc(tc);
+      PREFETCHED_BATCH result;
+      try {
+        result.batch = make_batch(batch_size, split_id, et, &batch_tc, &e, &carry, first_slot + index * batch_size);
+      }
+      catch (...) {
+        result.error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(prefetch_mtx);
+        prefetched[index] = std::move(result);
+      }
+      ready_cv.notify_all();
+    }
+  }
+
+  void add_packing_stats(const matrix<int> &doc, size_t documents) {
+    uint64_t tokens = 0;
+    uint64_t positions = 0;
+    for (const auto &row : doc) {
+      positions += row.size();
+      for (const auto &v : row) {
+        tokens += (v > 0);
+      }
+    }
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    num_batches++;
+    num_rows += doc.size();
+    num_documents += documents;
+    num_tokens += tokens;
+    num_positions += positions;
+  }
+
+  void add_carried_stats() {
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    num_carried++;
+  }
+
+  void unmap() {
+#ifndef _WIN32
+    if (map_data) {
+      munmap((void*)map_data, map_size);
+    }
+#endif
+    map_data = NULL;
+    map_size = 0;
+  }
+
   std::string filepath;
   std::string header_filepath;
+  std::string index_filepath;
   std::fstream fs;
+  dataset_manipulation::IndexWriter index_writer;
   std::fstream header_fs;
   bool can_write;
   bool can_read;
+  bool use_mmap;
+  const char *map_data;
+  size_t map_size;
   midi::Dataset header;
+  SPLIT_INDEX splits[3];
+  enums::SAMPLING_MODE sampling;
+  std::shared_ptr<const LZ4_DICTIONARY> dictionary;
   int flush_count;
 
   int num_bars;
@@ -354,12 +1162,81 @@ private:
   int max_tracks;
   int max_seq_len;
 
+  int seed;
   std::mt19937 engine;
+  std::mutex fs_mtx;
+
+  int prefetch_workers;
+  int prefetch_depth;
+  std::vector<std::thread> workers;
+  std::mutex prefetch_mtx;
+  std::condition_variable ready_cv;
+  std::condition_variable space_cv;
+  std::map<uint64_t,PREFETCHED_BATCH> prefetched;
+  uint64_t next_batch = 0;
+  uint64_t next_pop = 0;
+  uint64_t num_prefetch_waits = 0;
+  bool prefetch_stopping = false;
+  std::string prefetch_args;
+
+  bool packing;
+  std::mutex stats_mtx;
+  uint64_t num_batches = 0;
+  uint64_t num_rows = 0;
+  uint64_t num_documents = 0;
+  uint64_t num_tokens = 0;
+  uint64_t num_positions = 0;
+  uint64_t num_carried = 0;
+  std::map<std::tuple<size_t,int>,std::vector<int>> pack_carry;
 
   std::vector<std::vector<int>> bstore;
   encoder::ENCODER *encoder;
 };
 
+// writes a token shard of the dataset at src_path to dst_path. pieces keep
+// their split and index. num_bars defaults to the NUM_BARS domain
+void build_token_shard(const std::string &src_path, const std::string &dst_path, enums::ENCODER_TYPE et, int min_tracks, std::vector<int> num_bars) {
+  std::unique_ptr<encoder::ENCODER> enc = enums::getEncoder(et);
+  if (!enc) {
+    throw std::runtime_error("ENCODER TYPE DOES NOT EXIST");
+  }
+  enc->config->use_microtiming = true;
+  if (num_bars.size() == 0) {
+    if (!enc->rep->has_token_type(midi::TOKEN_NUM_BARS)) {
+      throw std::runtime_error("NUM_BARS MUST BE PROVIDED FOR THIS ENCODER");
+    }
+    num_bars = enc->rep->get_num_bars_domain();
+  }
+
+  Jagged src(src_path);
+  if (src.is_token_shard()) {
+    throw std::runtime_error("DATASET IS ALREADY A TOKEN SHARD");
+  }
+  Jagged dst(dst_path);
+  dst.set_token_shard(enums::getEncoderTypeString(et), min_tracks, num_bars);
+
+  midi::Piece p;
+  midi::TokenShardPiece sp;
+  std::string record;
+  for (int split_id=0; split_id<3; split_id++) {
+    int nitems = src.get_split_size(split_id);
+    for (int index=0; index<nitems; index++) {
+      try {
+        src.parse_record(index, split_id, &p);
+        build_token_shard_piece(&p, enc.get(), num_bars, min_tracks, &sp);
+      }
+      catch (const std::exception &exc) {
+        // keep the index aligned, the piece just has no valid segments
+        std::cerr << exc.what() << std::endl;
+        sp.Clear();
+      }
+      sp.SerializeToString(&record);
+      dst.append(record, split_id, sp.segments_size() / num_bars.size());
+    }
+  }
+  dst.close();
+}
+
 }
 // END OF NAMESPACE
 
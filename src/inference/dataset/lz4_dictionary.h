@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#define LZ4_STATIC_LINKING_ONLY
+#include "lz4.h"
+
+// Serialized midi::Piece records are small and share most of their
+// structure, so compressing each record on its own finds few matches. A
+// dictionary of content common to many records, stored once in the dataset
+// header, is used as history for every record. Records stay independent,
+// so random access is unchanged.
+
+// START OF NAMESPACE
+namespace compression {
+
+class LZ4_DICTIONARY {
+public:
+  LZ4_DICTIONARY(const std::string &d) {
+    // lz4 only references the last 64KB of history
+    data = d.substr(d.size() > 65536 ? d.size() - 65536 : 0);
+    stream = LZ4_createStream();
+    LZ4_loadDict(stream, data.data(), data.size());
+  }
+  ~LZ4_DICTIONARY() {
+    LZ4_freeStream(stream);
+  }
+  LZ4_DICTIONARY(const LZ4_DICTIONARY&) = delete;
+  LZ4_DICTIONARY &operator=(const LZ4_DICTIONARY&) = delete;
+
+  // safe to call from several threads. each thread attaches the shared
+  // dictionary to its own working stream
+  int compress(const char *src, int size, char *dst, int capacity) const {
+    static thread_local LZ4_stream_t working;
+    static thread_local bool initialized = false;
+    if (!initialized) {
+      LZ4_initStream(&working, sizeof(working));
+      initialized = true;
+    }
+    LZ4_resetStream_fast(&working);
+    LZ4_attach_dictionary(&working, stream);
+    return LZ4_compress_fast_continue(&working, src, dst, size, capacity, 1);
+  }
+
+  int decompress(const char *src, int size, char *dst, int capacity) const {
+    return LZ4_decompress_safe_usingDict(src, dst, size, capacity, data.data(), data.size());
+  }
+
+  std::string data;
+
+private:
+  LZ4_stream_t *stream;
+};
+
+// compresses a record, with the dictionary if there is one
+void lz4_compress_record(const LZ4_DICTIONARY *dictionary, const char *src, size_t size, std::string *out) {
+  out->resize(LZ4_compressBound(size));
+  int csize = dictionary ?
+    dictionary->compress(src, size, &(*out)[0], out->size()) :
+    LZ4_compress_default(src, &(*out)[0], size, out->size());
+  if (csize <= 0) {
+    throw std::runtime_error("FAILED TO COMPRESS RECORD");
+  }
+  out->resize(csize);
+}
+
+// Trains a dictionary on sample records. Every 8 byte k-mer is scored by the
+// number of samples it appears in, and the samples are cut into segments of
+// segment_size bytes. Segments are chosen greedily by the score of the
+// k-mers they cover that are not covered yet, and placed so that the best
+// segments are last in the dictionary, closest to the compressed data.
+std::string train_lz4_dictionary(const std::vector<std::string> &samples, size_t dict_size, size_t segment_size=256) {
+  const size_t k = 8;
+  dict_size = std::min(dict_size, (size_t)65536);
+  segment_size = std::max(segment_size, k);
+  auto kmer = [](const char *p) {
+    uint64_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return x * 0x9E3779B97F4A7C15ULL;
+  };
+
+  // number of samples containing each k-mer
+  std::unordered_map<uint64_t,std::tuple<int,int>> freq; // kmer -> (count, last sample)
+  for (int i=0; i<(int)samples.size(); i++) {
+    const std::string &s = samples[i];
+    for (size_t pos=0; pos+k<=s.size(); pos++) {
+      auto &f = freq[kmer(s.data() + pos)];
+      if (std::get<1>(f) != i + 1) {
+        std::get<0>(f)++;
+        std::get<1>(f) = i + 1;
+      }
+    }
+  }
+
+  auto score = [&](int sample, size_t start) {
+    const std::string &s = samples[sample];
+    size_t end = std::min(start + segment_size, s.size());
+    uint64_t total = 0;
+    for (size_t pos=start; pos+k<=end; pos++) {
+      auto it = freq.find(kmer(s.data() + pos));
+      // k-mers found in a single sample are not worth storing
+      if (std::get<0>(it->second) > 1) {
+        total += std::get<0>(it->second);
+      }
+    }
+    return total;
+  };
+
+  // lazy greedy selection : a segment's score can only decrease
+  std::priority_queue<std::tuple<uint64_t,int,size_t>> queue;
+  for (int i=0; i<(int)samples.size(); i++) {
+    for (size_t start=0; start+k<=samples[i].size(); start+=segment_size) {
+      queue.push(std::make_tuple(score(i, start), i, start));
+    }
+  }
+  std::vector<std::string> segments;
+  size_t size = 0;
+  while ((size < dict_size) && (!queue.empty())) {
+    auto [s, sample, start] = queue.top();
+    queue.pop();
+    if (s == 0) {
+      break;
+    }
+    uint64_t current = score(sample, start);
+    if (current == 0) {
+      continue;
+    }
+    if ((!queue.empty()) && (current < std::get<0>(queue.top()))) {
+      queue.push(std::make_tuple(current, sample, start));
+      continue;
+    }
+    const std::string &x = samples[sample];
+    size_t end = std::min(start + segment_size, x.size());
+    for (size_t pos=start; pos+k<=end; pos++) {
+      std::get<0>(freq[kmer(x.data() + pos)]) = 0;
+    }
+    segments.push_back(x.substr(start, std::min(end - start, dict_size - size)));
+    size += segments.back().size();
+  }
+
+  std::string dictionary;
+  for (auto it=segments.rbegin(); it!=segments.rend(); it++) {
+    dictionary += *it;
+  }
+  return dictionary;
+}
+
+}
+// END OF NAMESPACE
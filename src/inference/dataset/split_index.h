@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "../../../libraries/protobuf/build/midi.pb.h"
+#include "../enum/sampling_mode.h"
+#include "../random.h"
+
+// START OF NAMESPACE
+namespace compression {
+
+// The epoch slots read by the draws of one batch with SAMPLE_EPOCH. A batch
+// owns batch_size consecutive slots starting at first_slot, and draw d reads
+// slot first_slot + d % batch_size. Draws past batch_size (examples that
+// failed, or extra segments of a packed batch) read the same slots again in
+// lane d / batch_size, so the records of a batch only depend on first_slot
+// and not on what other threads draw.
+struct EPOCH_CURSOR {
+  EPOCH_CURSOR(uint64_t first_slot_, int batch_size_) {
+    first_slot = first_slot_;
+    batch_size = std::max(batch_size_, 1);
+    draws = 0;
+  }
+
+  uint64_t first_slot;
+  int batch_size;
+  int draws;
+};
+
+// The items of one split in flat arrays, built once when a dataset is
+// opened, and the samplers that pick the record of each training example.
+class SPLIT_INDEX {
+public:
+  void clear() {
+    std::lock_guard<std::mutex> lock(mtx);
+    start.clear();
+    length.clear();
+    src_size.clear();
+    num_segments.clear();
+    alias_prob.clear();
+    alias.clear();
+    orders.clear();
+    next_slot = 0;
+  }
+
+  void add(const midi::Item &item) {
+    start.push_back(item.start());
+    length.push_back(item.end() - item.start());
+    src_size.push_back(item.src_size());
+    num_segments.push_back(item.num_segments());
+  }
+
+  // call once all the items are added
+  void finalize() {
+    build_alias_table();
+  }
+
+  size_t size() const {
+    return start.size();
+  }
+
+  // draws outside of a batch (cursor is NULL) take the next epoch slot
+  int sample(enums::SAMPLING_MODE mode, int seed, int split_id, std::mt19937 *e, EPOCH_CURSOR *cursor) {
+    if (size() == 0) {
+      throw std::runtime_error("SPLIT IS EMPTY");
+    }
+    switch (mode) {
+      case enums::SAMPLE_UNIFORM: return random_on_range((int)size(), e);
+      case enums::SAMPLE_EPOCH: {
+        if (!cursor) {
+          return sample_epoch(seed, split_id, reserve_slots(1), 0);
+        }
+        int draw = cursor->draws++;
+        return sample_epoch(seed, split_id, cursor->first_slot + draw % cursor->batch_size, draw / cursor->batch_size);
+      }
+      case enums::SAMPLE_WEIGHTED: return sample_weighted(e);
+    }
+    throw std::runtime_error("INVALID SAMPLING MODE");
+  }
+
+  // the record at an epoch slot. slot i belongs to epoch i / size(), and
+  // every epoch visits each record once, in a permutation seeded by the
+  // seed, split and epoch. a lane reads the same permutation rotated, so
+  // repeated reads of a slot fall on other records
+  int sample_epoch(int seed, int split_id, uint64_t slot, int lane) {
+    uint64_t n = size();
+    std::shared_ptr<const std::vector<int>> order = get_order(seed, split_id, slot / n);
+    uint64_t lane_step = (uint64_t)(n * 0.6180339887);
+    return (*order)[(slot + lane * lane_step) % n];
+  }
+
+  // slots used by the batches and draws handed out so far. returns the
+  // first slot of the count reserved
+  uint64_t reserve_slots(uint64_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t first = next_slot;
+    next_slot += count;
+    return first;
+  }
+
+  uint64_t get_next_slot() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return next_slot;
+  }
+
+  // O(1) draw proportional to the number of valid segments (Vose's alias
+  // method). records with an unknown count weigh as much as one segment
+  int sample_weighted(std::mt19937 *e) {
+    int column = random_on_range((int)size(), e);
+    return (random_on_unit(e) < alias_prob[column]) ? column : alias[column];
+  }
+
+  // restarts the epochs, so that a new seed gives a new sequence
+  void reset_epoch() {
+    std::lock_guard<std::mutex> lock(mtx);
+    orders.clear();
+    next_slot = 0;
+  }
+
+  // number of epochs completed by the slots handed out
+  uint64_t get_epoch() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return size() ? next_slot / size() : 0;
+  }
+
+  std::vector<uint64_t> start;
+  std::vector<uint32_t> length;
+  std::vector<uint32_t> src_size;
+  std::vector<uint32_t> num_segments;
+
+private:
+  // the permutations of the epochs in use. batches prepared ahead can be in
+  // the next epoch while others finish the current one, so older epochs are
+  // only dropped two epochs later. a dropped epoch is rebuilt identically
+  std::shared_ptr<const std::vector<int>> get_order(int seed, int split_id, uint64_t epoch) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = orders.find(epoch);
+    if (it != orders.end()) {
+      return it->second;
+    }
+    std::vector<int> order = arange((int)size());
+    std::seed_seq seq{(uint32_t)seed, (uint32_t)split_id, (uint32_t)epoch, (uint32_t)(epoch >> 32)};
+    std::mt19937 g(seq);
+    std::shuffle(order.begin(), order.end(), g);
+    auto ptr = std::make_shared<const std::vector<int>>(std::move(order));
+    orders[epoch] = ptr;
+    while (orders.begin()->first + 2 < epoch) {
+      orders.erase(orders.begin());
+    }
+    return ptr;
+  }
+
+  void build_alias_table() {
+    size_t n = size();
+    alias_prob.assign(n, 1.);
+    alias.assign(n, 0);
+    if (n == 0) {
+      return;
+    }
+    double total = 0;
+    for (const auto &w : num_segments) {
+      total += std::max(w, (uint32_t)1);
+    }
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (size_t i=0; i<n; i++) {
+      scaled[i] = std::max(num_segments[i], (uint32_t)1) * n / total;
+      if (scaled[i] < 1.) {
+        small.push_back(i);
+      }
+      else {
+        large.push_back(i);
+      }
+    }
+    while (small.size() && large.size()) {
+      int s = small.back();
+      small.pop_back();
+      int l = large.back();
+      alias_prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] -= 1. - scaled[s];
+      if (scaled[l] < 1.) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // the remaining columns are full up to rounding errors
+    for (const auto &i : small) {
+      alias_prob[i] = 1.;
+    }
+    for (const auto &i : large) {
+      alias_prob[i] = 1.;
+    }
+  }
+
+  std::vector<float> alias_prob;
+  std::vector<int> alias;
+
+  std::mutex mtx;
+  std::map<uint64_t,std::shared_ptr<const std::vector<int>>> orders;
+  uint64_t next_slot = 0;
+};
+
+}
+// END OF NAMESPACE
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "../../../libraries/protobuf/build/midi.pb.h"
+#include "../../common/encoder/encoder_all.h"
+#include "../../common/data_structures/train_config.h"
+#include "../random.h"
+
+// Pre-tokenized datasets. Parsing and encoding a midi::Piece for every
+// training example dominates the cost of Jagged::read_batch, so a token
+// shard stores every valid segment of a piece already encoded, split into
+// the span of each track header and the prefix and notes of each bar.
+// Spans are interned per piece, bars shared by overlapping segments are
+// only stored once.
+//
+// A training example is assembled by concatenating spans, with the same
+// random draws as Jagged::load_random_segment. Spans are encoded with
+// microtiming, so the delta tokens are dropped for examples without it, and
+// transposition shifts the NOTE_ONSET tokens of pitched tracks.
+
+// START OF NAMESPACE
+namespace compression {
+
+class TOKEN_SPAN_POOL {
+public:
+  TOKEN_SPAN_POOL(midi::TokenShardPiece *p) {
+    piece = p;
+  }
+  int add(const std::vector<int> &tokens) {
+    auto it = index.find(tokens);
+    if (it == index.end()) {
+      midi::TokenSpan *span = piece->add_spans();
+      for (const auto &token : tokens) {
+        span->add_tokens(token);
+      }
+      it = index.insert({tokens, piece->spans_size() - 1}).first;
+    }
+    return it->second;
+  }
+private:
+  midi::TokenShardPiece *piece;
+  std::map<std::vector<int>,int> index;
+};
+
+bool is_note_token_type(midi::TOKEN_TYPE tt) {
+  switch (tt) {
+    case midi::TOKEN_TIME_ABSOLUTE_POS:
+    case midi::TOKEN_VELOCITY_LEVEL:
+    case midi::TOKEN_DELTA_DIRECTION:
+    case midi::TOKEN_DELTA:
+    case midi::TOKEN_NOTE_ONSET:
+    case midi::TOKEN_NOTE_DURATION:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// splits the tokens of an encoded segment (x, without infilling) into spans
+void add_token_shard_segment(const std::vector<int> &tokens, midi::Piece *x, int num_bars, int start, const std::shared_ptr<encoder::REPRESENTATION> &rep, TOKEN_SPAN_POOL *pool, midi::TokenShardPiece *sp) {
+  enum { OUTSIDE, HEADER, PREFIX, NOTES } part = OUTSIDE;
+  midi::TokenSpanSegment *seg = sp->add_segments();
+  seg->set_num_bars(num_bars);
+  seg->set_start(start);
+  midi::TokenSpanTrack *track = NULL;
+  std::vector<int> span;
+  for (const auto &token : tokens) {
+    midi::TOKEN_TYPE tt = rep->get_token_type(token);
+    if (tt == midi::TOKEN_TRACK) {
+      track = seg->add_tracks();
+      span = {token};
+      part = HEADER;
+    }
+    else if (tt == midi::TOKEN_BAR) {
+      if (part == HEADER) {
+        track->set_header(pool->add(span));
+      }
+      span = {token};
+      part = PREFIX;
+    }
+    else if (tt == midi::TOKEN_BAR_END) {
+      if (part == PREFIX) {
+        track->add_bar_prefix(pool->add(span));
+        span.clear();
+      }
+      track->add_bar_notes(pool->add(span));
+      part = OUTSIDE;
+    }
+    else if (tt == midi::TOKEN_TRACK_END) {
+      part = OUTSIDE;
+    }
+    else if ((part == PREFIX) && (is_note_token_type(tt))) {
+      track->add_bar_prefix(pool->add(span));
+      span = {token};
+      part = NOTES;
+    }
+    else if (part != OUTSIDE) {
+      span.push_back(token);
+    }
+  }
+
+  if (seg->tracks_size() != x->tracks_size()) {
+    throw std::runtime_error("FAILED TO SPLIT ENCODED SEGMENT");
+  }
+  for (int track_num=0; track_num<x->tracks_size(); track_num++) {
+    const midi::Track &t = x->tracks(track_num);
+    midi::TokenSpanTrack *st = seg->mutable_tracks(track_num);
+    if ((st->bar_prefix_size() != num_bars) || (st->bar_notes_size() != num_bars)) {
+      throw std::runtime_error("FAILED TO SPLIT ENCODED SEGMENT");
+    }
+    // same extents as util_protobuf::get_pitch_extents
+    int min_pitch = INT_MAX;
+    int max_pitch = 0;
+    st->set_is_drum(data_structures::is_drum_track(t.track_type()));
+    if (!st->is_drum()) {
+      for (const auto &bar : t.bars()) {
+        for (const auto &event_index : bar.events()) {
+          int pitch = x->events(event_index).pitch();
+          min_pitch = std::min(pitch, min_pitch);
+          max_pitch = std::max(pitch, max_pitch);
+        }
+      }
+    }
+    st->set_min_pitch(min_pitch);
+    st->set_max_pitch(max_pitch);
+  }
+}
+
+// encodes every valid segment of p for each number of bars. enc must be a
+// private encoder with use_microtiming enabled
+void build_token_shard_piece(midi::Piece *p, encoder::ENCODER *enc, const std::vector<int> &num_bars, int min_tracks, midi::TokenShardPiece *sp) {
+  sp->Clear();
+  sp->set_nomml(p->internal_metadata_labels().nomml());
+  TOKEN_SPAN_POOL pool(sp);
+  compute_piece_level_attribute_controls(enc->rep, p);
+  data_structures::EncoderState state;
+  for (const auto &nb : num_bars) {
+    util_protobuf::UpdateValidSegments(p, nb, min_tracks);
+    for (int i=0; i<p->internal_valid_segments_size(); i++) {
+      int start = p->internal_valid_segments(i);
+      std::vector<int> tracks;
+      for (const auto &track_num : p->internal_valid_tracks_v2(i).tracks()) {
+        tracks.push_back(track_num);
+      }
+      midi::Piece x(*p);
+      util_protobuf::prune_tracks(&x, tracks, arange(start, start + nb, 1));
+      std::vector<int> tokens = enc->encode(&x, state);
+      add_token_shard_segment(tokens, &x, nb, start, enc->rep, &pool, sp);
+    }
+  }
+}
+
+void append_token_span(const midi::TokenShardPiece &sp, int index, std::vector<int> &tokens) {
+  const auto &span = sp.spans(index).tokens();
+  tokens.insert(tokens.end(), span.begin(), span.end());
+}
+
+// track header tokens, with the controls that hold pitches transposed like
+// the notes (see ENCODER::encode_track)
+void append_token_shard_header(const midi::TokenShardPiece &sp, const midi::TokenSpanTrack &track, encoder::ENCODER *enc, int transpose, std::vector<int> &tokens) {
+  size_t start = tokens.size();
+  append_token_span(sp, track.header(), tokens);
+  if ((!track.is_drum()) && (transpose != 0)) {
+    encoder::transpose_track_tokens(enc->rep, &tokens[start], (int)(tokens.size() - start), transpose);
+  }
+}
+
+// note tokens of a bar with microtiming removed if needed and transposed
+void append_token_shard_notes(const midi::TokenShardPiece &sp, const midi::TokenSpanTrack &track, int bar_num, encoder::ENCODER *enc, int transpose, std::vector<int> &tokens) {
+  const std::shared_ptr<encoder::REPRESENTATION> &rep = enc->rep;
+  bool use_microtiming = enc->config->use_microtiming;
+  int shift = track.is_drum() ? 0 : transpose;
+  for (const auto &token : sp.spans(track.bar_notes(bar_num)).tokens()) {
+    midi::TOKEN_TYPE tt = rep->get_token_type(token);
+    if ((!use_microtiming) && ((tt == midi::TOKEN_DELTA) || (tt == midi::TOKEN_DELTA_DIRECTION))) {
+      continue;
+    }
+    if ((tt == midi::TOKEN_NOTE_ONSET) && (shift != 0)) {
+      tokens.push_back( rep->encode(midi::TOKEN_NOTE_ONSET, rep->decode(token) + shift) );
+    }
+    else {
+      tokens.push_back( token );
+    }
+  }
+}
+
+// counterpart of Jagged::load_random_segment followed by ENCODER::encode for
+// a shard piece. enc is the private encoder of the batch
+std::vector<int> assemble_token_shard_sequence(const midi::TokenShardPiece &sp, encoder::ENCODER *enc, data_structures::TrainConfig *tc, data_structures::EncoderState *state, std::mt19937 *e) {
+  const std::shared_ptr<encoder::REPRESENTATION> &rep = enc->rep;
+
+  if (tc->use_microtiming) {
+    if (sp.nomml() == 12) {
+      enc->config->use_microtiming = random_on_unit(e) < tc->microtiming;
+    }
+  }
+
+  // same draws as util_protobuf::select_random_segment_indices
+  std::vector<const midi::TokenSpanSegment*> segments;
+  for (const auto &seg : sp.segments()) {
+    if (seg.num_bars() == tc->num_bars) {
+      segments.push_back(&seg);
+    }
+  }
+  if (segments.size() == 0) {
+    throw std::runtime_error("NO VALID SEGMENTS");
+  }
+  const midi::TokenSpanSegment *seg = segments[random_on_range((int)segments.size(), e)];
+  std::vector<int> tracks = arange(seg->tracks_size());
+  shuffle(tracks.begin(), tracks.end(), *e);
+  tracks.resize(std::min((int)tracks.size(), tc->max_tracks));
+
+  int min_pitch = INT_MAX;
+  int max_pitch = 0;
+  for (const auto &track_num : tracks) {
+    const midi::TokenSpanTrack &track = seg->tracks(track_num);
+    if (!track.is_drum()) {
+      min_pitch = std::min(track.min_pitch(), min_pitch);
+      max_pitch = std::max(track.max_pitch(), max_pitch);
+    }
+  }
+  state->transpose = util_protobuf::select_random_transpose(std::make_tuple(min_pitch, max_pitch), e);
+
+  if (enc->config->both_in_one) {
+    state->do_multi_fill = random_on_unit(e) < .75;
+  }
+  if (state->do_multi_fill) {
+    state->multi_fill = util_protobuf::make_bar_mask(
+      (int)tracks.size(), tc->num_bars, tc->max_mask_percentage, e);
+  }
+
+  // same layout as ENCODER::encode_piece
+  std::vector<int> tokens;
+  tokens.push_back( rep->encode(
+    midi::TOKEN_PIECE_START, std::min((int)state->do_multi_fill,rep->get_domain_size(midi::TOKEN_PIECE_START)-1)) );
+  if (rep->has_token_type(midi::TOKEN_NUM_BARS)) {
+    tokens.push_back( rep->encode(midi::TOKEN_NUM_BARS, tc->num_bars) );
+  }
+  for (int i=0; i<(int)tracks.size(); i++) {
+    const midi::TokenSpanTrack &track = seg->tracks(tracks[i]);
+    append_token_shard_header(sp, track, enc, state->transpose, tokens);
+    for (int bar_num=0; bar_num<tc->num_bars; bar_num++) {
+      append_token_span(sp, track.bar_prefix(bar_num), tokens);
+      if ((state->do_multi_fill) && (state->multi_fill.find(std::make_pair(i,bar_num)) != state->multi_fill.end())) {
+        tokens.push_back( rep->encode(midi::TOKEN_FILL_IN_PLACEHOLDER, 0) );
+      }
+      else {
+        append_token_shard_notes(sp, track, bar_num, enc, state->transpose, tokens);
+      }
+      tokens.push_back( rep->encode(midi::TOKEN_BAR_END, 0) );
+    }
+    tokens.push_back( rep->encode(midi::TOKEN_TRACK_END, 0) );
+  }
+  if (state->do_multi_fill) {
+    for (const auto &track_bar : state->multi_fill) {
+      const midi::TokenSpanTrack &track = seg->tracks(tracks[std::get<0>(track_bar)]);
+      tokens.push_back( rep->encode(midi::TOKEN_FILL_IN_START, 0) );
+      append_token_shard_notes(sp, track, std::get<1>(track_bar), enc, state->transpose, tokens);
+      tokens.push_back( rep->encode(midi::TOKEN_FILL_IN_END, 0) );
+    }
+  }
+  return tokens;
+}
+
+}
+// END OF NAMESPACE
@@ -2,6 +2,8 @@
 
 #include "../../common/encoder/encoder_all.h"
 #include <string>
+#include <map>
+#include <mutex>
 
 namespace enums {
 
@@ -23,14 +25,42 @@ ENCODER_TYPE getEncoderType(const std::string &s) {
   return NO_ENCODER;
 }
 
+std::string getEncoderTypeString(ENCODER_TYPE et) {
+  switch (et) {
+    case EXPRESSIVE_ENCODER: return "EXPRESSIVE_ENCODER";
+    case NO_ENCODER: return "NO_ENCODER";
+  }
+  return "NO_ENCODER";
+}
+
 std::vector<std::string> getEncoderTypeList() {
   std::vector<std::string> list;
   list.push_back("EXPRESSIVE_ENCODER");
   return list;
 }
 
+// Encoders are built once per type and shared between callers and threads.
+// A shared encoder must be treated as read-only : per-call state goes through
+// data_structures::EncoderState, and callers that need to change the config
+// use getEncoder to get a private instance (which still shares the
+// REPRESENTATION). set_scheme throws on a shared encoder.
+std::shared_ptr<encoder::ENCODER> getSharedEncoder(ENCODER_TYPE et) {
+  static std::mutex mtx;
+  static std::map<ENCODER_TYPE,std::shared_ptr<encoder::ENCODER>> encoders;
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = encoders.find(et);
+  if (it == encoders.end()) {
+    std::shared_ptr<encoder::ENCODER> encoder(getEncoder(et));
+    if (encoder) {
+      encoder->shared = true;
+    }
+    it = encoders.insert({et, encoder}).first;
+  }
+  return it->second;
+}
+
 int getEncoderSize(ENCODER_TYPE et) {
-  std::unique_ptr<encoder::ENCODER> encoder = getEncoder(et);
+  std::shared_ptr<encoder::ENCODER> encoder = getSharedEncoder(et);
   if (!encoder) {
     return 0;
   }
@@ -48,4 +78,8 @@ std::unique_ptr<encoder::ENCODER> getEncoderFromString(const std::string &s) {
   return getEncoder(getEncoderType(s));
 }
 
+std::shared_ptr<encoder::ENCODER> getSharedEncoderFromString(const std::string &s) {
+  return getSharedEncoder(getEncoderType(s));
+}
+
 }
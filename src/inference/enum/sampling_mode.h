@@ -0,0 +1,15 @@
+#pragma once
+
+
+// START OF NAMESPACE
+namespace enums {
+
+// how Jagged picks the record of each training example
+enum SAMPLING_MODE {
+  SAMPLE_UNIFORM, // uniform, with replacement
+  SAMPLE_EPOCH, // without replacement, in a seeded permutation per epoch
+  SAMPLE_WEIGHTED // with replacement, proportional to the number of valid segments
+};
+
+}
+// END OF NAMESPACE
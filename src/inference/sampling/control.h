@@ -8,6 +8,7 @@
 #pragma once
 
 #include <map>
+#include <random>
 #include <tuple>
 #include <set>
 #include <vector>
@@ -18,6 +19,7 @@
 #include "../../common/encoder/attribute_control.h"
 #include "../../common/data_structures/verbosity.h"
 #include "graph.h"
+#include "mask_automaton.h"
 
 namespace sampling {
 
@@ -66,9 +68,7 @@ public:
         }
 
         if (std::get<0>(target_node) != midi::TOKEN_NONE) {
-          auto msg = data_structures::to_str("CONDITIONAL_REP_GRAPH::possibly_skip() : skip ", util_protobuf::enum_to_string(std::get<0>(target_node)), std::get<1>(target_node));
-          std::cout << msg << std::endl;
-          data_structures::LOGGER(msg);
+          data_structures::LOGGER(data_structures::to_str("CONDITIONAL_REP_GRAPH::possibly_skip() : skip ", util_protobuf::enum_to_string(std::get<0>(target_node)), std::get<1>(target_node)));
           rg->graph.skip(rg->graph.get_previous_nodes(target_node)[0]);
           rg->set_mask(rep->encode(std::get<0>(target_node), 0), mask);
 
@@ -121,6 +121,14 @@ public:
 
     verbose = param->verbose();
 
+    // each sequence samples from its own engine so that a fixed
+    // sampling_seed gives the same output regardless of batching
+    if (param->sampling_seed() != -1) {
+      engine.seed(param->sampling_seed());
+    } else {
+      engine.seed(std::random_device()());
+    }
+
     data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, util_protobuf::protobuf_to_string(status));
     
     initialize(piece, status, param, meta);
@@ -139,6 +147,10 @@ public:
     parse_status(status);
     initialize_members();
 
+    automaton = get_mask_automaton(meta->encoder(), model_type, [&]() {
+      return build_mask_automaton();
+    });
+
   }
 
   ~SAMPLE_CONTROL() {}
@@ -162,15 +174,15 @@ public:
     if (p) {
       std::set<std::tuple<int,int>> barset;
       std::copy(bars.begin(), bars.end(), std::inserter(barset, barset.end()));
-      enc->config->do_multi_fill = true;
-      enc->config->multi_fill = barset;
+      enc_state.do_multi_fill = true;
+      enc_state.multi_fill = barset;
       
       if (param->internal_skip_preprocess()) {
         util_protobuf::calculate_note_durations(p);
-        prompt = enc->encode_wo_preprocess(p);
+        prompt = enc->encode_wo_preprocess(p, enc_state);
       }
       else {
-        prompt = enc->encode(p);
+        prompt = enc->encode(p, enc_state);
       }
       
       data_structures::LOGGER( "FULL PROMPT " );
@@ -195,11 +207,11 @@ public:
   void set_autoregressive_prompt(std::vector<midi::StatusTrack> &tracks, midi::Piece *p, midi::Status *status, midi::HyperParam *param) {
 	  data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "set_autoregressive_prompt" );
 
-    enc->config->do_multi_fill = false;
+    enc_state.do_multi_fill = false;
 
     if (p->tracks_size()) {
       data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "SET AUTOREGRESSIVE PROMPT" );
-      prompt = enc->encode(p);
+      prompt = enc->encode(p, enc_state);
     }
     else {
       prompt.push_back( enc->rep->encode(midi::TOKEN_PIECE_START,0) );
@@ -260,7 +272,7 @@ public:
     // select the correct model
     int nb = status->tracks(0).selected_bars_size();
 
-    enc = enums::getEncoderFromString(meta->encoder());
+    enc = enums::getSharedEncoderFromString(meta->encoder());
 
     if (num_infill_tracks > 0) {
       data_structures::LOGGER( "INFILL" );
@@ -438,7 +450,7 @@ public:
       attribute_masks.push_back( mask );
 
       // changing to use status bar instead
-      std::vector<std::vector<int>> bar_masks;
+      std::vector<TOKEN_MASK> bar_masks;
       for (int bn=0; bn<track.bars_size(); bn++) {
         std::vector<int> bar_mask(mask);
         midi::StatusBar bar = track.bars(bn);
@@ -447,7 +459,7 @@ public:
           bar_mask[tstoken] = 1; // only allow time signature
         }
         set_bar_masks(rep, bar_mask, &bar);
-        bar_masks.push_back( bar_mask );
+        bar_masks.push_back( TOKEN_MASK(bar_mask) );
       }
       attribute_bar_masks.push_back( bar_masks );
     
@@ -566,29 +578,68 @@ public:
 
   }
 
-  void set_mask(int last_token, std::vector<int> &mask) {
-    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "controlhSAMPLECONTROL set_mask" );
-
-    // basic constraints of the representation    
+  // advances the grammar graph g with last_token and sets the token types
+  // that may follow in mask
+  void graph_step(std::unique_ptr<REP_GRAPH> &g, midi::TRACK_TYPE track_type, int last_token, std::vector<int> &mask) {
     midi::TOKEN_TYPE last_tt = rep->get_token_type(last_token);
-    bool is_drum = data_structures::is_drum_track(current_track_type);
+    bool is_drum = data_structures::is_drum_track(track_type);
 
     // automatically handle skipping tokens when necessary for drum or instrument tracks
-    midi::TOKEN_TYPE inst_skip = instrument_rg->possibly_skip(current_track_type, last_token, rg, rep, mask);
-    midi::TOKEN_TYPE drum_skip = drum_rg->possibly_skip(current_track_type, last_token, rg, rep, mask);
+    midi::TOKEN_TYPE inst_skip = instrument_rg->possibly_skip(track_type, last_token, g, rep, mask);
+    midi::TOKEN_TYPE drum_skip = drum_rg->possibly_skip(track_type, last_token, g, rep, mask);
 
     if ((is_drum) && (last_tt == midi::TOKEN_NOTE_ONSET)) {
       // fast forward past NOTE_DURATION token
-      rg->skip(midi::TOKEN_NOTE_ONSET);
-      rg->set_mask(rep->encode(midi::TOKEN_NOTE_DURATION,0), mask);
+      g->skip(midi::TOKEN_NOTE_ONSET);
+      g->set_mask(rep->encode(midi::TOKEN_NOTE_DURATION,0), mask);
     }
     else if ((inst_skip == midi::TOKEN_NONE) && (drum_skip == midi::TOKEN_NONE)) {
-      rg->set_mask(last_token, mask);
+      g->set_mask(last_token, mask);
+    }
+  }
+
+  // enumerates graph_step for every node, token type and track kind
+  std::shared_ptr<const TOKEN_MASK_AUTOMATON> build_mask_automaton() {
+    std::vector<NODE_TYPE> nodes;
+    for (const auto &kv : rg->graph.nodes) {
+      nodes.push_back(kv.first);
+    }
+    std::vector<int> token_types;
+    int num_types = 0;
+    for (int token=0; token<rep->max_token(); token++) {
+      int tt = rep->get_token_type(token);
+      token_types.push_back(tt);
+      num_types = std::max(num_types, tt + 1);
+    }
+    auto step = [&](const NODE_TYPE &node, int token, bool is_drum, std::vector<int> &mask) {
+      auto g = std::make_unique<REP_GRAPH>(*rg);
+      g->graph.current_node = node;
+      g->graph.traversal_started = true;
+      graph_step(g, is_drum ? midi::STANDARD_DRUM_TRACK : midi::STANDARD_TRACK, token, mask);
+      return g->graph.current_node;
+    };
+    return std::make_shared<TOKEN_MASK_AUTOMATON>(nodes, token_types, num_types, rep->max_token(), step);
+  }
+
+  void set_mask(int last_token, TOKEN_MASK &mask) {
+    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "controlhSAMPLECONTROL set_mask" );
+
+    // basic constraints of the representation    
+    midi::TOKEN_TYPE last_tt = rep->get_token_type(last_token);
+
+    // the first step (before traversal has started) goes through the graph
+    if ((automaton) && (rg->graph.traversal_started)) {
+      rg->graph.current_node = automaton->step(rg->graph.current_node, last_token, data_structures::is_drum_track(current_track_type), mask);
+    }
+    else {
+      std::vector<int> graph_mask(mask.size(), 0);
+      graph_step(rg, current_track_type, last_token, graph_mask);
+      mask.merge(TOKEN_MASK(graph_mask));
     }
 
     // can't have onset for note that is already sounding
     for (const auto &pitch : onsets) {
-      mask[rep->encode(midi::TOKEN_NOTE_ONSET,pitch)] = 0;
+      mask.reset(rep->encode(midi::TOKEN_NOTE_ONSET,pitch));
     }    
    
     // can't have note onsets when timestep == barlength
@@ -597,8 +648,8 @@ public:
       if (verbose) {
         data_structures::LOGGER( "HIT TIME LIMIT >>>>>>>>>>>>>>>>>>>> " );
       }
-      rep->set_mask(midi::TOKEN_NOTE_ONSET, {-1}, mask, 0);
-      rep->set_mask(midi::TOKEN_VELOCITY_LEVEL, {-1}, mask, 0);
+      mask.reset(rep->type_tokens[midi::TOKEN_NOTE_ONSET]);
+      mask.reset(rep->type_tokens[midi::TOKEN_VELOCITY_LEVEL]);
     }
 
     // determine what the hard limit is
@@ -616,8 +667,8 @@ public:
     // can't have more than n simultaneous notes
     if ((int)onsets.size() >= hard_limit) {
       data_structures::LOGGER(data_structures::to_str("HIT HARD LIMIT ( ",(int)onsets.size()," >= ", hard_limit, " ) >>>>>>>>>>>>>>>>>>>> "));
-      rep->set_mask(midi::TOKEN_NOTE_ONSET, {-1}, mask, 0);
-      rep->set_mask(midi::TOKEN_VELOCITY_LEVEL, {-1}, mask, 0);
+      mask.reset(rep->type_tokens[midi::TOKEN_NOTE_ONSET]);
+      mask.reset(rep->type_tokens[midi::TOKEN_VELOCITY_LEVEL]);
       // will be ignored if token doesn't exist
     }
 
@@ -627,12 +678,12 @@ public:
     if (!enc->config->use_microtiming) {
       for (int td=0; td<delta_domain_limit; td++) {
         data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("NOT USE MICRO -> ","MASKING DELTA :: ", td));
-        mask[rep->encode(midi::TOKEN_DELTA,td)] = 0;
+        mask.reset(rep->encode(midi::TOKEN_DELTA,td));
       }
     } else {
       if (last_tt == midi::TOKEN_DELTA) {
         num_delta_tokens += 1;
-        mask[rep->encode(midi::TOKEN_DELTA_DIRECTION,0)] = 0;
+        mask.reset(rep->encode(midi::TOKEN_DELTA_DIRECTION,0));
       } else {
         num_delta_tokens = 0;
       }
@@ -640,7 +691,7 @@ public:
       if (num_delta_tokens > 0) {
         for (int td=0; td<delta_domain_limit; td++) {
           data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("MAX MULTIPLE -> ","MASKING DELTA :: ", td));
-          mask[rep->encode(midi::TOKEN_DELTA,td)] = 0;
+          mask.reset(rep->encode(midi::TOKEN_DELTA,td));
         }
       }
       
@@ -653,21 +704,21 @@ public:
         int max_td = std::max(std::min(max_step, delta_domain_limit), 0);
         for (int td=max_td; td<delta_domain_limit; td++) {
           data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("MAX FORWARD/BACKWARD -> ","MASKING DELTA :: ", td));
-          mask[rep->encode(midi::TOKEN_DELTA,td)] = 0;
+          mask.reset(rep->encode(midi::TOKEN_DELTA,td));
         }
       }
 
       //Forward delta only at start of bar
       if (timestep == 0) {
         data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("AT START -> ","MASKING DELTA DIRECTION"));
-        mask[rep->encode(midi::TOKEN_DELTA_DIRECTION,0)] = 0;
+        mask.reset(rep->encode(midi::TOKEN_DELTA_DIRECTION,0));
       }
 
       //Backward delta only at end of bar
       if (timestep == barlength) {
         for (int td=1; td<delta_domain_limit; td++) {
           data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("AT END -> ","MASKING DELTA :: ", 0));
-          mask[rep->encode(midi::TOKEN_DELTA,td)] = 0;
+          mask.reset(rep->encode(midi::TOKEN_DELTA,td));
         }
       }
     }
@@ -677,55 +728,53 @@ public:
     int domain_limit = rep->get_domain_size(midi::TOKEN_TIME_ABSOLUTE_POS);
     if (domain_limit) {
       for (int td=0; td<=timestep; td++) {
-        mask[rep->encode(midi::TOKEN_TIME_ABSOLUTE_POS,td)] = 0;
+        mask.reset(rep->encode(midi::TOKEN_TIME_ABSOLUTE_POS,td));
       }
       for (int td=barlength+1; td<domain_limit; td++) {
-        mask[rep->encode(midi::TOKEN_TIME_ABSOLUTE_POS,td)] = 0;
+        mask.reset(rep->encode(midi::TOKEN_TIME_ABSOLUTE_POS,td));
       }
     }
     
     if (model_type == enums::TRACK_MODEL) {
       // limit number of bars
       if (bar_count != num_bars) {
-        rep->set_mask(midi::TOKEN_TRACK_END, {-1}, mask, 0);
+        mask.reset(rep->type_tokens[midi::TOKEN_TRACK_END]);
       }
       else {
-        rep->set_mask(midi::TOKEN_BAR, {-1}, mask, 0);
+        mask.reset(rep->type_tokens[midi::TOKEN_BAR]);
       }
       // limit the track count
       if (track_count >= num_tracks) {
-        std::fill(mask.begin(), mask.end(), 0);
+        mask.reset();
         finished = true;
       }
       // only add attribute mask if not finished
       // otherwise it will crash with track_count out of range
       if (!finished) {
-        for (int i=0; i<(int)mask.size(); i++) {
-          int num_bars = attribute_bar_masks[track_count].size();
-          int safe_bar_index = std::min(bar_count, num_bars - 1);
-          mask[i] *= attribute_bar_masks[track_count][safe_bar_index][i];
-        }
+        int num_bars = attribute_bar_masks[track_count].size();
+        int safe_bar_index = std::min(bar_count, num_bars - 1);
+        mask.intersect(attribute_bar_masks[track_count][safe_bar_index]);
       }
     }
     else if ((model_type == enums::BAR_INFILL_MODEL)) {
       // limit the bar infill count
       if (infill_bar_count >= num_infill_bars) {
-        std::fill(mask.begin(), mask.end(), 0);
+        mask.reset();
         finished = true;
       }
     }
 
     // if mask is all zeros we have a problem as the model has
     // no 'valid' path forward
-    if ((std::find(mask.begin(), mask.end(), 1) == mask.end()) && (!finished)) {
+    if ((!mask.any()) && (!finished)) {
       throw std::runtime_error("FATAL ERROR : EVERY TOKEN IS MASKED");
     }
 
   }
 
-  std::vector<int> get_mask(std::vector<int> &tokens) {
+  TOKEN_MASK get_mask(std::vector<int> &tokens) {
       data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "get_mask" );
-    std::vector<int> mask(enc->rep->max_token(), 0);
+    TOKEN_MASK mask(enc->rep->max_token());
     for (int t=token_position; t<(int)tokens.size(); t++) {
       if (verbose) {
         data_structures::LOGGER(data_structures::to_str("UPDATING [", token_position, "] :: ", enc->rep->pretty(tokens[t])));
@@ -759,7 +808,7 @@ public:
   int num_tracks;
   int num_infill_bars;
   std::vector<std::vector<int>> attribute_masks;
-  std::vector<std::vector<std::vector<int>>> attribute_bar_masks;
+  std::vector<std::vector<TOKEN_MASK>> attribute_bar_masks;
 
   std::vector<int> prompt;
   std::vector<int> inverse_order;
@@ -767,6 +816,8 @@ public:
 
   int token_position;
   bool finished;
+  std::mt19937 engine;
+  std::shared_ptr<const TOKEN_MASK_AUTOMATON> automaton;
   enums::MODEL_TYPE model_type;
   std::vector<int> history;
 
@@ -776,7 +827,8 @@ public:
   std::vector<float> track_temperatures;
   std::vector<std::pair<int,int>> selected_bars;
 
-  std::unique_ptr<encoder::ENCODER> enc;
+  std::shared_ptr<encoder::ENCODER> enc; // shared, read-only
+  data_structures::EncoderState enc_state;
   std::shared_ptr<encoder::REPRESENTATION> rep;
   std::unique_ptr<REP_GRAPH> rg;
   std::unique_ptr<INSTRUMENT_CONDITIONAL_REP_GRAPH> instrument_rg;
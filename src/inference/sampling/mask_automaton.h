@@ -0,0 +1,149 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "graph.h"
+#include "sampler.h"
+
+namespace sampling {
+
+// The grammar part of SAMPLE_CONTROL::set_mask only depends on the current
+// node of the REP_GRAPH, the type of the last token and whether the current
+// track is a drum track. TOKEN_MASK_AUTOMATON enumerates these once into a
+// flat transition table, where each entry holds the next node and an index
+// into a set of precomputed vocabulary bitsets. A step merges the bitset into
+// the TOKEN_MASK that is passed to the sampler, so the grammar mask is never
+// expanded to one int per token.
+class TOKEN_MASK_AUTOMATON {
+public:
+	// simulates one graph step from node with a token of the given type.
+	// returns the resulting node and fills mask with the allowed tokens
+	using STEP_FN = std::function<NODE_TYPE(const NODE_TYPE &node, int token, bool is_drum, std::vector<int> &mask)>;
+
+	struct TRANSITION {
+		int next = -1;
+		int mask = -1;
+		std::string error;
+	};
+
+	TOKEN_MASK_AUTOMATON(const std::vector<NODE_TYPE> &node_list, const std::vector<int> &token_to_type, int num_token_types, int vocab_size, STEP_FN step) {
+		nodes = node_list;
+		token_types = token_to_type;
+		num_types = num_token_types;
+		words = (vocab_size + 63) / 64;
+		for (int i=0; i<(int)nodes.size(); i++) {
+			node_index[nodes[i]] = i;
+		}
+
+		// a representative token for each token type
+		std::vector<int> first_token(num_types, -1);
+		for (int token=0; token<(int)token_types.size(); token++) {
+			int tt = token_types[token];
+			if ((tt >= 0) && (first_token[tt] == -1)) {
+				first_token[tt] = token;
+			}
+		}
+
+		std::map<std::vector<uint64_t>,int> mask_index;
+		table.resize(nodes.size() * num_types * 2);
+		for (int s=0; s<(int)nodes.size(); s++) {
+			for (int tt=0; tt<num_types; tt++) {
+				if (first_token[tt] == -1) {
+					continue;
+				}
+				for (int drum=0; drum<2; drum++) {
+					TRANSITION &tr = table[index(s, tt, drum)];
+					std::vector<int> mask(vocab_size, 0);
+					try {
+						NODE_TYPE next = step(nodes[s], first_token[tt], drum, mask);
+						auto it = node_index.find(next);
+						if (it == node_index.end()) {
+							tr.error = "ERROR : INVALID NODE IN DIGRAPH (" + toString(next) + ")";
+							continue;
+						}
+						tr.next = it->second;
+					}
+					catch (const std::exception &e) {
+						tr.error = e.what();
+						continue;
+					}
+					TOKEN_MASK packed(mask);
+					std::vector<uint64_t> bits(packed.data(), packed.data() + words);
+					auto it = mask_index.find(bits);
+					if (it == mask_index.end()) {
+						it = mask_index.insert({bits, (int)(masks.size() / words)}).first;
+						masks.insert(masks.end(), bits.begin(), bits.end());
+					}
+					tr.mask = it->second;
+				}
+			}
+		}
+	}
+
+	int state(const NODE_TYPE &node) const {
+		auto it = node_index.find(node);
+		return (it == node_index.end()) ? -1 : it->second;
+	}
+
+	// adds the allowed tokens for the transition to mask, which must have
+	// vocab_size tokens, and returns the next node. throws the same errors as
+	// the graph traversal would
+	NODE_TYPE step(const NODE_TYPE &node, int last_token, bool is_drum, TOKEN_MASK &mask) const {
+		int s = state(node);
+		int tt = ((last_token >= 0) && (last_token < (int)token_types.size())) ? token_types[last_token] : -1;
+		if ((s < 0) || (tt < 0)) {
+			throw std::runtime_error("ERROR : INVALID TOKEN MASK AUTOMATON STATE");
+		}
+		const TRANSITION &tr = table[index(s, tt, is_drum)];
+		if (tr.next < 0) {
+			throw std::runtime_error(tr.error.size() ? tr.error : "ERROR : CANNOT INFER NODE");
+		}
+		if (mask.num_words() != words) {
+			throw std::runtime_error("ERROR : TOKEN MASK SIZE DOES NOT MATCH THE AUTOMATON");
+		}
+		mask.merge(masks.data() + (size_t)tr.mask * words);
+		return nodes[tr.next];
+	}
+
+	int num_states() const {
+		return nodes.size();
+	}
+
+	int num_masks() const {
+		return words ? masks.size() / words : 0;
+	}
+
+private:
+	size_t index(int s, int tt, bool drum) const {
+		return ((size_t)s * num_types + tt) * 2 + (int)drum;
+	}
+
+	std::vector<NODE_TYPE> nodes;
+	std::map<NODE_TYPE,int> node_index;
+	std::vector<int> token_types;
+	int num_types;
+	int words;
+	std::vector<TRANSITION> table;
+	std::vector<uint64_t> masks;
+};
+
+// automata are compiled once per encoder and model type and shared
+std::shared_ptr<const TOKEN_MASK_AUTOMATON> get_mask_automaton(const std::string &encoder_name, int model_type, const std::function<std::shared_ptr<const TOKEN_MASK_AUTOMATON>()> &build) {
+	static std::mutex mtx;
+	static std::map<std::tuple<std::string,int>,std::shared_ptr<const TOKEN_MASK_AUTOMATON>> automata;
+	std::lock_guard<std::mutex> lock(mtx);
+	auto key = std::make_tuple(encoder_name, model_type);
+	auto it = automata.find(key);
+	if (it == automata.end()) {
+		it = automata.insert({key, build()}).first;
+	}
+	return it->second;
+}
+
+}
@@ -2,9 +2,14 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "callback_base.h"
 #include "sample_internal.h"
+#include "scheduler.h"
 #include "../../common/midi_parsing/util_protobuf.h"
 
 #include <google/protobuf/util/message_differencer.h>
@@ -259,7 +264,7 @@ std::vector<STEP> find_steps(const std::vector<std::vector<bool>> &sel, const st
   return steps;
 }
 
-void sample_step(midi::Piece *piece, midi::Status *status, midi::HyperParam *param, const std::unique_ptr<ModelMeta> &model, const STEP *s, CallbackManager *callbacks) {
+void sample_step(midi::Piece *piece, midi::Status *status, midi::HyperParam *param, const std::shared_ptr<ModelMeta> &model, const STEP *s, CallbackManager *callbacks, InferenceSession *session=NULL) {
     data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "sample_step" );
     
     // prepare the inputs for generation
@@ -268,11 +273,16 @@ void sample_step(midi::Piece *piece, midi::Status *status, midi::HyperParam *par
     status_rehighlight(&step_status, s->get_bars_to_generate());  
 
     // do generation
-    midi::Piece gen_piece = generate(&step_status, &step_piece, param, model, callbacks)[0];
+    midi::Piece gen_piece;
+    if ((!session) && ((param->internal_use_batching()) || (BATCH_SCHEDULER::instance().enabled()))) {
+      gen_piece = generate_batched(&step_status, &step_piece, param, model, callbacks)[0];
+    } else {
+      gen_piece = generate(&step_status, &step_piece, param, model, callbacks, session)[0];
+    }
     // NOTE : this inserts tracks that are just conditioned on as well
     // insert generation into global piece
     piece_insert(piece, &gen_piece, s->get_bar_mapping(), param->verbose());
-    std::unique_ptr<encoder::ENCODER> enc = enums::getEncoderFromString(model->meta.encoder());
+    std::shared_ptr<encoder::ENCODER> enc = enums::getSharedEncoderFromString(model->meta.encoder());
     if (!enc.get()) {
         throw std::invalid_argument("INVALID ENCODER");
     }
@@ -285,7 +295,7 @@ void sample_step(midi::Piece *piece, midi::Status *status, midi::HyperParam *par
 
 // ==============================
 // MAIN INFERENCE ENTRYPOINT
-void sample(midi::Piece* piece, midi::Status* raw_status, midi::HyperParam* param, CallbackManager *callbacks) {
+void sample(midi::Piece* piece, midi::Status* raw_status, midi::HyperParam* param, CallbackManager *callbacks, InferenceSession *session=NULL) {
     data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, "sample" );
 
     //CheckIfDataExists
@@ -302,10 +312,10 @@ void sample(midi::Piece* piece, midi::Status* raw_status, midi::HyperParam* para
     midi::Status* status_pointer = &status_object;
 
     // try to load model
-    std::unique_ptr<ModelMeta> model = load_model(param);
+    std::shared_ptr<ModelMeta> model = load_model(param);
 
     // Check if encoder exists
-    std::unique_ptr<encoder::ENCODER> enc = enums::getEncoderFromString(model->meta.encoder());
+    std::shared_ptr<encoder::ENCODER> enc = enums::getSharedEncoderFromString(model->meta.encoder());
     if (!enc.get()) {
         throw std::invalid_argument("INVALID ENCODER");
     }
@@ -363,7 +373,7 @@ void sample(midi::Piece* piece, midi::Status* raw_status, midi::HyperParam* para
       }
       STEP step = steps[i];
       data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, data_structures::to_str("Sampling step :: decoding final = ", status_pointer->decode_final()));
-      sample_step(piece, status_pointer, param, model, &step, callbacks);
+      sample_step(piece, status_pointer, param, model, &step, callbacks, session);
     }
     util_protobuf::reorder_tracks(piece, reverse_order);
     std::string json_string_res = util_protobuf::protobuf_to_string(piece);
@@ -423,8 +433,177 @@ std::vector<std::tuple<int,int>> find_identical_bars(midi::Piece *input, midi::P
   return identical_bars;
 }
 
+// callback given to each parallel candidate. it buffers the predictions so
+// that only those of the selected candidate are passed on, and forwards
+// cancellation of the parent request
+class CandidateCallback : public CallbackBase {
+public:
+  CandidateCallback (CallbackManager *_parent) {
+    parent = _parent;
+    cancel = false;
+  }
+  void on_bar_end() {
+    if ((parent) && (parent->callbacks.size())) {
+      events.push_back(std::make_tuple(true, std::vector<float>(), -1));
+    }
+  }
+  void on_prediction(std::vector<float> &logits, int next_token) {
+    if ((parent) && (parent->callbacks.size())) {
+      events.push_back(std::make_tuple(false, logits, next_token));
+    }
+  }
+  bool is_cancelled() {
+    return cancel || ((parent) && (parent->is_cancelled()));
+  }
+  void replay() {
+    if (!parent) {
+      return;
+    }
+    for (auto &e : events) {
+      if (std::get<0>(e)) {
+        parent->on_bar_end();
+      } else {
+        parent->on_prediction(std::get<1>(e), std::get<2>(e));
+      }
+    }
+  }
+  CallbackManager *parent;
+  std::atomic<bool> cancel;
+  std::vector<std::tuple<bool,std::vector<float>,int>> events;
+};
+
+// temperature increase between parallel candidates when no callback raises it
+const float PARALLEL_ATTEMPT_TEMPERATURE_STEP = .1;
+const float PARALLEL_ATTEMPT_MAX_TEMPERATURE = 2.;
+
+// runs max_attempts candidates concurrently, at most the max batch size of
+// the batch scheduler at a time. each candidate uses the temperature the
+// sequential retries would have used, or a temperature
+// PARALLEL_ATTEMPT_TEMPERATURE_STEP above the previous one when the callbacks
+// do not raise it. the candidates are decoded by the batch scheduler so that
+// aligned sequences share a forward pass. like the sequential path, the
+// lowest candidate that passes the novelty check wins, and once a candidate
+// is novel the candidates after it are cancelled or not started. so the
+// result does not depend on which candidate finishes first. returns the
+// number of attempts used : the position of the winner plus one, or
+// max_attempts if no candidate is novel.
+int sample_multi_attempts_parallel(midi::Piece* piece, midi::Status* status, midi::HyperParam* param, CallbackManager *callbacks, int max_attempts) {
+  midi::Piece input;
+  input.CopyFrom(*piece);
+
+  std::vector<midi::Piece> candidates(max_attempts);
+  std::vector<midi::HyperParam> params(max_attempts);
+  std::vector<std::shared_ptr<CandidateCallback>> candidate_callbacks;
+  std::vector<CallbackManager> managers(max_attempts);
+  float temperature = param->temperature();
+  for (int k=0; k<max_attempts; k++) {
+    candidates[k].CopyFrom(*piece);
+    params[k].CopyFrom(*param);
+    params[k].set_temperature(temperature);
+    params[k].set_parallel_attempts(false);
+    params[k].set_internal_use_batching(true);
+    if (param->sampling_seed() != -1) {
+      params[k].set_sampling_seed(param->sampling_seed() + k);
+    }
+    candidate_callbacks.push_back(std::make_shared<CandidateCallback>(callbacks));
+    managers[k].add_callback_ptr(candidate_callbacks[k]);
+    if (k < max_attempts - 1) {
+      float next = callbacks ? callbacks->update_temperature(temperature) : temperature;
+      if (next <= temperature) {
+        next = std::min(temperature + PARALLEL_ATTEMPT_TEMPERATURE_STEP, std::max(temperature, PARALLEL_ATTEMPT_MAX_TEMPERATURE));
+      }
+      temperature = next;
+    }
+  }
+
+  // candidates from limit on are not needed (a lower one is novel). limit,
+  // done, novel and errors are guarded by mtx
+  std::mutex mtx;
+  std::condition_variable done_cv;
+  int next_candidate = 0;
+  int limit = max_attempts;
+  std::vector<bool> done(max_attempts, false);
+  std::vector<bool> novel(max_attempts, false);
+  std::vector<std::exception_ptr> errors(max_attempts, nullptr);
+  auto work = [&]() {
+    while (true) {
+      int k;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (next_candidate >= limit) {
+          return;
+        }
+        k = next_candidate++;
+      }
+      bool is_novel = false;
+      std::exception_ptr error = nullptr;
+      try {
+        sample(&candidates[k], status, &params[k], &managers[k]);
+        is_novel = (!candidate_callbacks[k]->is_cancelled()) && (find_identical_bars(&input, &candidates[k], status).size() == 0);
+      }
+      catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        done[k] = true;
+        novel[k] = is_novel;
+        errors[k] = error;
+        if ((is_novel) && (k < limit)) {
+          limit = k + 1;
+          for (int j=k+1; j<max_attempts; j++) {
+            candidate_callbacks[j]->cancel = true;
+          }
+        }
+      }
+      done_cv.notify_all();
+    }
+  };
+  int num_threads = std::min(max_attempts, BATCH_SCHEDULER::instance().get_max_batch_size());
+  std::vector<std::thread> threads;
+  for (int t=0; t<num_threads; t++) {
+    threads.push_back(std::thread(work));
+  }
+
+  // candidates are checked in order, as the sequential retries would
+  int winner = -1;
+  std::exception_ptr error = nullptr;
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (int k=0; k<max_attempts; k++) {
+      done_cv.wait(lock, [&]() { return done[k]; });
+      if ((errors[k]) || (novel[k])) {
+        error = errors[k];
+        winner = error ? -1 : k;
+        // the candidates after k are not needed
+        limit = 0;
+        for (int j=k+1; j<max_attempts; j++) {
+          candidate_callbacks[j]->cancel = true;
+        }
+        break;
+      }
+    }
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  if (winner >= 0) {
+    piece->CopyFrom(candidates[winner]);
+    candidate_callbacks[winner]->replay();
+    return winner + 1;
+  }
+  return max_attempts;
+}
+
 // wrapper function that ensures novelty and non-silence
-int sample_multi_attempts(midi::Piece* piece, midi::Status* status, midi::HyperParam* param, CallbackManager *callbacks, int max_attempts) {
+int sample_multi_attempts(midi::Piece* piece, midi::Status* status, midi::HyperParam* param, CallbackManager *callbacks, int max_attempts, InferenceSession *session=NULL) {
+  if ((param->parallel_attempts()) && (max_attempts > 1) && (!session)) {
+    return sample_multi_attempts_parallel(piece, status, param, callbacks, max_attempts);
+  }
   int attempts = 0;
   midi::Piece input;
   input.CopyFrom(*piece);
@@ -432,7 +611,7 @@ int sample_multi_attempts(midi::Piece* piece, midi::Status* status, midi::HyperP
     std::cout << "ATTEMPT " << attempts << std::endl;
     midi::Piece current;
     current.CopyFrom(*piece);
-    sample(&current, status, param, callbacks);
+    sample(&current, status, param, callbacks, session);
     std::vector<std::tuple<int,int>> identical_bars = find_identical_bars(&input, &current, status);
     attempts++;
     if (identical_bars.size() == 0) {
@@ -446,7 +625,7 @@ int sample_multi_attempts(midi::Piece* piece, midi::Status* status, midi::HyperP
   return attempts;
 }
 
-std::tuple<std::string,int> sample_multi_step_py(std::string &piece_json, std::string &status_json, std::string &param_json, int max_attempts, sampling::CallbackManager *callbacks) {
+std::tuple<std::string,int> sample_multi_step_py(std::string &piece_json, std::string &status_json, std::string &param_json, int max_attempts, sampling::CallbackManager *callbacks, InferenceSession *session=NULL) {
   midi::Piece piece;
   midi::Status status;
   midi::HyperParam hyperParam;
@@ -468,7 +647,7 @@ std::tuple<std::string,int> sample_multi_step_py(std::string &piece_json, std::s
   data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_VERBOSE, util_protobuf::protobuf_to_string(&status));
   data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_VERBOSE, util_protobuf::protobuf_to_string(&hyperParam));
 
-  int attempts = sample_multi_attempts(&piece, &status, &hyperParam, callbacks, max_attempts);
+  int attempts = sample_multi_attempts(&piece, &status, &hyperParam, callbacks, max_attempts, session);
   return std::make_tuple(util_protobuf::protobuf_to_string(&piece), attempts);
 }
 
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <ATen/core/ivalue.h>
+#include <torch/script.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "session.h"
+
+namespace sampling {
+
+  // node of the radix tree. edge holds the tokens between the parent and
+  // this node, depth is the number of tokens from the root to this node.
+  struct PREFIX_NODE {
+    std::vector<int> edge;
+    std::map<int,std::unique_ptr<PREFIX_NODE>> children;
+    PREFIX_NODE *parent = NULL;
+    int depth = 0;
+    bool has_state = false;
+    torch::jit::IValue state;
+    size_t nbytes = 0;
+    uint64_t last_used = 0;
+  };
+
+  // Process-wide cache of past_key_values snapshots keyed by token sequence.
+  // A snapshot taken after n tokens can be truncated to any shorter prefix, so
+  // a new prompt restores the state of the deepest matching node and only the
+  // remaining tokens are fed through the model. Snapshots are evicted in LRU
+  // order once their total size exceeds the memory budget.
+  class PREFIX_CACHE {
+  public:
+    static PREFIX_CACHE& instance() {
+      static PREFIX_CACHE cache;
+      return cache;
+    }
+
+    // sets up the model inputs for prompt from the deepest cached prefix.
+    // returns the number of prompt tokens that were restored.
+    int prepare(const std::vector<int> &prompt, const std::shared_ptr<ModelMeta> &mm, std::vector<torch::jit::IValue> &inputs) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (budget == 0) {
+        return 0;
+      }
+      num_lookups++;
+      num_prompt_tokens += prompt.size();
+      PREFIX_NODE *root = get_root(mm, false);
+      if (!root) {
+        return 0;
+      }
+      int matched = 0;
+      PREFIX_NODE *node = match(root, prompt, &matched);
+      // any snapshot below the match point covers the matched tokens
+      PREFIX_NODE *src = find_state(node);
+      if (!src) {
+        src = node;
+        while ((src) && (!src->has_state)) {
+          src = src->parent;
+        }
+        if (!src) {
+          return 0;
+        }
+        matched = src->depth;
+      }
+      // at least one token must be fed to obtain the next logits
+      int reused = std::min(matched, (int)prompt.size() - 1);
+      if (reused <= 0) {
+        return 0;
+      }
+      src->last_used = ++clock;
+      inputs.clear();
+      std::vector<int> suffix(prompt.begin() + reused, prompt.end());
+      auto opts = torch::TensorOptions().dtype(torch::kInt64);
+      inputs.push_back( torch::tensor(suffix, opts).view({1, -1}) );
+      inputs.push_back( truncate_state(src->state, reused) );
+      num_hits++;
+      num_reused_tokens += reused;
+      return reused;
+    }
+
+    // stores the state for the first n tokens of seq, where n is the number
+    // of positions held in past
+    void insert(const std::vector<int> &seq, const torch::jit::IValue &past, const std::shared_ptr<ModelMeta> &mm) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if ((budget == 0) || (!past.isTuple())) {
+        return;
+      }
+      int64_t n = state_length(past);
+      size_t nbytes = state_nbytes(past);
+      if ((n <= 0) || (n > (int64_t)seq.size()) || (nbytes > budget)) {
+        return;
+      }
+      PREFIX_NODE *node = get_root(mm, true);
+      int pos = 0;
+      while (pos < n) {
+        auto it = node->children.find(seq[pos]);
+        if (it == node->children.end()) {
+          auto child = std::make_unique<PREFIX_NODE>();
+          child->edge.assign(seq.begin() + pos, seq.begin() + n);
+          child->parent = node;
+          child->depth = n;
+          PREFIX_NODE *next = child.get();
+          node->children[seq[pos]] = std::move(child);
+          node = next;
+          pos = n;
+          break;
+        }
+        PREFIX_NODE *child = it->second.get();
+        int k = 0;
+        while ((k < (int)child->edge.size()) && (pos + k < n) && (child->edge[k] == seq[pos + k])) {
+          k++;
+        }
+        if (k < (int)child->edge.size()) {
+          child = split(node, child, k);
+        }
+        node = child;
+        pos += k;
+      }
+      if (node->has_state) {
+        total_bytes -= node->nbytes;
+      }
+      node->has_state = true;
+      node->state = past;
+      node->nbytes = nbytes;
+      node->last_used = ++clock;
+      total_bytes += nbytes;
+      evict();
+    }
+
+    // budget in bytes, 0 disables the cache
+    void set_budget(size_t nbytes) {
+      std::lock_guard<std::mutex> lock(mtx);
+      budget = nbytes;
+      evict();
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(mtx);
+      roots.clear();
+      total_bytes = 0;
+      num_entries = 0;
+    }
+
+    std::map<std::string,double> stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return {
+        {"lookups", (double)num_lookups},
+        {"hits", (double)num_hits},
+        {"hit_rate", num_lookups ? (double)num_hits / num_lookups : 0.},
+        {"reused_tokens", (double)num_reused_tokens},
+        {"prompt_tokens", (double)num_prompt_tokens},
+        {"token_hit_rate", num_prompt_tokens ? (double)num_reused_tokens / num_prompt_tokens : 0.},
+        {"entries", (double)num_entries},
+        {"evictions", (double)num_evictions},
+        {"bytes", (double)total_bytes},
+        {"budget", (double)budget}
+      };
+    }
+
+    void reset_stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      num_lookups = 0;
+      num_hits = 0;
+      num_reused_tokens = 0;
+      num_prompt_tokens = 0;
+      num_evictions = 0;
+    }
+
+  private:
+    struct ROOT {
+      std::weak_ptr<ModelMeta> model;
+      std::unique_ptr<PREFIX_NODE> node;
+    };
+
+    PREFIX_CACHE() {}
+
+    // one tree per model. a tree whose model was released is discarded
+    PREFIX_NODE *get_root(const std::shared_ptr<ModelMeta> &mm, bool create) {
+      auto it = roots.find(mm.get());
+      if ((it != roots.end()) && (it->second.model.expired())) {
+        drop_subtree(it->second.node.get());
+        roots.erase(it);
+        it = roots.end();
+      }
+      if (it == roots.end()) {
+        if (!create) {
+          return NULL;
+        }
+        ROOT r;
+        r.model = mm;
+        r.node = std::make_unique<PREFIX_NODE>();
+        it = roots.emplace(mm.get(), std::move(r)).first;
+      }
+      return it->second.node.get();
+    }
+
+    // walks down the tree as far as prompt matches. returns the node at (or
+    // the node whose edge contains) the end of the match
+    PREFIX_NODE *match(PREFIX_NODE *node, const std::vector<int> &prompt, int *matched) {
+      int pos = 0;
+      while (pos < (int)prompt.size()) {
+        auto it = node->children.find(prompt[pos]);
+        if (it == node->children.end()) {
+          break;
+        }
+        PREFIX_NODE *child = it->second.get();
+        int k = 0;
+        while ((k < (int)child->edge.size()) && (pos + k < (int)prompt.size()) && (child->edge[k] == prompt[pos + k])) {
+          k++;
+        }
+        pos += k;
+        node = child;
+        if (k < (int)child->edge.size()) {
+          break;
+        }
+      }
+      *matched = pos;
+      return node;
+    }
+
+    PREFIX_NODE *find_state(PREFIX_NODE *node) {
+      if (node->has_state) {
+        return node;
+      }
+      for (const auto &kv : node->children) {
+        PREFIX_NODE *found = find_state(kv.second.get());
+        if (found) {
+          return found;
+        }
+      }
+      return NULL;
+    }
+
+    // splits the edge of child after k tokens and returns the new middle node
+    PREFIX_NODE *split(PREFIX_NODE *parent, PREFIX_NODE *child, int k) {
+      auto mid = std::make_unique<PREFIX_NODE>();
+      mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+      mid->parent = parent;
+      mid->depth = child->depth - (int)child->edge.size() + k;
+      std::unique_ptr<PREFIX_NODE> owned = std::move(parent->children[child->edge[0]]);
+      child->edge.erase(child->edge.begin(), child->edge.begin() + k);
+      child->parent = mid.get();
+      mid->children[child->edge[0]] = std::move(owned);
+      PREFIX_NODE *result = mid.get();
+      parent->children[result->edge[0]] = std::move(mid);
+      return result;
+    }
+
+    void collect(PREFIX_NODE *node, std::vector<PREFIX_NODE*> &nodes) {
+      if (node->has_state) {
+        nodes.push_back(node);
+      }
+      for (const auto &kv : node->children) {
+        collect(kv.second.get(), nodes);
+      }
+    }
+
+    void drop_subtree(PREFIX_NODE *node) {
+      std::vector<PREFIX_NODE*> nodes;
+      collect(node, nodes);
+      for (auto n : nodes) {
+        total_bytes -= n->nbytes;
+      }
+    }
+
+    // removes stateless leaves up to the root
+    void prune(PREFIX_NODE *node) {
+      while ((node->parent) && (!node->has_state) && (node->children.empty())) {
+        PREFIX_NODE *parent = node->parent;
+        parent->children.erase(node->edge[0]);
+        node = parent;
+      }
+    }
+
+    void evict() {
+      if (total_bytes <= budget) {
+        num_entries = count_entries();
+        return;
+      }
+      std::vector<PREFIX_NODE*> nodes;
+      for (const auto &kv : roots) {
+        collect(kv.second.node.get(), nodes);
+      }
+      std::sort(nodes.begin(), nodes.end(), [](const PREFIX_NODE *a, const PREFIX_NODE *b) {
+        return a->last_used < b->last_used;
+      });
+      for (auto node : nodes) {
+        if (total_bytes <= budget) {
+          break;
+        }
+        total_bytes -= node->nbytes;
+        node->has_state = false;
+        node->state = torch::jit::IValue();
+        node->nbytes = 0;
+        num_evictions++;
+        prune(node);
+      }
+      num_entries = count_entries();
+    }
+
+    int count_entries() {
+      std::vector<PREFIX_NODE*> nodes;
+      for (const auto &kv : roots) {
+        collect(kv.second.node.get(), nodes);
+      }
+      return (int)nodes.size();
+    }
+
+    std::mutex mtx;
+    std::map<const ModelMeta*,ROOT> roots;
+    size_t budget = (size_t)256 << 20;
+    size_t total_bytes = 0;
+    int num_entries = 0;
+    uint64_t clock = 0;
+    uint64_t num_lookups = 0;
+    uint64_t num_hits = 0;
+    uint64_t num_reused_tokens = 0;
+    uint64_t num_prompt_tokens = 0;
+    uint64_t num_evictions = 0;
+  };
+
+}
@@ -9,11 +9,19 @@
 #include <vector>
 #include <array>
 #include <set>
+#include <map>
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <filesystem>
 
 #include "../enum/model_type.h"
 #include "../../common/data_structures/verbosity.h"
 #include "control.h"
 #include "callback_base.h"
+#include "sampler.h"
+#include "session.h"
+#include "prefix_cache.h"
 
 namespace sampling {
 
@@ -42,17 +50,214 @@ namespace sampling {
     }
   }
 
-  std::unique_ptr<ModelMeta> load_model(midi::HyperParam *param) {
-    auto model = std::make_unique<ModelMeta>();
-    load_checkpoint(param->ckpt(), model);
+  // process-wide cache of loaded checkpoints so that repeated calls to sample()
+  // do not re-run torch::jit::load. entries are keyed by path and invalidated
+  // when the modification time of the checkpoint changes. the least recently
+  // used model is evicted once the capacity is exceeded.
+  class MODEL_CACHE {
+  public:
+    static MODEL_CACHE& instance() {
+      static MODEL_CACHE cache;
+      return cache;
+    }
+
+    std::shared_ptr<ModelMeta> get(const std::string &ckpt_path) {
+      std::filesystem::file_time_type mtime = get_mtime(ckpt_path);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(ckpt_path);
+        if ((it != entries.end()) && (it->second.mtime == mtime)) {
+          hits++;
+          lru.splice(lru.begin(), lru, it->second.lru_it);
+          return it->second.model;
+        }
+        misses++;
+      }
+
+      // load outside of the lock so other checkpoints can still be served
+      auto start = std::chrono::steady_clock::now();
+      auto loaded = std::make_unique<ModelMeta>();
+      load_checkpoint(ckpt_path, loaded);
+      loaded->meta.set_num_heads(8);
+      loaded->meta.set_num_layers(NUM_LAYERS);
+      std::shared_ptr<ModelMeta> model(std::move(loaded));
+      double elapsed = std::chrono::duration<double,std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+
+      std::lock_guard<std::mutex> lock(mtx);
+      load_time_ms += elapsed;
+      num_loads++;
+      auto it = entries.find(ckpt_path);
+      if (it != entries.end()) {
+        if (it->second.mtime == mtime) {
+          // another thread loaded the same checkpoint concurrently
+          lru.splice(lru.begin(), lru, it->second.lru_it);
+          return it->second.model;
+        }
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+      }
+      lru.push_front(ckpt_path);
+      entries[ckpt_path] = {mtime, model, lru.begin()};
+      evict();
+      return model;
+    }
+
+    void warm(const std::string &ckpt_path) {
+      get(ckpt_path);
+    }
+
+    bool unload(const std::string &ckpt_path) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto it = entries.find(ckpt_path);
+      if (it == entries.end()) {
+        return false;
+      }
+      lru.erase(it->second.lru_it);
+      entries.erase(it);
+      return true;
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(mtx);
+      entries.clear();
+      lru.clear();
+    }
+
+    void set_capacity(int n) {
+      if (n < 1) {
+        throw std::runtime_error("MODEL CACHE CAPACITY MUST BE AT LEAST 1");
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      capacity = n;
+      evict();
+    }
+
+    std::map<std::string,double> stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return {
+        {"hits", (double)hits},
+        {"misses", (double)misses},
+        {"evictions", (double)evictions},
+        {"loads", (double)num_loads},
+        {"load_time_ms", load_time_ms},
+        {"size", (double)entries.size()},
+        {"capacity", (double)capacity}
+      };
+    }
+
+    void reset_stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      hits = 0;
+      misses = 0;
+      evictions = 0;
+      num_loads = 0;
+      load_time_ms = 0;
+    }
+
+  private:
+    struct ENTRY {
+      std::filesystem::file_time_type mtime;
+      std::shared_ptr<ModelMeta> model;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    MODEL_CACHE() {}
+
+    static std::filesystem::file_time_type get_mtime(const std::string &ckpt_path) {
+      std::error_code ec;
+      auto mtime = std::filesystem::last_write_time(ckpt_path, ec);
+      if (ec) {
+        throw std::runtime_error("ERROR LOADING MODEL : CHECKPOINT NOT FOUND " + ckpt_path);
+      }
+      return mtime;
+    }
+
+    // models still referenced by a running generation stay alive through
+    // their shared_ptr, so eviction only drops the cache's reference
+    void evict() {
+      while ((int)entries.size() > capacity) {
+        entries.erase(lru.back());
+        lru.pop_back();
+        evictions++;
+      }
+    }
+
+    std::mutex mtx;
+    std::map<std::string,ENTRY> entries;
+    std::list<std::string> lru;
+    int capacity = 2;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t num_loads = 0;
+    double load_time_ms = 0;
+  };
+
+  std::shared_ptr<ModelMeta> load_model(midi::HyperParam *param) {
+    std::shared_ptr<ModelMeta> model = MODEL_CACHE::instance().get(param->ckpt());
     if (model->meta.model_dim() != -1) {
       param->set_model_dim(model->meta.model_dim());
     }
+    return model;
+  }
 
-    model->meta.set_num_heads(8);
-    model->meta.set_num_layers(6);
+  // computes the grammar mask for a single sequence and samples the next
+  // token from its logits. when mask_top_k triggers, the most likely allowed
+  // token is excluded
+  int sample_next_token(SAMPLE_CONTROL *sc, std::vector<int> &seq, const float *logits, int n, midi::HyperParam *param) {
+    TOKEN_MASK mask = sc->get_mask( seq );
+    if (data_structures::GLOBAL_VERBOSITY_LEVEL >= data_structures::VERBOSITY_LEVEL_VERBOSE) {
+      std::vector<int> unpacked = mask.to_vector();
+      sc->rep->show_mask_token_types(unpacked);
+      std::set<std::string> unmasked_types;
+      for (int j=0; j<(int)unpacked.size(); j++) {
+        if (unpacked[j]) {
+          unmasked_types.insert(sc->enc->rep->pretty_type(j));
+        }
+      }
+      for (const auto &strr : unmasked_types) {
+        data_structures::LOGGER(data_structures::to_str("NOT MASKED: ", strr));
+      }
+    }
 
-    return model;
+    bool apply_mask = (!sc->finished) && (!param->internal_disable_masking());
+    const TOKEN_MASK *mask_ptr = apply_mask ? &mask : NULL;
+
+    int exclude = -1;
+    if (param->mask_top_k() > 0) {
+      // optionally mask the top token
+      bool can_mask = false;
+      std::vector<midi::TOKEN_TYPE> token_types_to_mask = {midi::TOKEN_NOTE_ONSET, midi::TOKEN_TIME_ABSOLUTE_POS, midi::TOKEN_NOTE_DURATION};
+      for (const auto &t : token_types_to_mask) {
+        if (mask.any(sc->rep->type_tokens[t])) {
+          can_mask = true;
+          break;
+        }
+      }
+      if ((can_mask) && (random_on_unit(&sc->engine) < param->mask_top_k())) {
+        exclude = masked_argmax(logits, n, mask_ptr);
+      }
+    }
+
+    return sample_logits(logits, n, mask_ptr, param->temperature(), &sc->engine, exclude);
+  }
+
+  // adds the sampled token to an unfinished sequence and notifies callbacks
+  void append_token(SAMPLE_CONTROL *sc, std::vector<int> &seq, int next_token, const float *logits, int n, CallbackManager *callbacks) {
+    if (sc->finished) {
+      return;
+    }
+    data_structures::LOGGER(data_structures::to_str("SAMPLED :: ", sc->enc->rep->pretty(next_token)));
+    seq.push_back( next_token );
+
+    if (callbacks) {
+      if ((sc->enc->rep->is_token_type(next_token, midi::TOKEN_BAR_END)) || (sc->enc->rep->is_token_type(next_token, midi::TOKEN_FILL_IN_END))) {
+        callbacks->on_bar_end();
+      }
+      std::vector<float> logits_copy(logits, logits + n); // unmasked
+      callbacks->on_prediction(logits_copy, next_token);
+    }
   }
 
   void sample_inner(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vector<std::vector<int>> &seqs, torch::jit::Module *model, std::vector<torch::jit::IValue> &inputs, midi::HyperParam *param, CallbackManager *callbacks) {
@@ -70,93 +275,24 @@ namespace sampling {
     past_key_values = outputs->elements()[1];
 
 
-    // get logits for first in batch
-    std::vector<std::vector<int>> masks_copy;
-    std::vector<std::vector<float>> logits_copy;
-    for (int i=0; i<(int)seqs.size(); i++) {
-      logits_copy.push_back(std::vector<float>(logits[i].data_ptr<float>(), logits[i].data_ptr<float>() + logits[i].numel()));
-    }
+    logits = logits.to(torch::kFloat32).contiguous();
+    int vocab_size = logits.size(1);
+    const float *data = logits.data_ptr<float>();
 
-    // set masks
-    std::vector<std::set<midi::TOKEN_TYPE>> masked_tts;
-    int num_masked = 0;
+    std::vector<int64_t> next_tokens(seqs.size());
     for (int i=0; i<(int)seqs.size(); i++) {
-      std::vector<std::string> unmasked_types;
-      std::vector<int> mask = scon[i]->get_mask( seqs[i] );
-      masks_copy.push_back( mask );
-      masked_tts.push_back( scon[i]->rep->get_mask_token_types(mask) );
-      scon[i]->rep->show_mask_token_types(mask);
-      if ((!scon[i]->finished) && (!param->internal_disable_masking())) {
-        for (int j=0; j<(int)mask.size(); j++) {
-          if (mask[j] == 0) {
-            logits[i][j] = -1 * std::numeric_limits<float>::max(); // set this to a very small possibility
-            num_masked++;
-          } else {
-            unmasked_types.push_back(scon[i]->enc->rep->pretty_type(j));
-          }
-        }
-      }
-      std::set<std::string> s( unmasked_types.begin(), unmasked_types.end() );
-      unmasked_types.assign( s.begin(), s.end() );
-      for (auto strr : unmasked_types) {
-        std::cout << "NOT MASKED: " << strr << std::endl;
-      }
-
-      if (param->mask_top_k() > 0) {
-
-        std::mt19937 engine(time(NULL));
-
-        // optionally mask the top k tokens
-        bool can_mask = false;
-        std::vector<midi::TOKEN_TYPE> token_types_to_mask = {midi::TOKEN_NOTE_ONSET, midi::TOKEN_TIME_ABSOLUTE_POS, midi::TOKEN_NOTE_DURATION};
-        for (const auto &t : token_types_to_mask) {
-          if (masked_tts[i].count(t) > 0) {
-            can_mask = true;
-            break;
-          }
-        }
-        if ((can_mask) && (random_on_unit(&engine) < param->mask_top_k())) {
-          std::vector<int> V(mask.size());
-          std::iota(V.begin(),V.end(),0);
-          std::sort( V.begin(),V.end(), [&](int ii,int jj){ return (logits[i][ii] > logits[i][jj]).item<int64_t>(); });
-
-          for (int j=0; j<10; j++) {
-            if (j==0) {
-              logits[i][V[j]] = -1 * std::numeric_limits<float>::max();
-              num_masked++;
-            }
-          }
-        }
-      }
+      const float *row = data + (int64_t)i * vocab_size;
+      next_tokens[i] = sample_next_token(scon[i].get(), seqs[i], row, vocab_size, param);
     }
 
-    if (param->sampling_seed() != -1) {
-      torch::manual_seed(param->sampling_seed());
-    }
-
-    float temperature = param->temperature();
-    auto probs = (logits / temperature).softmax(1);
-    auto next_tokens = probs.multinomial(1);
-
     inputs.clear();
-    inputs.push_back( next_tokens );
+    inputs.push_back( torch::tensor(next_tokens, torch::TensorOptions().dtype(torch::kInt64)).view({-1, 1}) );
     inputs.push_back( past_key_values );
     
     // add next token to the sequences
     for (int i=0; i<(int)seqs.size(); i++) {
-      if (!scon[i]->finished) {      
-        int next_token = next_tokens[i][0].item<int64_t>();
-        data_structures::LOGGER(data_structures::to_str("SAMPLED :: ", scon[i]->enc->rep->pretty(next_token)));
-        seqs[i].push_back( next_token );
-
-
-        if (callbacks) {
-          if ((scon[i]->enc->rep->is_token_type(next_token, midi::TOKEN_BAR_END)) || (scon[i]->enc->rep->is_token_type(next_token, midi::TOKEN_FILL_IN_END))) {
-            callbacks->on_bar_end();
-          }
-          callbacks->on_prediction(logits_copy[i], next_token);
-        }
-      }
+      const float *row = data + (int64_t)i * vocab_size;
+      append_token(scon[i].get(), seqs[i], next_tokens[i], row, vocab_size, callbacks);
     }
   }
 
@@ -171,10 +307,7 @@ namespace sampling {
     }
   }
 
-  std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi::HyperParam *param, const std::unique_ptr<ModelMeta> &mm, CallbackManager *callbacks) {
-    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_DEBUG, "generate");
-    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, util_protobuf::protobuf_to_string(status));
-    param->set_temperature( std::max((double)param->temperature(), 1e-6) ); // CAN'T HAVE ZERO TEMPERATURE
+  std::vector<std::unique_ptr<SAMPLE_CONTROL>> make_controls(midi::Status *status, midi::Piece *piece, midi::HyperParam *param, const std::shared_ptr<ModelMeta> &mm) {
     std::vector<std::unique_ptr<SAMPLE_CONTROL>> scon;
     for (int i=0; i<param->batch_size(); i++) {
       scon.push_back( std::make_unique<SAMPLE_CONTROL>(piece, status, param, &mm->meta) );
@@ -183,24 +316,62 @@ namespace sampling {
       data_structures::LOGGER("REG GRAPH" );
       sc->rg->graph.print_graphviz();
     }
+    return scon;
+  }
+
+  std::vector<midi::Piece> decode_generation(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vector<std::vector<int>> &seqs, midi::Status *status, midi::HyperParam *param, bool terminated) {
+    scon[0]->rep->show(seqs[0]);
+    std::vector<midi::Piece> output(param->batch_size());
+    if (!terminated) {
+      scon[0]->enc->tokens_to_json_array(seqs, output, scon[0]->enc_state);
+      for (int i=0; i<(int)output.size(); i++) {
+        scon[i]->finalize(&output[i]);
+      }
+    }
+    return output;
+  }
+
+  std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi::HyperParam *param, const std::shared_ptr<ModelMeta> &mm, CallbackManager *callbacks, InferenceSession *session=NULL) {
+    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_DEBUG, "generate");
+    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_TRACE, util_protobuf::protobuf_to_string(status));
+    param->set_temperature( std::max((double)param->temperature(), 1e-6) ); // CAN'T HAVE ZERO TEMPERATURE
+    std::vector<std::unique_ptr<SAMPLE_CONTROL>> scon = make_controls(status, piece, param, mm);
     std::vector<int> prompt = scon[0]->prompt;
     std::vector<torch::jit::IValue> inputs;
     std::vector<std::vector<int>> seqs = std::vector<std::vector<int>>(param->batch_size(), prompt);
     scon[0]->rep->show(prompt);
 
-    auto opts = torch::TensorOptions().dtype(torch::kInt64);
-    torch::Tensor x = torch::zeros({param->batch_size(), (int)prompt.size()}, opts);
-    for (int k=0; k<param->batch_size(); k++) {
-      for (int i=0; i<(int)prompt.size(); i++) {
-        x[k][i] = prompt[i];
-      }
+    // the session cache only holds a single sequence
+    if ((session) && (param->batch_size() != 1)) {
+      session = NULL;
     }
-    inputs.push_back( x );
-    std::vector<torch::jit::IValue> state;
-    if ((param) && (mm->meta.new_state())) {
-        make_state(&state, param->batch_size(), &mm->meta);
+    int reused = 0;
+    if (session) {
+      reused = session->prepare(prompt, mm, inputs);
+      data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_DEBUG, data_structures::to_str("SESSION REUSED ", reused, " OF ", prompt.size(), " PROMPT TOKENS"));
+    }
+    if ((reused == 0) && (session)) {
+      session->record_miss(prompt);
+    }
+    if ((reused == 0) && (param->batch_size() == 1)) {
+      reused = PREFIX_CACHE::instance().prepare(prompt, mm, inputs);
+      data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_DEBUG, data_structures::to_str("PREFIX CACHE RESTORED ", reused, " OF ", prompt.size(), " PROMPT TOKENS"));
+    }
+    if (reused == 0) {
+      auto opts = torch::TensorOptions().dtype(torch::kInt64);
+      torch::Tensor x = torch::zeros({param->batch_size(), (int)prompt.size()}, opts);
+      for (int k=0; k<param->batch_size(); k++) {
+        for (int i=0; i<(int)prompt.size(); i++) {
+          x[k][i] = prompt[i];
+        }
+      }
+      inputs.push_back( x );
+      std::vector<torch::jit::IValue> state;
+      if ((param) && (mm->meta.new_state())) {
+          make_state(&state, param->batch_size(), &mm->meta);
+      }
+      inputs.push_back(torch::ivalue::Tuple::create(state));
     }
-    inputs.push_back(torch::ivalue::Tuple::create(state));
 
 
     bool terminated = false;
@@ -217,14 +388,17 @@ namespace sampling {
         break;
       }
     }
-    scon[0]->enc->config->decode_final = status->decode_final();
-    scon[0]->rep->show(seqs[0]);
-    std::vector<midi::Piece> output(param->batch_size());
-    if (!terminated) {
-      scon[0]->enc->tokens_to_json_array(seqs, output);
-      scon[0]->finalize(&output[0]); // batch size should be 1 anyways
+    if (session) {
+      if (terminated) {
+        session->reset();
+      } else {
+        session->store(seqs[0], inputs[1], mm);
+      }
     }
-    return output;
+    if ((!terminated) && (param->batch_size() == 1)) {
+      PREFIX_CACHE::instance().insert(seqs[0], inputs[1], mm);
+    }
+    return decode_generation(scon, seqs, status, param, terminated);
   }
 
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace sampling {
+
+  // A set of allowed tokens packed into 64-bit words (bit i set = token i
+  // allowed). SAMPLE_CONTROL builds the grammar mask in this form from the
+  // bitsets of the mask automaton and hands it to the sampler as is.
+  class TOKEN_MASK {
+  public:
+    TOKEN_MASK() {}
+    TOKEN_MASK(int n) : n(n), bits((n + 63) / 64, 0) {}
+    TOKEN_MASK(const std::vector<int> &mask) : TOKEN_MASK((int)mask.size()) {
+      for (int i=0; i<n; i++) {
+        bits[i >> 6] |= (uint64_t)(mask[i] != 0) << (i & 63);
+      }
+    }
+
+    int size() const {
+      return n;
+    }
+    int num_words() const {
+      return bits.size();
+    }
+    const uint64_t *data() const {
+      return bits.data();
+    }
+
+    bool test(int i) const {
+      return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+    void set(int i) {
+      bits[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    void reset(int i) {
+      bits[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+    void reset(const std::vector<int> &tokens) {
+      for (const auto &i : tokens) {
+        reset(i);
+      }
+    }
+    void reset() {
+      std::fill(bits.begin(), bits.end(), 0);
+    }
+
+    // adds the tokens of num_words() packed words
+    void merge(const uint64_t *words) {
+      for (size_t w=0; w<bits.size(); w++) {
+        bits[w] |= words[w];
+      }
+    }
+    void merge(const TOKEN_MASK &other) {
+      merge(other.data());
+    }
+    void intersect(const TOKEN_MASK &other) {
+      for (size_t w=0; w<bits.size(); w++) {
+        bits[w] &= other.bits[w];
+      }
+    }
+
+    bool any() const {
+      for (const auto &word : bits) {
+        if (word) {
+          return true;
+        }
+      }
+      return false;
+    }
+    bool any(const std::vector<int> &tokens) const {
+      for (const auto &i : tokens) {
+        if (test(i)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::vector<int> to_vector() const {
+      std::vector<int> mask(n, 0);
+      for (int i=0; i<n; i++) {
+        mask[i] = test(i);
+      }
+      return mask;
+    }
+
+  private:
+    int n = 0;
+    std::vector<uint64_t> bits;
+  };
+
+  // tokens beyond the end of the mask are allowed, as are all tokens when
+  // mask is NULL
+  inline bool is_allowed(const TOKEN_MASK *mask, int i) {
+    return (!mask) || (i >= mask->size()) || (mask->test(i));
+  }
+
+  // index of the largest allowed logit
+  int masked_argmax(const float *logits, int n, const TOKEN_MASK *mask) {
+    int best = -1;
+    float best_value = -std::numeric_limits<float>::infinity();
+    for (int i=0; i<n; i++) {
+      if ((is_allowed(mask, i)) && ((best == -1) || (logits[i] > best_value))) {
+        best = i;
+        best_value = logits[i];
+      }
+    }
+    return best;
+  }
+
+  // number of values processed together by the passes of sample_logits. they
+  // keep one partial max or sum per lane, so the compiler can vectorize them
+  // without reordering floating point operations
+  const int SAMPLER_LANES = 8;
+
+  // 0 for the allowed tokens of a mask byte, -inf for the masked ones
+  class MASK_BYTE_TABLE {
+  public:
+    MASK_BYTE_TABLE() {
+      for (int b=0; b<256; b++) {
+        for (int j=0; j<8; j++) {
+          values[b][j] = ((b >> j) & 1) ? 0.f : -std::numeric_limits<float>::infinity();
+        }
+      }
+    }
+    const float *get(uint64_t byte) const {
+      return values[byte];
+    }
+  private:
+    float values[256][8];
+  };
+
+  // exp(x) for x <= 0 without calls or branches, so that it is vectorized
+  // with the loop around it. range reduction and polynomial of cephes expf
+  // (relative error about 1e-7). below -87 (and for -inf) it returns 0. the
+  // selections are bit masks, a float compare in a ?: keeps gcc from
+  // vectorizing the loop
+  inline float exp_nonpositive(float x) {
+    uint32_t in_range = -(uint32_t)(x >= -87.f);
+    float y = std::bit_cast<float>((std::bit_cast<uint32_t>(x) & in_range) | (std::bit_cast<uint32_t>(-87.f) & ~in_range));
+    int k = (int)(y * 1.44269504f - .5f); // round(y / ln 2) for y <= 0
+    float fk = (float)k;
+    float r = y - fk * .693359375f + fk * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.f;
+    float scale = std::bit_cast<float>((uint32_t)(k + 127) << 23);
+    return std::bit_cast<float>(std::bit_cast<uint32_t>(p * scale) & in_range);
+  }
+
+  // out[i] = logits[i] / temperature, or -inf for masked tokens. whole bytes
+  // of the mask add 0 or -inf from MASK_BYTE_TABLE. out is padded with -inf
+  // up to a multiple of SAMPLER_LANES
+  void scale_masked_logits(const float *__restrict logits, int n, const TOKEN_MASK *mask, float inv_t, float *__restrict out) {
+    static const MASK_BYTE_TABLE table;
+    const float neg_inf = -std::numeric_limits<float>::infinity();
+    int i = 0;
+    if (mask) {
+      const uint64_t *words = mask->data();
+      int masked = std::min(n, mask->size()) / 8 * 8;
+      for (; i<masked; i+=8) {
+        const float *__restrict penalty = table.get((words[i >> 6] >> (i & 63)) & 0xff);
+        for (int j=0; j<8; j++) {
+          out[i+j] = logits[i+j] * inv_t + penalty[j];
+        }
+      }
+    }
+    for (; i<n; i++) {
+      out[i] = is_allowed(mask, i) ? logits[i] * inv_t : neg_inf;
+    }
+    for (; i % SAMPLER_LANES; i++) {
+      out[i] = neg_inf;
+    }
+  }
+
+  float lanes_max(const float *__restrict w, int padded) {
+    float lane_max[SAMPLER_LANES];
+    std::fill(lane_max, lane_max + SAMPLER_LANES, -std::numeric_limits<float>::infinity());
+    for (int i=0; i<padded; i+=SAMPLER_LANES) {
+      for (int j=0; j<SAMPLER_LANES; j++) {
+        lane_max[j] = (w[i+j] > lane_max[j]) ? w[i+j] : lane_max[j];
+      }
+    }
+    return *std::max_element(lane_max, lane_max + SAMPLER_LANES);
+  }
+
+  // replaces w[i] by exp(w[i] - max_value) and returns the sum
+  float exp_and_sum(float *__restrict w, int padded, float max_value) {
+    float lane_sum[SAMPLER_LANES] = {0};
+    for (int i=0; i<padded; i+=SAMPLER_LANES) {
+      for (int j=0; j<SAMPLER_LANES; j++) {
+        w[i+j] = exp_nonpositive(w[i+j] - max_value);
+        lane_sum[j] += w[i+j];
+      }
+    }
+    float sum = 0;
+    for (int j=0; j<SAMPLER_LANES; j++) {
+      sum += lane_sum[j];
+    }
+    return sum;
+  }
+
+  // Fused masking, temperature, softmax and multinomial sampling over a raw
+  // logits buffer. Masked tokens (and exclude, if >= 0) get zero probability.
+  // It replaces the tensor operations of the old sampler with passes over a
+  // thread-local buffer. The masking, max and exp passes are written so that
+  // gcc vectorizes them at -O2 without fast-math. The only source of
+  // randomness is engine, so a seeded engine makes sampling fully
+  // deterministic.
+  //
+  // If every token is masked (or excluded) the token is drawn uniformly from
+  // the whole vocabulary. This is what the old sampler did : it set masked
+  // logits to -max, so the softmax of an all masked row was uniform.
+  int sample_logits(const float *logits, int n, const TOKEN_MASK *mask, float temperature, std::mt19937 *engine, int exclude=-1) {
+    static thread_local std::vector<float> w;
+    int padded = (n + SAMPLER_LANES - 1) / SAMPLER_LANES * SAMPLER_LANES;
+    w.resize(padded);
+    scale_masked_logits(logits, n, mask, 1.f / temperature, w.data());
+    if ((exclude >= 0) && (exclude < n)) {
+      w[exclude] = -std::numeric_limits<float>::infinity();
+    }
+
+    float max_value = lanes_max(w.data(), padded);
+    if (max_value == -std::numeric_limits<float>::infinity()) {
+      return std::uniform_int_distribution<int>(0, n - 1)(*engine);
+    }
+    float sum = exp_and_sum(w.data(), padded, max_value);
+
+    float u = std::uniform_real_distribution<float>(0, sum)(*engine);
+    float acc = 0;
+    int last = 0;
+    for (int i=0; i<n; i++) {
+      if (w[i] > 0) {
+        acc += w[i];
+        last = i;
+        if (u < acc) {
+          return i;
+        }
+      }
+    }
+    return last; // rounding
+  }
+
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <torch/script.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "sample_internal.h"
+
+namespace sampling {
+
+  // a single sequence submitted to the scheduler. the caller owns scon and seq
+  // and blocks until the sequence is finished.
+  struct BATCH_REQUEST {
+    SAMPLE_CONTROL *scon;
+    std::vector<int> *seq;
+    midi::HyperParam param;
+    CallbackManager *callbacks;
+    std::shared_ptr<ModelMeta> model;
+    int num_steps = 0;
+    std::promise<bool> done;
+  };
+
+  // sequences that are decoded in the same forward pass. the TorchScript
+  // model takes no attention mask, so only sequences whose prompts have the
+  // same length can share a batch.
+  struct BATCH_COHORT {
+    std::shared_ptr<ModelMeta> model;
+    std::vector<std::unique_ptr<BATCH_REQUEST>> rows;
+    std::vector<torch::jit::IValue> inputs;
+  };
+
+  // Batching of independent generation requests. Requests are bucketed by
+  // model and prompt length. The first request of a bucket opens a cohort
+  // and waits up to max_wait_ms for requests of the same bucket, which join
+  // it until it holds max_batch_size sequences. The cohort is then decoded
+  // on the thread of the request that opened it, and finished sequences are
+  // removed between decoding steps.
+  //
+  // Because the model takes no attention mask or position offset, caches of
+  // different lengths can not be padded into one batch, and a cohort grows
+  // by one token per step. So requests only share forward passes when they
+  // arrive within max_wait_ms of each other with prompts of the same length
+  // (for example the attempts of one call, or concurrent calls on the same
+  // piece and status). Other requests run their own cohort concurrently on
+  // their own thread, as they would without batching. stats() reports the
+  // fraction of calls that joined a cohort opened by another call
+  // (merge_rate) to measure how much batching happens.
+  class BATCH_SCHEDULER {
+  public:
+    static BATCH_SCHEDULER& instance() {
+      static BATCH_SCHEDULER scheduler;
+      return scheduler;
+    }
+
+    void configure(bool enable, int max_batch, int max_wait) {
+      if (max_batch < 1) {
+        throw std::runtime_error("MAX BATCH SIZE MUST BE AT LEAST 1");
+      }
+      if (max_wait < 0) {
+        throw std::runtime_error("MAX WAIT MUST BE AT LEAST 0");
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      enabled_flag = enable;
+      max_batch_size = max_batch;
+      max_wait_ms = max_wait;
+    }
+
+    bool enabled() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return enabled_flag;
+    }
+
+    int get_max_batch_size() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return max_batch_size;
+    }
+
+    // decodes every seqs[k] with scon[k] until it is finished. the sequences
+    // must have the same length. returns true if generation was terminated
+    // early (max_steps or cancellation)
+    bool decode(const std::vector<SAMPLE_CONTROL*> &scon, const std::vector<std::vector<int>*> &seqs, midi::HyperParam *param, const std::shared_ptr<ModelMeta> &mm, CallbackManager *callbacks) {
+      std::vector<std::unique_ptr<BATCH_REQUEST>> reqs;
+      std::vector<std::future<bool>> results;
+      for (size_t k=0; k<seqs.size(); k++) {
+        auto req = std::make_unique<BATCH_REQUEST>();
+        req->scon = scon[k];
+        req->seq = seqs[k];
+        req->param.CopyFrom(*param);
+        req->callbacks = callbacks;
+        req->model = mm;
+        results.push_back(req->done.get_future());
+        reqs.push_back(std::move(req));
+      }
+      if (reqs.size() == 0) {
+        return false;
+      }
+
+      auto key = std::make_tuple(mm.get(), (int)seqs[0]->size());
+      std::unique_ptr<BATCH_COHORT> cohort;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        num_calls++;
+        num_active += reqs.size();
+        auto it = open.find(key);
+        if ((it != open.end()) && ((int)(it->second->rows.size() + reqs.size()) <= max_batch_size)) {
+          // join the cohort, its thread decodes the sequences
+          for (auto &req : reqs) {
+            it->second->rows.push_back(std::move(req));
+          }
+          num_merges++;
+          lock.unlock();
+          cv.notify_all();
+        }
+        else {
+          cohort = std::make_unique<BATCH_COHORT>();
+          cohort->model = mm;
+          cohort->rows = std::move(reqs);
+          BATCH_COHORT *c = cohort.get();
+          open[key] = c;
+          num_cohorts++;
+          auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(max_wait_ms);
+          cv.wait_until(lock, deadline, [&]{ return (int)c->rows.size() >= max_batch_size; });
+          it = open.find(key);
+          if ((it != open.end()) && (it->second == c)) {
+            open.erase(it);
+          }
+        }
+      }
+
+      if (cohort) {
+        try {
+          prefill(cohort.get());
+        }
+        catch (...) {
+          fail(cohort.get());
+        }
+        while (cohort->rows.size() > 0) {
+          step(cohort.get());
+        }
+      }
+
+      // every row references seq and scon, so wait for all before rethrowing
+      for (auto &r : results) {
+        r.wait();
+      }
+      bool terminated = false;
+      for (auto &r : results) {
+        terminated |= r.get();
+      }
+      return terminated;
+    }
+
+    std::map<std::string,double> stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return {
+        {"forwards", (double)num_forwards},
+        {"rows", (double)num_rows},
+        {"mean_batch_size", num_forwards ? (double)num_rows / num_forwards : 0.},
+        {"completed", (double)num_completed},
+        {"calls", (double)num_calls},
+        {"merges", (double)num_merges},
+        {"cohorts", (double)num_cohorts},
+        {"merge_rate", num_calls ? (double)num_merges / num_calls : 0.},
+        {"active", (double)num_active},
+        {"max_batch_size", (double)max_batch_size},
+        {"max_wait_ms", (double)max_wait_ms}
+      };
+    }
+
+  private:
+    BATCH_SCHEDULER() {}
+
+    // inputs of the first forward, the prompts of every row
+    void prefill(BATCH_COHORT *c) {
+      int bs = c->rows.size();
+      int n = c->rows[0]->seq->size();
+      auto opts = torch::TensorOptions().dtype(torch::kInt64);
+      torch::Tensor x = torch::empty({bs, n}, opts);
+      int64_t *data = x.data_ptr<int64_t>();
+      for (int k=0; k<bs; k++) {
+        std::copy(c->rows[k]->seq->begin(), c->rows[k]->seq->end(), data + (int64_t)k * n);
+      }
+      c->inputs.push_back( x );
+      std::vector<torch::jit::IValue> state;
+      if (c->model->meta.new_state()) {
+        make_state(&state, bs, &c->model->meta);
+      }
+      c->inputs.push_back( torch::ivalue::Tuple::create(state) );
+    }
+
+    // runs one decoding step for a cohort and retires finished sequences
+    void step(BATCH_COHORT *c) {
+      int bs = c->rows.size();
+      try {
+        auto outputs = c->model->model.forward(c->inputs).toTuple();
+        torch::Tensor logits = outputs->elements()[0].toTensor().index(
+          {torch::indexing::Slice(),-1,torch::indexing::Slice()}).to(torch::kFloat32).contiguous();
+        int vocab_size = logits.size(1);
+        const float *data = logits.data_ptr<float>();
+        torch::jit::IValue past = outputs->elements()[1];
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          num_forwards++;
+          num_rows += bs;
+        }
+
+        std::vector<int64_t> next_tokens(bs);
+        std::vector<int64_t> keep;
+        for (int i=0; i<bs; i++) {
+          BATCH_REQUEST *req = c->rows[i].get();
+          const float *row = data + (int64_t)i * vocab_size;
+          next_tokens[i] = sample_next_token(req->scon, *req->seq, row, vocab_size, &req->param);
+          append_token(req->scon, *req->seq, next_tokens[i], row, vocab_size, req->callbacks);
+          req->num_steps++;
+          bool terminated = ((req->param.max_steps() > 0) && (req->num_steps >= req->param.max_steps())) || ((req->callbacks) && (req->callbacks->is_cancelled()));
+          if ((terminated) || (req->scon->finished)) {
+            req->done.set_value(terminated);
+            std::lock_guard<std::mutex> lock(mtx);
+            num_completed++;
+            num_active--;
+          } else {
+            keep.push_back(i);
+          }
+        }
+
+        auto opts = torch::TensorOptions().dtype(torch::kInt64);
+        torch::Tensor next = torch::tensor(next_tokens, opts).view({bs, 1});
+        if ((int)keep.size() < bs) {
+          torch::Tensor index = torch::tensor(keep, opts);
+          next = next.index_select(0, index);
+          past = select_rows(past, index);
+          std::vector<std::unique_ptr<BATCH_REQUEST>> rows;
+          for (auto i : keep) {
+            rows.push_back(std::move(c->rows[i]));
+          }
+          c->rows = std::move(rows);
+        }
+        c->inputs.clear();
+        c->inputs.push_back( next );
+        c->inputs.push_back( past );
+      }
+      catch (...) {
+        fail(c);
+      }
+    }
+
+    // passes the current exception to every unfinished row of the cohort
+    void fail(BATCH_COHORT *c) {
+      int failed = 0;
+      for (auto &req : c->rows) {
+        if (req) {
+          try {
+            req->done.set_exception(std::current_exception());
+            failed++;
+          }
+          catch (const std::future_error &) {} // already finished
+        }
+      }
+      c->rows.clear();
+      std::lock_guard<std::mutex> lock(mtx);
+      num_active -= failed;
+    }
+
+    static torch::jit::IValue select_rows(const torch::jit::IValue &state, const torch::Tensor &index) {
+      std::vector<torch::jit::IValue> layers;
+      for (const auto &layer : state.toTuple()->elements()) {
+        std::vector<torch::jit::IValue> kv;
+        for (const auto &t : layer.toTuple()->elements()) {
+          kv.push_back( t.toTensor().index_select(0, index) );
+        }
+        layers.push_back( torch::ivalue::Tuple::create(kv) );
+      }
+      return torch::ivalue::Tuple::create(layers);
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool enabled_flag = false;
+    int max_batch_size = 8;
+    int max_wait_ms = 5;
+    std::map<std::tuple<ModelMeta*,int>,BATCH_COHORT*> open; // cohorts still admitting requests
+    uint64_t num_forwards = 0;
+    uint64_t num_rows = 0;
+    uint64_t num_completed = 0;
+    uint64_t num_calls = 0;
+    uint64_t num_merges = 0;
+    uint64_t num_cohorts = 0;
+    int num_active = 0;
+  };
+
+  // same as generate() but every sequence of the batch is decoded by the
+  // batch scheduler together with sequences from concurrent requests
+  std::vector<midi::Piece> generate_batched(midi::Status *status, midi::Piece *piece, midi::HyperParam *param, const std::shared_ptr<ModelMeta> &mm, CallbackManager *callbacks) {
+    data_structures::LOGGER(data_structures::VERBOSITY_LEVEL_DEBUG, "generate_batched");
+    param->set_temperature( std::max((double)param->temperature(), 1e-6) ); // CAN'T HAVE ZERO TEMPERATURE
+    std::vector<std::unique_ptr<SAMPLE_CONTROL>> scon = make_controls(status, piece, param, mm);
+    std::vector<std::vector<int>> seqs = std::vector<std::vector<int>>(param->batch_size(), scon[0]->prompt);
+    scon[0]->rep->show(scon[0]->prompt);
+
+    std::vector<SAMPLE_CONTROL*> rows;
+    std::vector<std::vector<int>*> row_seqs;
+    for (int i=0; i<param->batch_size(); i++) {
+      rows.push_back(scon[i].get());
+      row_seqs.push_back(&seqs[i]);
+    }
+    bool terminated = BATCH_SCHEDULER::instance().decode(rows, row_seqs, param, mm, callbacks);
+    return decode_generation(scon, seqs, status, param, terminated);
+  }
+
+}
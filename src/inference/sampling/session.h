@@ -0,0 +1,147 @@
+#pragma once
+
+#include <ATen/core/ivalue.h>
+#include <torch/script.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sampling {
+
+  class ModelMeta;
+
+  // returns the length of the longest common prefix of two token sequences
+  int common_prefix_length(const std::vector<int> &a, const std::vector<int> &b) {
+    int n = (int)std::min(a.size(), b.size());
+    int i = 0;
+    while ((i < n) && (a[i] == b[i])) {
+      i++;
+    }
+    return i;
+  }
+
+  // past_key_values is a tuple (one entry per layer) of (key, value) tensors
+  // with shape {batch, heads, seq, hidden}. this keeps the first n positions.
+  torch::jit::IValue truncate_state(const torch::jit::IValue &state, int64_t n) {
+    std::vector<torch::jit::IValue> layers;
+    for (const auto &layer : state.toTuple()->elements()) {
+      std::vector<torch::jit::IValue> kv;
+      for (const auto &t : layer.toTuple()->elements()) {
+        kv.push_back( t.toTensor().narrow(2, 0, n) );
+      }
+      layers.push_back( torch::ivalue::Tuple::create(kv) );
+    }
+    return torch::ivalue::Tuple::create(layers);
+  }
+
+  // number of positions held in a past_key_values state
+  int64_t state_length(const torch::jit::IValue &state) {
+    const auto &layers = state.toTuple()->elements();
+    if (layers.size() == 0) {
+      return 0;
+    }
+    return layers[0].toTuple()->elements()[0].toTensor().size(2);
+  }
+
+  // size in bytes of all tensors held in a past_key_values state
+  size_t state_nbytes(const torch::jit::IValue &state) {
+    size_t nbytes = 0;
+    for (const auto &layer : state.toTuple()->elements()) {
+      for (const auto &t : layer.toTuple()->elements()) {
+        nbytes += t.toTensor().nbytes();
+      }
+    }
+    return nbytes;
+  }
+
+  // Keeps the KV-cache of the last generation so that consecutive steps (or
+  // calls) sharing a token prefix only run the forward pass on the new suffix.
+  // A session is bound to a single model and is not thread-safe. The python
+  // bindings release the GIL while sampling, so they hold mutex() for the
+  // length of every call on the same session.
+  class InferenceSession {
+  public:
+    InferenceSession () {}
+
+    // sets up the model inputs for prompt, reusing the cached state where
+    // possible. returns the number of prompt tokens that were reused.
+    int prepare(const std::vector<int> &prompt, const std::shared_ptr<ModelMeta> &mm, std::vector<torch::jit::IValue> &inputs) {
+      inputs.clear();
+      int reused = 0;
+      if ((mm == model) && (tokens.size() > 0)) {
+        reused = common_prefix_length(prompt, tokens);
+        // at least one token must be fed to obtain the next logits
+        reused = std::min(reused, (int)prompt.size() - 1);
+      }
+      if (reused <= 0) {
+        return 0;
+      }
+      std::vector<int> suffix(prompt.begin() + reused, prompt.end());
+      auto opts = torch::TensorOptions().dtype(torch::kInt64);
+      inputs.push_back( torch::tensor(suffix, opts).view({1, -1}) );
+      inputs.push_back( truncate_state(state, reused) );
+      num_reused_tokens += reused;
+      num_prompt_tokens += prompt.size();
+      num_hits++;
+      return reused;
+    }
+
+    // record the prompt when it was not served from the cache
+    void record_miss(const std::vector<int> &prompt) {
+      num_prompt_tokens += prompt.size();
+      num_misses++;
+    }
+
+    // seq is the generated sequence. past holds the kv for its first n tokens
+    // (all of them once generation finished, otherwise all but the last)
+    void store(const std::vector<int> &seq, const torch::jit::IValue &past, const std::shared_ptr<ModelMeta> &mm) {
+      int64_t n = past.isTuple() ? state_length(past) : 0;
+      if ((n <= 0) || (n > (int64_t)seq.size())) {
+        reset();
+        return;
+      }
+      tokens.assign(seq.begin(), seq.begin() + n);
+      state = past;
+      model = mm;
+    }
+
+    void reset() {
+      tokens.clear();
+      state = torch::jit::IValue();
+      model = nullptr;
+    }
+
+    int cached_length() {
+      return (int)tokens.size();
+    }
+
+    std::mutex &mutex() {
+      return mtx;
+    }
+
+    std::map<std::string,double> stats() {
+      return {
+        {"hits", (double)num_hits},
+        {"misses", (double)num_misses},
+        {"reused_tokens", (double)num_reused_tokens},
+        {"prompt_tokens", (double)num_prompt_tokens},
+        {"cached_tokens", (double)tokens.size()},
+        {"cached_bytes", (double)(tokens.size() ? state_nbytes(state) : 0)}
+      };
+    }
+
+  private:
+    std::vector<int> tokens;
+    torch::jit::IValue state;
+    std::shared_ptr<ModelMeta> model;
+    uint64_t num_hits = 0;
+    uint64_t num_misses = 0;
+    uint64_t num_reused_tokens = 0;
+    uint64_t num_prompt_tokens = 0;
+    std::mutex mtx;
+  };
+
+}
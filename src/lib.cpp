@@ -11,6 +11,7 @@ namespace py = pybind11;
 
 #include "common/midi_parsing/midi_io.h"
 #include "./inference/dataset/jagged.h"
+#include "./inference/dataset/build_dataset.h"
 #include "./inference/enum/model_type.h"
 #include "./inference/enum/encoder_types.h"
 #include "./inference/sampling/control.h"
@@ -79,25 +80,36 @@ std::string select_random_segment_py(std::string json_string, int num_bars, int
 
 py::bytes midi_to_json_bytes(std::string &filepath, data_structures::TrainConfig *tc, std::string &metadata_labels) {
   std::string x;
-  midi::Piece p;
-  auto config = std::make_shared<data_structures::EncoderConfig>();
-  config->resolution = tc->resolution;
-  config->decode_resolution = tc->decode_resolution;
-  config->delta_resolution = tc->delta_resolution;
-  config->use_microtiming = tc->use_microtiming;
-  midi_io::ParseSong(filepath, &p, config);
-  util_protobuf::UpdateValidSegments(&p, tc->num_bars, tc->min_tracks);
-  if (!p.internal_valid_segments_size()) {
-    return py::bytes(x); // empty bytes
-  }
+  compression::midi_to_piece_bytes(filepath, tc, metadata_labels, &x);
+  return py::bytes(x); // empty bytes if there are no valid segments
+}
 
-  // insert metadata labels here
-  midi::MetadataLabels *ml = new midi::MetadataLabels();
-  google::protobuf::util::JsonStringToMessage(metadata_labels, ml);
-  p.set_allocated_internal_metadata_labels(ml);
+py::bytes midi_bytes_to_json_bytes(std::string_view midi_bytes, data_structures::TrainConfig *tc, std::string &metadata_labels) {
+  std::string x;
+  compression::midi_bytes_to_piece_bytes(midi_bytes, tc, metadata_labels, &x);
+  return py::bytes(x); // empty bytes if there are no valid segments
+}
 
-  p.SerializeToString(&x);
-  return py::bytes(x);
+// wraps the buffers of a flat batch in numpy arrays without copying. the
+// batch is read without the GIL
+template <typename T>
+py::tuple read_batch_numpy(compression::Jagged &jagged, int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc, int pad_value) {
+  auto b = std::make_unique<compression::Jagged::FLAT_BATCH<T>>();
+  {
+    py::gil_scoped_release release;
+    *b = jagged.read_flat_batch<T>(batch_size, split_id, et, tc, pad_value);
+  }
+  std::vector<py::ssize_t> shape = {b->rows, b->cols};
+  auto owner = b.get();
+  py::capsule capsule(b.release(), [](void *p) {
+    delete reinterpret_cast<compression::Jagged::FLAT_BATCH<T>*>(p);
+  });
+  return py::make_tuple(
+    py::array_t<T>(shape, owner->input_ids.data(), capsule),
+    py::array_t<T>(shape, owner->attention_mask.data(), capsule),
+    py::array_t<T>(shape, owner->labels.data(), capsule),
+    py::array_t<T>(shape, owner->position_ids.data(), capsule),
+    py::array_t<T>(shape, owner->document_ids.data(), capsule));
 }
 
 std::string json_bytes_to_string(py::bytes &json_bytes) {
@@ -122,7 +134,10 @@ PYBIND11_MODULE(midigpt,handle) {
   handle.def("getAttributeControlStr", &encoder::getAttributeControlStr);
 
 #ifndef NO_TORCH
-  handle.def("sample_multi_step", &sampling::sample_multi_step_py);
+  handle.def("sample_multi_step", [](std::string piece_json, std::string status_json, std::string param_json, int max_attempts, sampling::CallbackManager *callbacks) {
+    py::gil_scoped_release release; // allows concurrent requests to be batched
+    return sampling::sample_multi_step_py(piece_json, status_json, param_json, max_attempts, callbacks);
+  });
   handle.def("sample_multi_step_capture_output", [](std::string piece_json, std::string status_json, std::string param_json, int max_attempts, sampling::CallbackManager *callbacks) {
     py::scoped_ostream_redirect stream(
         std::cout,                               
@@ -131,13 +146,91 @@ PYBIND11_MODULE(midigpt,handle) {
     return sampling::sample_multi_step_py(piece_json, status_json, param_json, max_attempts, callbacks);
   });
   handle.def("get_notes", &sampling::get_notes_py);
+
+  // keeps the kv-cache between generation steps and calls
+  py::class_<sampling::InferenceSession>(handle, "InferenceSession")
+    .def(py::init<>())
+    .def("sample_multi_step", [](sampling::InferenceSession &session, std::string piece_json, std::string status_json, std::string param_json, int max_attempts, sampling::CallbackManager *callbacks) {
+      py::gil_scoped_release release; // allows concurrent requests to be batched
+      std::lock_guard<std::mutex> lock(session.mutex());
+      return sampling::sample_multi_step_py(piece_json, status_json, param_json, max_attempts, callbacks, &session);
+    })
+    .def("reset", [](sampling::InferenceSession &session) {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(session.mutex());
+      session.reset();
+    })
+    .def("cached_length", [](sampling::InferenceSession &session) {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(session.mutex());
+      return session.cached_length();
+    })
+    .def("stats", [](sampling::InferenceSession &session) {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(session.mutex());
+      return session.stats();
+    });
+
+  // model cache
+  handle.def("warm_model_cache", [](std::string ckpt) {
+    py::gil_scoped_release release;
+    sampling::MODEL_CACHE::instance().warm(ckpt);
+  });
+  handle.def("unload_model", [](std::string ckpt) {
+    return sampling::MODEL_CACHE::instance().unload(ckpt);
+  });
+  handle.def("clear_model_cache", []() {
+    sampling::MODEL_CACHE::instance().clear();
+  });
+  handle.def("set_model_cache_capacity", [](int n) {
+    sampling::MODEL_CACHE::instance().set_capacity(n);
+  });
+  handle.def("get_model_cache_stats", []() {
+    return sampling::MODEL_CACHE::instance().stats();
+  });
+  handle.def("reset_model_cache_stats", []() {
+    sampling::MODEL_CACHE::instance().reset_stats();
+  });
+
+  // continuous batching of concurrent requests
+  handle.def("set_continuous_batching", [](bool enable, int max_batch_size, int max_wait_ms) {
+    sampling::BATCH_SCHEDULER::instance().configure(enable, max_batch_size, max_wait_ms);
+  }, py::arg("enable"), py::arg("max_batch_size") = 8, py::arg("max_wait_ms") = 5);
+  handle.def("get_batching_stats", []() {
+    return sampling::BATCH_SCHEDULER::instance().stats();
+  });
+
+  // prompt prefix cache
+  handle.def("set_prefix_cache_budget", [](size_t nbytes) {
+    sampling::PREFIX_CACHE::instance().set_budget(nbytes);
+  });
+  handle.def("clear_prefix_cache", []() {
+    sampling::PREFIX_CACHE::instance().clear();
+  });
+  handle.def("get_prefix_cache_stats", []() {
+    return sampling::PREFIX_CACHE::instance().stats();
+  });
+  handle.def("reset_prefix_cache_stats", []() {
+    sampling::PREFIX_CACHE::instance().reset_stats();
+  });
 #endif
 
   handle.def("compute_all_attribute_controls", &encoder::compute_all_attribute_controls_py);
   handle.def("get_instruments_by_category", &enums::get_instruments_by_category);
   handle.def("get_instrument_and_track_type_from_gm_inst", &enums::get_instrument_and_track_type_from_gm_inst);
   handle.def("midi_to_json_bytes", &midi_to_json_bytes);
+  handle.def("midi_bytes_to_json_bytes", &midi_bytes_to_json_bytes);
   handle.def("json_bytes_to_string", &json_bytes_to_string);
+  handle.def("compute_features", py::overload_cast<std::string&,std::vector<std::string>&>(&feature_extraction::compute_features));
+  handle.def("compute_features_bytes", py::overload_cast<std::string_view,std::string,std::vector<std::string>&>(&feature_extraction::compute_features), py::arg("midi_bytes"), py::arg("name"), py::arg("feature_names"), py::call_guard<py::gil_scoped_release>());
+  handle.def("compute_features_batch", &feature_extraction::compute_features_batch, py::arg("filepaths"), py::arg("feature_names"), py::arg("num_threads")=1, py::call_guard<py::gil_scoped_release>());
+  handle.def("benchmark_midi_parser", &midi_io::benchmark_midi_parser, py::arg("paths"), py::arg("repeats")=5, py::call_guard<py::gil_scoped_release>());
+
+  py::enum_<enums::SAMPLING_MODE>(handle, "SAMPLING_MODE", py::arithmetic())
+    .value("SAMPLE_UNIFORM", enums::SAMPLING_MODE::SAMPLE_UNIFORM)
+    .value("SAMPLE_EPOCH", enums::SAMPLING_MODE::SAMPLE_EPOCH)
+    .value("SAMPLE_WEIGHTED", enums::SAMPLING_MODE::SAMPLE_WEIGHTED)
+    .export_values();
 
   py::enum_<enums::MODEL_TYPE>(handle, "MODEL_TYPE", py::arithmetic())
     .value("TRACK_MODEL", enums::MODEL_TYPE::TRACK_MODEL)
@@ -151,18 +244,50 @@ PYBIND11_MODULE(midigpt,handle) {
     .def("set_min_tracks", &compression::Jagged::set_min_tracks)
     .def("set_max_tracks", &compression::Jagged::set_max_tracks)
     .def("set_max_seq_len", &compression::Jagged::set_max_seq_len)
+    .def("set_use_mmap", &compression::Jagged::set_use_mmap)
+    .def("set_packing", &compression::Jagged::set_packing)
+    .def("set_sampling", &compression::Jagged::set_sampling)
+    .def("get_epoch", &compression::Jagged::get_epoch)
     .def("enable_write", &compression::Jagged::enable_write)
     .def("enable_read", &compression::Jagged::enable_read)
-    .def("append", &compression::Jagged::append)
+    .def("append", &compression::Jagged::append, py::arg("s"), py::arg("split_id"), py::arg("num_segments")=0)
     .def("read", &compression::Jagged::read)
     .def("read_bytes", &compression::Jagged::read_bytes)
     .def("read_json", &compression::Jagged::read_json)
-    .def("read_batch", &compression::Jagged::read_batch)
+    .def("read_batch", &compression::Jagged::read_batch, py::call_guard<py::gil_scoped_release>())
+    .def("read_batch_numpy", [](compression::Jagged &jagged, int batch_size, size_t split_id, enums::ENCODER_TYPE et, data_structures::TrainConfig *tc, int pad_value, bool int64) {
+      if (int64) {
+        return read_batch_numpy<int64_t>(jagged, batch_size, split_id, et, tc, pad_value);
+      }
+      return read_batch_numpy<int32_t>(jagged, batch_size, split_id, et, tc, pad_value);
+    }, py::arg("batch_size"), py::arg("split_id"), py::arg("encoder_type"), py::arg("tc"), py::arg("pad_value")=-100, py::arg("int64")=true)
+    .def("set_prefetch", &compression::Jagged::set_prefetch, py::arg("num_workers"), py::arg("depth")=4)
+    .def("stop_prefetch", &compression::Jagged::stop_prefetch, py::call_guard<py::gil_scoped_release>())
+    .def("get_prefetch_stats", &compression::Jagged::get_prefetch_stats)
+    .def("get_packing_stats", &compression::Jagged::get_packing_stats)
+    .def("reset_packing_stats", &compression::Jagged::reset_packing_stats)
     .def("load_random_piece", &compression::Jagged::load_random_piece_py)
     .def("load_piece", &compression::Jagged::load_piece)
     .def("close", &compression::Jagged::close)
     .def("get_size", &compression::Jagged::get_size)
-    .def("get_split_size", &compression::Jagged::get_split_size);
+    .def("get_split_size", &compression::Jagged::get_split_size)
+    .def("is_token_shard", &compression::Jagged::is_token_shard)
+    .def("set_lz4_dictionary", &compression::Jagged::set_lz4_dictionary)
+    .def("get_lz4_dictionary", [](compression::Jagged &jagged) {
+      return py::bytes(jagged.get_lz4_dictionary());
+    })
+    .def("benchmark_lz4", &compression::Jagged::benchmark_lz4, py::arg("dictionary"), py::arg("split_id")=0, py::arg("num_records")=1000, py::arg("repeats")=10, py::call_guard<py::gil_scoped_release>());
+
+  handle.def("build_dataset", &compression::build_dataset, py::arg("paths"), py::arg("split_ids"), py::arg("metadata_labels"), py::arg("tc"), py::arg("output"), py::arg("num_threads")=8, py::arg("resume")=false, py::arg("dedup")=false, py::arg("lz4_dictionary")=std::string(), py::call_guard<py::gil_scoped_release>());
+  handle.def("train_lz4_dictionary", [](const std::vector<std::string> &samples, size_t dict_size, size_t segment_size) {
+    std::string d;
+    {
+      py::gil_scoped_release release;
+      d = compression::train_lz4_dictionary(samples, dict_size, segment_size);
+    }
+    return py::bytes(d);
+  }, py::arg("samples"), py::arg("dict_size")=65536, py::arg("segment_size")=256);
+  handle.def("build_token_shard", &compression::build_token_shard, py::arg("src_path"), py::arg("dst_path"), py::arg("encoder_type"), py::arg("min_tracks"), py::arg("num_bars")=std::vector<int>(), py::call_guard<py::gil_scoped_release>());
 
   py::class_<data_structures::TrainConfig>(handle, "TrainConfig")
     .def(py::init<>())
@@ -191,6 +316,7 @@ PYBIND11_MODULE(midigpt,handle) {
     .def_readonly("vocab_size", &encoder::REPRESENTATION::vocab_size)
     .def("get_type_mask", &encoder::REPRESENTATION::get_type_mask)
     .def("max_token", &encoder::REPRESENTATION::max_token)
+    .def("benchmark_lookups", &encoder::REPRESENTATION::benchmark_lookups)
     .def_readonly("token_domains", &encoder::REPRESENTATION::token_domains);
   
   py::class_<encoder::TOKEN_DOMAIN>(handle, "TOKEN_DOMAIN")
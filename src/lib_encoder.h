@@ -10,16 +10,24 @@ void init_encoders(py::module &handle) {
 
   py::class_<encoder::ExpressiveEncoder>(handle, "ExpressiveEncoder")
     .def(py::init<>())
-    .def("encode", &encoder::ExpressiveEncoder::encode)
-    .def("decode", &encoder::ExpressiveEncoder::decode)
+    .def("encode", py::overload_cast<midi::Piece*>(&encoder::ExpressiveEncoder::encode))
+    .def("decode", py::overload_cast<std::vector<int>&,midi::Piece*>(&encoder::ExpressiveEncoder::decode))
     .def("midi_to_json", &encoder::ExpressiveEncoder::midi_to_json)
     .def("midi_to_tokens", &encoder::ExpressiveEncoder::midi_to_tokens)
+    .def("midi_bytes_to_json", &encoder::ExpressiveEncoder::midi_bytes_to_json)
+    .def("midi_bytes_to_tokens", &encoder::ExpressiveEncoder::midi_bytes_to_tokens)
     .def("json_to_midi", &encoder::ExpressiveEncoder::json_to_midi)
+    .def("json_to_midi_bytes", [](encoder::ExpressiveEncoder &e, std::string &json_string) {
+      return py::bytes(e.json_to_midi_bytes(json_string));
+    })
     .def("json_track_to_midi", &encoder::ExpressiveEncoder::json_track_to_midi)
     .def("json_to_tokens", &encoder::ExpressiveEncoder::json_to_tokens)
     .def("tokens_to_json", &encoder::ExpressiveEncoder::tokens_to_json)
     .def("resample_delta_json", &encoder::ExpressiveEncoder::resample_delta_json)
     .def("tokens_to_midi", &encoder::ExpressiveEncoder::tokens_to_midi)
+    .def("tokens_to_midi_bytes", [](encoder::ExpressiveEncoder &e, std::vector<int> &tokens) {
+      return py::bytes(e.tokens_to_midi_bytes(tokens));
+    })
     .def("pretty", &encoder::ExpressiveEncoder::pretty)
     .def("vocab_size", &encoder::ExpressiveEncoder::vocab_size)
     .def("get_attribute_control_types", &encoder::ExpressiveEncoder::get_attribute_control_types)